@@ -1,4 +1,5 @@
 import argparse
+import os
 
 default_config = dict(
     tunerpath='.',
@@ -18,11 +19,24 @@ arg_parser.add_argument("--graph_profile",
 arg_parser.add_argument("--flat_profile",
         default=default_config['flat_profile'],
         help="path to loop-prof.flat.csv")
+arg_parser.add_argument("--packed_profile",
+        help="path to loop-prof.pack, read instead of the flat and graph profiles if it exists (default: next to the flat profile)")
+arg_parser.add_argument("--edge_profile",
+        help="path to loop-prof.edges.csv, to lay out the blocks along their hottest edges before extracting the loops if it exists (default: next to the flat profile)")
 arg_parser.add_argument("--makefile",
         default=default_config['makefile'],
         help="path to makefile")
+arg_parser.add_argument("--specialize",
+        action="store_true",
+        help="specialize the loops for their usual values (loop-prof.values.csv) before tuning")
 arg_parser.add_argument("--run-rule",
         default=default_config['run_rule'],
         help="rule in makefile to run the executable")
 config = arg_parser.parse_args()
+if config.packed_profile is None:
+    config.packed_profile = os.path.join(
+            os.path.dirname(config.flat_profile), 'loop-prof.pack')
+if config.edge_profile is None:
+    config.edge_profile = os.path.join(
+            os.path.dirname(config.flat_profile), 'loop-prof.edges.csv')
 
@@ -20,6 +20,15 @@ endif
 ifndef MODULES
     MODULES=$(TARGET).bc
 endif
+# e.g. -thread-local or -exact-timing
+ifndef INSTRUMENT_FLAGS
+    INSTRUMENT_FLAGS =
+endif
+# instrument all modules in one run of `instrument-loops`, this many at once
+# (0: one per core); unset to run it once per module
+ifndef INSTRUMENT_JOBS
+    INSTRUMENT_JOBS =
+endif
 BIN_DIR = $(LEVEL)/bin
 OBJ_DIR = $(LEVEL)/obj
 EXE = $(TARGET)
@@ -37,10 +46,11 @@ LINK = $(CXX)
 
 OS := $(shell sh -c 'uname -s 2>/dev/null || echo not')
 ifneq ($(OS),Darwin)
-	LIBS += -lrt
+	LIBS += -lrt -lpthread -ldl
 endif
 
-PROF_OUT = loop-prof.flat.csv loop-prof.graph.data loop_prof.out
+PROF_OUT = loop-prof.flat.csv loop-prof.graph.data loop-prof.cct.data loop-prof.info \
+	loop-prof.hist.csv loop-prof.edges.csv loop-prof.values.csv loop-prof.pack
 
 .PRECIOUS: %.bc
 
@@ -56,8 +66,17 @@ $(SRCDIR)/%.bc: $(SRCDIR)/%.cpp
 $(SRCDIR)/%.o: $(SRCDIR)/%.bc
 	llc -filetype=obj $< -o $@
 
+ifeq ($(INSTRUMENT_JOBS),)
 $(SRCDIR)/%-prof.bc: $(SRCDIR)/%.bc
-	$(BIN_DIR)/instrument-loops $< -o $@
+	$(BIN_DIR)/instrument-loops $(INSTRUMENT_FLAGS) $< -o $@
+else
+$(INSTRUMENTED_MODS): loop-prof.batch ;
+
+loop-prof.batch: $(MODULES)
+	printf '%s %s\n' $(foreach m,$(MODULES),$(m) $(m:%.bc=%-prof.bc)) > $@.tmp
+	$(BIN_DIR)/instrument-loops $(INSTRUMENT_FLAGS) -batch $@.tmp -j $(INSTRUMENT_JOBS)
+	mv $@.tmp $@
+endif
 
 $(SRCDIR)/$(TARGET)-prof-bc.o: $(INSTRUMENTED_MODS) $(OBJ_DIR)/prof.bc
 	$(LINK) $^ -o - | llc -filetype=obj -o $@
@@ -66,5 +85,6 @@ $(EXE): $(OBJ)
 	$(CXX) $^ $(LIBS) -o $@
 
 clean:
-	rm -f $(EXE) $(OBJ) $(MODULES) $(INSTRUMENTED_MODS) $(PROF_OUT)
+	rm -f $(EXE) $(OBJ) $(MODULES) $(INSTRUMENTED_MODS) loop-prof.batch $(PROF_OUT) $(addsuffix .*,$(PROF_OUT))
+	rm -rf loop-prof.procs
 
@@ -0,0 +1,133 @@
+'''
+Reader of `loop-prof.pack`, the flat, graph and context profiles in one file
+(see src/ProfileFormat.h).  The file is mapped, not read: its tables are numpy
+arrays over the mapping, so nothing is parsed or copied until it's used.
+
+    pack = PackedProfile('loop-prof.pack')
+    hot = pack.nodes[pack.nodes['time'] > 1]
+    pack.string(hot[0]['function']), pack.columns.get('cycles')
+'''
+import mmap
+import numpy as np
+
+MAGIC = b'LOOPPACK'
+VERSION = 2
+
+# section kinds
+STRINGS, NODES, EDGES, CONTEXTS, COLUMN = range(1, 6)
+
+# in the byte order of the machine that wrote the file, as its reader
+HEADER = np.dtype([
+    ('magic', 'S8'),
+    ('version', '=u4'),
+    ('num_sections', '=u4'),
+    ('file_size', '=u8')])
+
+SECTION = np.dtype([
+    ('kind', '=u4'),
+    ('entry_size', '=u4'),
+    ('name', '=u4'),
+    ('reserved', '=u4'),
+    ('offset', '=u8'),
+    ('count', '=u8')])
+
+NODE = np.dtype([
+    # offsets of the names, see `PackedProfile.string`
+    ('module', '=u4'),
+    ('function', '=u4'),
+    ('header_id', '=u4'),
+    ('parent_id', '=u4'),
+    ('fingerprint', '=u8'),
+    ('runs', '=u8'),
+    ('samples', '=u8'),
+    ('time', '=f4'),
+    ('time_ms', '=f4'),
+    ('time_lo', '=f4'),
+    ('time_hi', '=f4')])
+
+EDGE = np.dtype([
+    ('from', '=u4'),
+    ('to', '=u4'),
+    ('freq', '=u8')])
+
+CONTEXT = np.dtype([
+    ('parent', '=u4'),
+    ('node', '=u4'),
+    ('inclusive', '=u8'),
+    ('exclusive', '=u8')])
+
+TABLES = {NODES: NODE, EDGES: EDGE, CONTEXTS: CONTEXT}
+
+
+# `dtype` padded to the entry size of the file, which later versions may grow
+def with_entry_size(dtype, entry_size):
+    if entry_size < dtype.itemsize:
+        raise ValueError('entries of %d bytes, expected %d' %
+                (entry_size, dtype.itemsize))
+    return np.dtype({
+        'names': dtype.names,
+        'formats': [dtype.fields[name][0] for name in dtype.names],
+        'offsets': [dtype.fields[name][1] for name in dtype.names],
+        'itemsize': entry_size})
+
+
+class PackedProfile(object):
+    '''
+    A mapped pack: `nodes` (the rows of the flat profile), `edges` (sorted
+    by source, then destination) and `contexts` are structured arrays,
+    `columns` maps the names of the other flat columns to arrays by node.
+    '''
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        header = np.frombuffer(self._map, HEADER, count=1)[0]
+        if header['magic'] != MAGIC or header['version'] != VERSION or \
+                header['file_size'] != len(self._map):
+            raise ValueError('%s is not a loop profile pack of version %d' %
+                    (path, VERSION))
+        sections = np.frombuffer(self._map, SECTION,
+                count=int(header['num_sections']), offset=HEADER.itemsize)
+
+        tables = {}
+        named = []
+        for section in sections:
+            kind = int(section['kind'])
+            offset, count = int(section['offset']), int(section['count'])
+            if kind == STRINGS:
+                self._strings = (offset, count)
+            elif kind in TABLES:
+                dtype = with_entry_size(TABLES[kind],
+                        int(section['entry_size']))
+                tables[kind] = np.frombuffer(self._map, dtype, count=count,
+                        offset=offset)
+            elif kind == COLUMN:
+                named.append((int(section['name']),
+                    np.frombuffer(self._map, '=f8', count=count,
+                        offset=offset)))
+        self.nodes = tables[NODES]
+        self.edges = tables[EDGES]
+        self.contexts = tables[CONTEXTS]
+        self._names = {}
+        self.columns = dict((self.string(name), values)
+                for name, values in named)
+
+    # the string at `offset` in the strings of the pack
+    def string(self, offset):
+        offset = int(offset)
+        name = self._names.get(offset)
+        if name is None:
+            begin, size = self._strings
+            if offset >= size:
+                return ''
+            end = self._map.find(b'\0', begin + offset)
+            name = self._map[begin + offset:end]
+            if not isinstance(name, str):
+                name = name.decode()
+            self._names[offset] = name
+        return name
+
+    # the edges from node `src`
+    def edges_from(self, src):
+        sources = self.edges['from']
+        return self.edges[np.searchsorted(sources, src, 'left'):
+                np.searchsorted(sources, src, 'right')]
@@ -8,6 +8,7 @@
 // This file implements the following classes:
 // + LoopHeader: representing a single loop and its enclosing function
 // + LoopCallProfile: describing a loop->loop and loop->function call profile
+//   and the calling context tree of loops and functions
 // 
 //===----------------------------------------------------------------------===//
 
@@ -16,10 +17,12 @@
 #include <fstream>	// std::ofstream
 #include <iostream>	// std::cout
 #include <sstream>	// std::istringstream
+#include <cstdlib>	// std::atof, std::strtoull
 #include <assert.h>
 
 #include "LoopCallProfile.h"
 #include "LoopName.h"
+#include "ProfileFormat.h"
 
 //===----------------------------------------------------------------------===//
 // Command line flag to control debugging info for profiles
@@ -34,35 +37,191 @@ ProfileDebugLevel("prof-debug",
 			     clEnumVal(Pretty,   "pretty-print profile data"),
 			     clEnumValEnd));
 
+cl::opt<std::string>
+ProfilePrefix("prof-prefix",
+              cl::desc("Prefix (e.g. directory) of the profile files"),
+              cl::init(""));
+
 //===----------------------------------------------------------------------===//
 
+// Is `Name` a column of every flat profile, read into a LoopHeader or its
+// NodeStats?
+static bool isStatsColumn(const std::string& Name)
+{
+  static const char *const Names[] = {
+      "module",  "function",  "header-id", "parent-id",
+      "fingerprint", "runs",  "time(pct)", "time(ms)",
+      "samples", "time-lo(pct)", "time-hi(pct)"};
+  return std::find(std::begin(Names), std::end(Names), Name) !=
+         std::end(Names);
+}
+
+// Do the values of extra column `Name` add up over runs, rather than
+// average out?
+static bool isCountColumn(const std::string& Name)
+{
+  static const char *const Names[] = {"calls", "cycles", "on-cpu(ms)",
+                                      "off-cpu(ms)", "mem-samples"};
+  return std::find(std::begin(Names), std::end(Names), Name) !=
+         std::end(Names);
+}
+
+unsigned
+LoopCallProfile::getExtraColumn(const std::string& Name)
+{
+  for (unsigned i = 0, e = ExtraColumns.size(); i != e; i++)
+    if (ExtraColumns[i].Name == Name)
+      return i;
+  ExtraColumns.push_back({Name, std::vector<double>(), 0});
+  return ExtraColumns.size() - 1;
+}
+
 void
 LoopCallProfile::readGraphNodeMetaData(const std::string& MetaFileName)
 {
   std::ifstream Fin(MetaFileName.c_str());
   std::string Line;
-  std::vector<LoopHeader>& Nodes = this->CGNodes;
-
-  // skip header
+  // find the columns with statistics, which vary between profiles; the
+  // extra ones are kept as they are (by index in the row, and in
+  // `ExtraColumns`)
   std::getline(Fin, Line);
-  unsigned nodeNum = 0;
+  std::map<std::string, unsigned> Columns;
+  std::vector<std::pair<unsigned, unsigned>> Extra;
+  std::istringstream Header(Line);
+  for (std::string Column; std::getline(Header, Column, ',');) {
+    if (!isStatsColumn(Column))
+      Extra.emplace_back(Columns.size(), getExtraColumn(Column));
+    Columns.emplace(Column, Columns.size());
+  }
+  unsigned Base = CGNodes.size();
+
+  // the header id of the enclosing loop of each row, resolved into
+  // paths once all of them are read
+  std::vector<LoopHeader> Nodes;
+  std::vector<NodeStats> NodeStatsRead;
+  std::vector<unsigned> ParentIds;
   while (std::getline(Fin, Line)) {
     LoopHeader Node;
     std::istringstream Fields(Line);
     std::getline(Fields, Node.ModuleName, ',');
     std::getline(Fields, Node.Function, ',');
     Fields >> Node.HeaderId;
-    
-    Nodes.emplace_back(Node);
-    
-    // Record LoopName info for each entry in the file and map func name to idx
-    IdToLoopNameMap.emplace(nodeNum, 
-	      new LoopName(Node.ModuleName, Node.Function, Node.HeaderId));
-    if (isFunction(Node.HeaderId))
-      FuncNameToIdMap[Node.Function] = nodeNum;
 
-    nodeNum++;
+    std::vector<std::string> Values;
+    std::istringstream AllFields(Line);
+    for (std::string Value; std::getline(AllFields, Value, ',');)
+      Values.push_back(Value);
+    auto getColumn = [&](const char *Name, float Default) -> float {
+      auto It = Columns.find(Name);
+      if (It == Columns.end() || It->second >= Values.size())
+        return Default;
+      return std::atof(Values[It->second].c_str());
+    };
+    // counts may be beyond what a float holds exactly
+    auto getCount = [&](const char *Name) -> uint64_t {
+      auto It = Columns.find(Name);
+      if (It == Columns.end() || It->second >= Values.size())
+        return 0;
+      return std::strtoull(Values[It->second].c_str(), nullptr, 10);
+    };
+    auto FP = Columns.find("fingerprint");
+    if (FP != Columns.end() && FP->second < Values.size())
+      Node.Fingerprint = parseFingerprint(Values[FP->second]);
+
+    NodeStats NS;
+    NS.Runs = getCount("runs");
+    NS.Time = getColumn("time(pct)", 0);
+    NS.TimeMs = getColumn("time(ms)", 0);
+    NS.TimeLo = getColumn("time-lo(pct)", NS.Time);
+    NS.TimeHi = getColumn("time-hi(pct)", NS.Time);
+    NS.Samples = getCount("samples");
+    Nodes.push_back(Node);
+    NodeStatsRead.push_back(NS);
+    ParentIds.push_back(getColumn("parent-id", 0));
+    for (auto& Col : Extra) {
+      std::vector<double>& ColValues = ExtraColumns[Col.second].Values;
+      ColValues.resize(Base + Nodes.size(), 0);
+      if (Col.first < Values.size())
+        ColValues.back() = std::atof(Values[Col.first].c_str());
+    }
+  }
+  addNodes(Nodes, NodeStatsRead, ParentIds);
+}
+
+void
+LoopCallProfile::addNodes(std::vector<LoopHeader>& Nodes,
+                          const std::vector<NodeStats>& NodeStatsRead,
+                          const std::vector<unsigned>& ParentIds)
+{
+  std::map<LoopName, unsigned, LoopNameComp> Rows;
+  for (unsigned i = 0, e = Nodes.size(); i != e; i++)
+    Rows.emplace(LoopName(Nodes[i].ModuleName, Nodes[i].Function,
+                          Nodes[i].HeaderId), i);
+  for (unsigned i = 0, e = Nodes.size(); i != e; i++) {
+    // walk up the enclosing loops, giving up on a broken chain
+    std::vector<unsigned>& Outer = Nodes[i].OuterIds;
+    for (unsigned j = i; ParentIds[j] != 0 && Outer.size() < e;) {
+      auto It = Rows.find(LoopName(Nodes[i].ModuleName, Nodes[i].Function,
+                                   ParentIds[j]));
+      if (It == Rows.end())
+        break;
+      Outer.insert(Outer.begin(), ParentIds[j]);
+      j = It->second;
+    }
+    addNode(Nodes[i], NodeStatsRead[i]);
+  }
+}
+
+unsigned
+LoopCallProfile::addNode(const LoopHeader& Node, const NodeStats& NS)
+{
+  unsigned nodeNum = CGNodes.size();
+  CGNodes.push_back(Node);
+  Stats.push_back(NS);
+
+  // Record LoopName info for each entry in the file and map func name to idx
+  LoopName *LN = new LoopName(Node.ModuleName, Node.Function, Node.HeaderId,
+                              Node.OuterIds, Node.Fingerprint);
+  IdToLoopNameMap.emplace(nodeNum, LN);
+  NodeIds.emplace(*LN, nodeNum);
+  if (Node.Fingerprint) {
+    auto Inserted = FingerprintIds.emplace(
+        std::make_pair(Node.ModuleName + ':' + Node.Function, Node.Fingerprint),
+        nodeNum);
+    if (!Inserted.second)
+      Inserted.first->second = UINT_MAX;
+  }
+  if (isFunction(Node.HeaderId))
+    FuncNameToIdMap[Node.Function] = nodeNum;
+  return nodeNum;
+}
+
+bool
+LoopCallProfile::hasUniqueFingerprint(const LoopHeader& Node) const
+{
+  auto It = FingerprintIds.find(
+      std::make_pair(Node.ModuleName + ':' + Node.Function, Node.Fingerprint));
+  return It != FingerprintIds.end() && It->second != UINT_MAX;
+}
+
+unsigned
+LoopCallProfile::findNode(const LoopHeader& Node, bool ByFingerprint) const
+{
+  if (ByFingerprint && Node.Fingerprint) {
+    auto It = FingerprintIds.find(
+        std::make_pair(Node.ModuleName + ':' + Node.Function, Node.Fingerprint));
+    if (It != FingerprintIds.end() && It->second != UINT_MAX)
+      return It->second;
   }
+  auto It = NodeIds.find(LoopName(Node.ModuleName, Node.Function,
+                                  Node.HeaderId));
+  if (It == NodeIds.end())
+    return UINT_MAX;
+  // in another build, the same header id may be another loop
+  uint64_t Fingerprint = CGNodes[It->second].Fingerprint;
+  if (Node.Fingerprint && Fingerprint && Fingerprint != Node.Fingerprint)
+    return UINT_MAX;
+  return It->second;
 }
 
 void
@@ -106,10 +265,279 @@ LoopCallProfile::readProfileData(const std::string& ProfileFileName)
 }
 
 void
-LoopCallProfile::readProfiles()
+LoopCallProfile::readContextData(const std::string& ContextFileName)
+{
+  std::ifstream In;
+  In.open(ContextFileName, std::ios::binary|std::ios::in);
+  ContextBuf Buf;
+  while (Buf.readFrom(In)) {
+    if (!Contexts.empty() && Buf.Parent >= Contexts.size()) {
+      std::cerr << "Malformed calling context tree in " << ContextFileName
+                << std::endl;
+      Contexts.clear();
+      break;
+    }
+    addContext(Buf.Parent, Buf.Node, Buf.Inclusive, Buf.Exclusive);
+  }
+  In.close();
+}
+
+bool
+LoopCallProfile::readPack(const std::string& PackFileName)
+{
+  PackedProfile Pack;
+  if (!Pack.open(PackFileName))
+    return false;
+
+  unsigned NumNodes = Pack.getNumNodes();
+  std::vector<LoopHeader> Nodes(NumNodes);
+  std::vector<NodeStats> NodeStatsRead(NumNodes);
+  std::vector<unsigned> ParentIds(NumNodes);
+  for (unsigned i = 0; i != NumNodes; i++) {
+    const PackNode& PN = Pack.getNode(i);
+    LoopHeader& Node = Nodes[i];
+    Node.ModuleName = Pack.getString(PN.Module);
+    Node.Function = Pack.getString(PN.Function);
+    Node.HeaderId = PN.HeaderId;
+    Node.Fingerprint = PN.Fingerprint;
+    NodeStats& NS = NodeStatsRead[i];
+    NS.Runs = PN.Runs;
+    NS.Samples = PN.Samples;
+    NS.Time = PN.Time;
+    NS.TimeMs = PN.TimeMs;
+    NS.TimeLo = PN.TimeLo;
+    NS.TimeHi = PN.TimeHi;
+    ParentIds[i] = PN.ParentId;
+  }
+  addNodes(Nodes, NodeStatsRead, ParentIds);
+  for (const std::string& Name : Pack.getColumnNames()) {
+    const double *Values = Pack.getColumn(Name);
+    ExtraColumns[getExtraColumn(Name)].Values.assign(Values,
+                                                     Values + NumNodes);
+  }
+
+  for (unsigned i = 0, e = Pack.getNumEdges(); i != e; i++) {
+    const PackEdge& PE = Pack.getEdge(i);
+    if (PE.From >= NumNodes || PE.To >= NumNodes)
+      continue;
+    getFreq(PE.From, PE.To) = PE.Freq;
+    getNested(PE.From).emplace(PE.To);
+  }
+
+  for (unsigned i = 0, e = Pack.getNumContexts(); i != e; i++) {
+    const PackContext& PC = Pack.getContext(i);
+    if (!Contexts.empty() && PC.Parent >= Contexts.size()) {
+      std::cerr << "Malformed calling context tree in " << PackFileName
+                << std::endl;
+      Contexts.clear();
+      break;
+    }
+    addContext(PC.Parent, PC.Node, PC.Inclusive, PC.Exclusive);
+  }
+  return true;
+}
+
+void
+LoopCallProfile::readProfiles(const std::string& Prefix, unsigned Snapshot)
+{
+  if (!readPack(getFileName(Prefix, PackFileName, Snapshot))) {
+    readGraphNodeMetaData(getFileName(Prefix, MetadataFileName, Snapshot));
+    readProfileData(getFileName(Prefix, ProfileFileName, Snapshot));
+    // older profiles come without one
+    readContextData(getFileName(Prefix, ContextFileName, Snapshot));
+  }
+  if (!CGNodes.empty()) {
+    TotalWeight = 1;
+    for (ExtraColumn& Col : ExtraColumns)
+      Col.Weight = 1;
+  }
+}
+
+void
+LoopCallProfile::writeProfiles(const std::string& Prefix)
+{
+  std::ofstream Flat(Prefix + MetadataFileName);
+  Flat << "module,function,header-id,parent-id,fingerprint,runs,time(pct),"
+          "time(ms),samples,time-lo(pct),time-hi(pct)";
+  for (const ExtraColumn& Col : ExtraColumns)
+    Flat << ',' << Col.Name;
+  Flat << '\n';
+  for (unsigned i = 0, e = CGNodes.size(); i != e; i++) {
+    const LoopHeader& LH = CGNodes[i];
+    const NodeStats& NS = Stats[i];
+    Flat << LH.ModuleName << ',' << LH.Function << ',' << LH.HeaderId << ','
+         << LH.getParentId() << ',' << formatFingerprint(LH.Fingerprint)
+         << ',' << NS.Runs << ',' << NS.Time << ',' << NS.TimeMs << ','
+         << NS.Samples << ',' << NS.TimeLo << ',' << NS.TimeHi;
+    // cycle counts take more digits than the shares
+    std::streamsize Precision = Flat.precision(15);
+    for (const ExtraColumn& Col : ExtraColumns)
+      Flat << ',' << (i < Col.Values.size() ? Col.Values[i] : 0);
+    Flat.precision(Precision);
+    Flat << '\n';
+  }
+  Flat.close();
+
+  dump(Prefix + ProfileFileName);
+  if (!Contexts.empty())
+    dumpContexts(Prefix + ContextFileName);
+
+  PackWriter Pack;
+  for (unsigned i = 0, e = CGNodes.size(); i != e; i++) {
+    const LoopHeader& LH = CGNodes[i];
+    const NodeStats& NS = Stats[i];
+    Pack.addNode(LH.ModuleName, LH.Function,
+                 {0, 0, LH.HeaderId, LH.getParentId(), LH.Fingerprint,
+                  NS.Runs, NS.Samples, NS.Time, NS.TimeMs, NS.TimeLo,
+                  NS.TimeHi});
+  }
+  for (const ExtraColumn& Col : ExtraColumns)
+    for (unsigned i = 0, e = Col.Values.size(); i != e; i++)
+      Pack.setColumn(Col.Name, i, Col.Values[i]);
+  for (const auto& Pair : M)
+    Pack.addEdge(Pair.first.first, Pair.first.second, Pair.second);
+  for (const Context& Ctx : Contexts)
+    Pack.addContext(Ctx.Parent, Ctx.Node, Ctx.Inclusive, Ctx.Exclusive);
+  if (!Pack.write(Prefix + PackFileName))
+    std::cerr << "Cannot write " << Prefix + PackFileName << std::endl;
+}
+
+void
+LoopCallProfile::merge(const LoopCallProfile& Other, double Weight,
+                       double ShareWeight)
+{
+  if (ShareWeight < 0)
+    ShareWeight = Weight;
+  if (Other.CGNodes.empty() || Weight <= 0 || ShareWeight <= 0)
+    return;
+
+  // Time shares are weighted means: scale down what is here before adding
+  // the other profile's share, so nodes missing from either get diluted
+  double Total = TotalWeight + ShareWeight;
+  for (NodeStats& NS : Stats) {
+    NS.Time *= TotalWeight / Total;
+    NS.TimeLo *= TotalWeight / Total;
+    NS.TimeHi *= TotalWeight / Total;
+  }
+  TotalWeight = Total;
+
+  // the same for the extra columns the other profile has, unless they are
+  // counts; `Scales` weighs its values
+  std::vector<unsigned> ColumnMap;
+  std::vector<double> Scales;
+  for (const ExtraColumn& Col : Other.ExtraColumns) {
+    ExtraColumn& To = ExtraColumns[getExtraColumn(Col.Name)];
+    double ColumnTotal = To.Weight + ShareWeight;
+    if (isCountColumn(Col.Name)) {
+      Scales.push_back(Weight);
+    } else {
+      for (double& Value : To.Values)
+        Value *= To.Weight / ColumnTotal;
+      Scales.push_back(ShareWeight / ColumnTotal);
+    }
+    To.Weight = ColumnTotal;
+    ColumnMap.push_back(&To - ExtraColumns.data());
+  }
+
+  // map the other profile's node ids to ours.  Loops are matched by
+  // fingerprint first, so profiles of different builds line up; those
+  // keep the header ids of the profile merged first.  A fingerprint that
+  // loops of a function share in either profile matches none of them.
+  std::vector<unsigned> NodeMap;
+  for (unsigned i = 0, e = Other.CGNodes.size(); i != e; i++) {
+    const LoopHeader& LH = Other.CGNodes[i];
+    unsigned Id = findNode(LH, !LH.Fingerprint ||
+                                   Other.hasUniqueFingerprint(LH));
+    if (Id == UINT_MAX)
+      Id = addNode(LH, NodeStats());
+    NodeMap.push_back(Id);
+
+    const NodeStats& From = Other.Stats[i];
+    NodeStats& To = Stats[Id];
+    To.Runs += From.Runs * Weight + 0.5;
+    To.Samples += From.Samples * Weight + 0.5;
+    To.TimeMs += From.TimeMs * Weight;
+    To.Time += From.Time * ShareWeight / Total;
+    To.TimeLo += From.TimeLo * ShareWeight / Total;
+    To.TimeHi += From.TimeHi * ShareWeight / Total;
+
+    for (unsigned c = 0, ce = ColumnMap.size(); c != ce; c++) {
+      const std::vector<double>& FromValues = Other.ExtraColumns[c].Values;
+      std::vector<double>& ToValues = ExtraColumns[ColumnMap[c]].Values;
+      if (i >= FromValues.size())
+        continue;
+      if (ToValues.size() <= Id)
+        ToValues.resize(Id + 1, 0);
+      ToValues[Id] += FromValues[i] * Scales[c];
+    }
+  }
+
+  for (const auto& Pair : Other.M) {
+    if (Pair.first.first >= NodeMap.size() ||
+        Pair.first.second >= NodeMap.size())
+      continue;
+    unsigned From = NodeMap[Pair.first.first], To = NodeMap[Pair.first.second];
+    getFreq(From, To) += Pair.second * Weight + 0.5;
+    getNested(From).emplace(To);
+  }
+
+  // merge the calling context trees; parents come before their children.
+  // A context of a node that isn't in the profile is left out, and so is
+  // everything nested in it.
+  if (Other.Contexts.empty())
+    return;
+  if (Contexts.empty())
+    addContext(0, UINT_MAX, 0, 0);
+  std::vector<unsigned> CtxMap(Other.Contexts.size(), 0);
+  for (unsigned i = 1, e = Other.Contexts.size(); i != e; i++) {
+    const Context& From = Other.Contexts[i];
+    if (From.Node >= NodeMap.size() || CtxMap[From.Parent] == UINT_MAX) {
+      CtxMap[i] = UINT_MAX;
+      continue;
+    }
+    unsigned Parent = CtxMap[From.Parent], Node = NodeMap[From.Node];
+    unsigned Ctx = UINT_MAX;
+    for (unsigned Child : Contexts[Parent].Children)
+      if (Contexts[Child].Node == Node) {
+        Ctx = Child;
+        break;
+      }
+    if (Ctx == UINT_MAX)
+      Ctx = addContext(Parent, Node, 0, 0);
+    CtxMap[i] = Ctx;
+    Contexts[Ctx].Inclusive += From.Inclusive * Weight + 0.5;
+    Contexts[Ctx].Exclusive += From.Exclusive * Weight + 0.5;
+  }
+  Contexts[0].Inclusive += Other.Contexts[0].Inclusive * Weight + 0.5;
+  Contexts[0].Exclusive += Other.Contexts[0].Exclusive * Weight + 0.5;
+}
+
+std::vector<unsigned>
+LoopCallProfile::getContextPath(unsigned Ctx) const
 {
-  readGraphNodeMetaData(MetadataFileName);
-  readProfileData(ProfileFileName);
+  std::vector<unsigned> Path;
+  for (; Ctx != 0; Ctx = Contexts[Ctx].Parent)
+    Path.push_back(Contexts[Ctx].Node);
+  return std::vector<unsigned>(Path.rbegin(), Path.rend());
+}
+
+std::map<unsigned, uint64_t>
+LoopCallProfile::getNestedInclusive(unsigned X) const
+{
+  std::map<unsigned, uint64_t> Inclusive;
+  // a node occurs at most once in a context, so summing over the subtrees
+  // of all contexts of X counts no sample twice
+  std::vector<unsigned> Worklist;
+  for (unsigned Ctx = 1, E = Contexts.size(); Ctx != E; Ctx++)
+    if (Contexts[Ctx].Node == X)
+      Worklist.push_back(Ctx);
+  while (!Worklist.empty()) {
+    const Context &C = Contexts[Worklist.back()];
+    Worklist.pop_back();
+    Inclusive[C.Node] += C.Inclusive;
+    Worklist.insert(Worklist.end(), C.Children.begin(), C.Children.end());
+  }
+  return Inclusive;
 }
 
 void LoopCallProfile::prettyPrint(std::ostream& os)
@@ -8,6 +8,7 @@
 // This file provides the following classes:
 // + LoopHeader: representing a single loop and its enclosing function
 // + LoopCallProfile: describing a loop->loop and loop->function call profile
+//   and the calling context tree of loops and functions
 // 
 //===----------------------------------------------------------------------===//
 
@@ -17,8 +18,11 @@
 #include <map>
 #include <set>
 #include <vector>
+#include <algorithm>	// std::find
 #include <fstream>	// std::ofstream
 #include <climits>	// UINT_MAX
+#include <cstdint>	// uint64_t
+#include <string>	// std::to_string
 
 #include <llvm/Support/CommandLine.h>
 using namespace llvm;
@@ -26,13 +30,20 @@ using namespace llvm;
 #include "LoopName.h"
 
 //===----------------------------------------------------------------------===//
-// Profile file names.
-// FIXME: Make these configurable.
+// Profile file names.  Profiles can be kept apart by giving them a common
+// prefix (e.g. a directory): the runtime prepends $LOOP_PROF_PREFIX to them,
+// the tools reading profiles take -prof-prefix.
 //===----------------------------------------------------------------------===//
 
 const char* const MetadataFileName = "loop-prof.flat.csv";
 const char* const ProfileFileName  = "loop-prof.graph.data";
-const char* const ProfileDumpFileName = "loop_prof.out";
+const char* const ProfileInfoFileName = "loop-prof.info";
+const char* const ContextFileName  = "loop-prof.cct.data";
+const char* const HistogramFileName = "loop-prof.hist.csv";
+const char* const EdgeCountFileName = "loop-prof.edges.csv";
+const char* const ValueProfileFileName = "loop-prof.values.csv";
+// the flat, graph and context profiles in one file (see ProfileFormat.h)
+const char* const PackFileName = "loop-prof.pack";
 
 //===----------------------------------------------------------------------===//
 // Command line flag to control debugging info for profiles
@@ -42,12 +53,17 @@ enum ProfileDebugOptions { NoDebug=0x0, Meta=0x1, Pretty=0x2 };
 
 extern cl::opt<ProfileDebugOptions> ProfileDebugLevel;
 
+extern cl::opt<std::string> ProfilePrefix;
+
 //===----------------------------------------------------------------------===//
 // class LoopHeader:
 // because basic blocks can be implicitly labelled,
 // we will reference them (across program executions) by the
 // order of default traversal. i.e. the first block encounter
 // in `for (auto &BB : F)` has id 1;
+// A header id is unique within its function; the ids of the profiled loops
+// enclosing a nested loop are kept along to name its path (see LoopName.h).
+// Loops also carry their fingerprint, which survives recompilation.
 //===----------------------------------------------------------------------===//
 
 // Does this index represent a function in the nested loop profile?
@@ -57,19 +73,42 @@ struct LoopHeader {
   std::string ModuleName;
   std::string Function;
   unsigned HeaderId;
+  std::vector<unsigned> OuterIds;	// enclosing loops, outermost first
+  uint64_t Fingerprint;			// 0 if unknown
 
-  LoopHeader(): Function(""), HeaderId(UINT_MAX) {}
+  LoopHeader(): Function(""), HeaderId(UINT_MAX), Fingerprint(0) {}
 
   LoopHeader(const std::string& funcName, unsigned id):
-    Function(funcName), HeaderId(id) {}
+    Function(funcName), HeaderId(id), Fingerprint(0) {}
 
   LoopHeader(const LoopName& loopName):
     Function(loopName.getFuncName()), 
-    HeaderId(loopName.getLoopId()) {}
+    HeaderId(loopName.getLoopId()),
+    OuterIds(loopName.getOuterIds()),
+    Fingerprint(loopName.getFingerprint()) {}
 
   // Does this index represent a function in the nested loop profile?
   bool isFunction() { return ::isFunction(HeaderId); }
 
+  // Header id of the closest enclosing profiled loop, 0 if there is none
+  unsigned getParentId() const {
+    return OuterIds.empty() ? 0 : OuterIds.back();
+  }
+
+  // Is this loop nested in loop `Outer` (of the same function)?
+  bool isNestedIn(const LoopHeader& Outer) const {
+    return ModuleName == Outer.ModuleName && Function == Outer.Function &&
+      std::find(OuterIds.begin(), OuterIds.end(), Outer.HeaderId) !=
+        OuterIds.end();
+  }
+
+  // The loop's path, e.g. "3/7"
+  std::string getPath() const {
+    std::vector<unsigned> Path(OuterIds);
+    Path.push_back(HeaderId);
+    return formatLoopPath(Path);
+  }
+
   bool operator==(LoopHeader &other) const {
     return Function == other.Function && HeaderId == other.HeaderId;
   }
@@ -83,24 +122,90 @@ struct LoopHeader {
 //===----------------------------------------------------------------------===//
 
 class LoopCallProfile {
+public:
+  // What the flat profile says about a node.  The share of time is in %,
+  // with a 95% confidence interval [TimeLo, TimeHi] if the profile has one
+  // (otherwise both equal Time).
+  struct NodeStats {
+    uint64_t Runs;
+    uint64_t Samples;
+    float Time, TimeMs, TimeLo, TimeHi;
+
+    NodeStats(): Runs(0), Samples(0), Time(0), TimeMs(0), TimeLo(0),
+                 TimeHi(0) {}
+  };
+
+  // A node of the calling context tree: the stack of loops and functions
+  // running when a sample was taken, outermost first.  Context 0 is the
+  // root (nothing running) and parents always precede their children.
+  struct Context {
+    unsigned Parent; // the same stack without the innermost entry
+    unsigned Node;   // innermost entry, an index into `GraphNodeMeta()`
+    uint64_t Inclusive; // samples taken in this context or a nested one
+    uint64_t Exclusive; // samples taken in exactly this context
+    std::vector<unsigned> Children;
+  };
+
   // representing an edge in a "call graph": which shows which functions
   // are called directly or indirectly from which (top-level) loops
   typedef std::pair<unsigned, unsigned> Edge;
 
+private:
   // Record the loops/funcs called by each loop and frequency for each edge
   std::vector<LoopHeader> CGNodes;
+  std::vector<NodeStats> Stats;
   std::map<unsigned, LoopName*> IdToLoopNameMap;
   std::map<std::string, unsigned> FuncNameToIdMap;
-  std::map<Edge, unsigned> M;		   // mapping an edge to its frequency
+  std::map<Edge, uint64_t> M;		   // mapping an edge to its frequency
   std::map<unsigned, std::set<unsigned>> nested;	// inner loops & funcs
+  std::vector<Context> Contexts;
+  std::map<LoopName, unsigned, LoopNameComp> NodeIds;
+  // the loops with a fingerprint, by module, function and fingerprint;
+  // UINT_MAX if loops of the function share it (identical loops without
+  // debug info), which are told apart by header id only
+  std::map<std::pair<std::string, uint64_t>, unsigned> FingerprintIds;
+  // total weight of the profiles merged into this one
+  double TotalWeight;
+  // The other columns of the flat profile (calls, cycles, ipc, t<N>(pct),
+  // ...) in the order they were first seen: a value for each node (0 for
+  // the nodes after the last one it has) and the total weight of the
+  // profiles merged into this one that had the column
+  struct ExtraColumn {
+    std::string Name;
+    std::vector<double> Values;
+    double Weight;
+  };
+  std::vector<ExtraColumn> ExtraColumns;
+
+  // The index of extra column `Name`, adding it if there is none
+  unsigned getExtraColumn(const std::string& Name);
+
+  // Add a node to the "call graph", return its index
+  unsigned addNode(const LoopHeader& Node, const NodeStats& NS);
+
+  // Does no other loop of the function of `Node` have its fingerprint?
+  bool hasUniqueFingerprint(const LoopHeader& Node) const;
+
+  // `findNode`, by header id only if `ByFingerprint` is false
+  unsigned findNode(const LoopHeader& Node, bool ByFingerprint) const;
+
+  // Add the nodes read from a flat profile, given the header id of the
+  // enclosing loop of each (0 if none); their `OuterIds` are filled in
+  void addNodes(std::vector<LoopHeader>& Nodes,
+                const std::vector<NodeStats>& NodeStatsRead,
+                const std::vector<unsigned>& ParentIds);
 
   // Helper functions to read the two policy files
   void readGraphNodeMetaData(const std::string& MetaFileName);
   void readProfileData(const std::string& ProfileFileName);
+  void readContextData(const std::string& ContextFileName);
+  // Read all three from a pack instead, return false if there is none
+  bool readPack(const std::string& PackFileName);
 
   // helper struct used for serialization
   struct EdgeBuf {
-    unsigned From, To, Freq;
+    unsigned From, To;
+    uint64_t Freq;
 
     char *getaddr() {
       return (char *)this;
@@ -118,13 +223,49 @@ class LoopCallProfile {
     }
   };
 
+  // serialized form of a `Context`
+  struct ContextBuf {
+    unsigned Parent, Node;
+    uint64_t Inclusive, Exclusive;
+
+    void writeTo(std::ostream &Out) {
+      Out.write((char *)this, sizeof(ContextBuf));
+    }
+
+    bool readFrom(std::istream &In) {
+      In.read((char *)this, sizeof(ContextBuf));
+      return !In.fail();
+    }
+  };
+
 public:
+  LoopCallProfile(): TotalWeight(0) {}
+  ~LoopCallProfile() {
+    for (auto& Pair : IdToLoopNameMap)
+      delete Pair.second;
+  }
+  LoopCallProfile(const LoopCallProfile&) = delete;
+  LoopCallProfile& operator=(const LoopCallProfile&) = delete;
+
   // Get the metadata describing the nodes of the profiled "call graph"
   const std::vector<LoopHeader>& GraphNodeMeta() const { return CGNodes; }
   
+  // Get the flat profile of node X
+  const NodeStats& getNodeStats(unsigned X) const { return Stats[X]; }
+
+  // Find the node of a loop or function, by fingerprint if both have one
+  // and no other loop of the function has it, otherwise by header id.
+  // Return UINT_MAX if it isn't in the profile.
+  unsigned findNode(const LoopHeader& Node) const {
+    return findNode(Node, true);
+  }
+
   // Get the frequency for an edge from node X to node Y
-  unsigned& getFreq(unsigned X, unsigned Y) { return M[Edge(X, Y)]; }
+  uint64_t& getFreq(unsigned X, unsigned Y) { return M[Edge(X, Y)]; }
   
+  // Get all the edges and their frequencies, by source then destination
+  const std::map<Edge, uint64_t>& getEdges() const { return M; }
+
   // Get the loops and functions called from node X
   std::set<unsigned>& getNested(unsigned X) { return nested[X]; }
 
@@ -136,6 +277,34 @@ public:
   unsigned getFuncIdForFuncName(const std::string& funcName)
 					{ return FuncNameToIdMap[funcName]; }
 
+  // Append a context to the calling context tree; the first one added is
+  // the root.  Return its index.
+  unsigned addContext(unsigned Parent, unsigned Node,
+                      uint64_t Inclusive, uint64_t Exclusive) {
+    unsigned Ctx = Contexts.size();
+    Contexts.emplace_back();
+    Context &C = Contexts.back();
+    C.Parent = Ctx == 0 ? 0 : Parent;
+    C.Node = Node;
+    C.Inclusive = Inclusive;
+    C.Exclusive = Exclusive;
+    if (Ctx != 0)
+      Contexts[Parent].Children.push_back(Ctx);
+    return Ctx;
+  }
+
+  // The calling context tree, empty if it wasn't profiled
+  const std::vector<Context>& getContexts() const { return Contexts; }
+  uint64_t getInclusive(unsigned Ctx) const { return Contexts[Ctx].Inclusive; }
+  uint64_t getExclusive(unsigned Ctx) const { return Contexts[Ctx].Exclusive; }
+
+  // Get the loops and functions of a context, outermost first
+  std::vector<unsigned> getContextPath(unsigned Ctx) const;
+
+  // Get the samples in which each node was running nested in node X, in
+  // any context of X; X itself maps to all the samples in which it ran.
+  std::map<unsigned, uint64_t> getNestedInclusive(unsigned X) const;
+
   // begin(), end() member function used for range-based enumeration
   unsigned begin() { return nested.begin()->first; }
   unsigned end()   { return nested.end()->first; }
@@ -158,8 +327,62 @@ public:
     Out.close();
   }
 
-  // Read metadata and profiles for loops and functions from policy files.
-  void readProfiles();
+  // dump the calling context tree to a file
+  void dumpContexts(const std::string &OutFileName) {
+    std::ofstream Out;
+    Out.open(OutFileName, std::ios::binary|std::ios::out);
+
+    ContextBuf Buf;
+    for (const Context &Ctx : Contexts) {
+      Buf.Parent = Ctx.Parent;
+      Buf.Node = Ctx.Node;
+      Buf.Inclusive = Ctx.Inclusive;
+      Buf.Exclusive = Ctx.Exclusive;
+      Buf.writeTo(Out);
+    }
+
+    Out.close();
+  }
+
+  // Read metadata and profiles for loops and functions from policy files,
+  // from the pack if there is one.  Snapshot N of a running process is
+  // read from the files with a ".N" suffix.
+  void readProfiles() { readProfiles(ProfilePrefix); }
+  void readProfiles(const std::string& Prefix, unsigned Snapshot = 0);
+
+  // The name of profile file `Name` of snapshot `Snapshot` (0 for the
+  // final profile)
+  static std::string getFileName(const std::string& Prefix, const char* Name,
+                                 unsigned Snapshot = 0) {
+    std::string FileName = Prefix + Name;
+    if (Snapshot)
+      FileName += "." + std::to_string(Snapshot);
+    return FileName;
+  }
+
+  // Call `Fn(Parent, Node, Inclusive, Exclusive)` on the contexts of a
+  // context file one at a time, parents first, without keeping them
+  template <typename FnTy>
+  static void streamContexts(const std::string& FileName, FnTy Fn) {
+    std::ifstream In(FileName, std::ios::binary|std::ios::in);
+    ContextBuf Buf;
+    while (Buf.readFrom(In))
+      Fn(Buf.Parent, Buf.Node, Buf.Inclusive, Buf.Exclusive);
+  }
+
+  // Write the flat, graph and context profiles, and the pack of them, to
+  // files named with a prefix
+  void writeProfiles(const std::string& Prefix);
+
+  // Add profile `Other`, weighted by `Weight`, to this one.  Nodes are
+  // matched by module, function and header id.  Counts (runs, samples, edge
+  // and context frequencies, time in ms, and the extra columns that count
+  // calls, cycles, CPU time or memory samples) are scaled by the weight and
+  // summed; time shares and the other extra columns become the mean over
+  // the merged profiles that have them, weighted by `ShareWeight` (by
+  // `Weight` if negative).
+  void merge(const LoopCallProfile& Other, double Weight = 1,
+             double ShareWeight = -1);
 
   // Formatted printout of metadata and profiles
   void prettyPrint(std::ostream& os);
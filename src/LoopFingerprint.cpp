@@ -0,0 +1,75 @@
+//===- llvmtuner/src/LoopFingerprint.cpp: stable loop identity --*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/DebugInfoMetadata.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+
+#include "LoopFingerprint.h"
+
+#include <map>
+
+using namespace llvm;
+
+namespace {
+// 64-bit FNV-1a
+struct FingerprintHash {
+  uint64_t Hash = 14695981039346656037ULL;
+
+  void add(const void *Data, size_t Size) {
+    const unsigned char *Bytes = (const unsigned char *)Data;
+    for (size_t i = 0; i < Size; i++) {
+      Hash ^= Bytes[i];
+      Hash *= 1099511628211ULL;
+    }
+  }
+  void add(uint32_t Value) { add(&Value, sizeof(Value)); }
+  void add(StringRef Str) {
+    add(Str.size());
+    add(Str.data(), Str.size());
+  }
+};
+}
+
+uint64_t getLoopFingerprint(const Loop &L) {
+  const Function *F = L.getHeader()->getParent();
+  std::map<const BasicBlock *, uint32_t> Index;
+  for (const BasicBlock &BB : *F)
+    if (L.contains(&BB))
+      Index.emplace(&BB, Index.size());
+
+  FingerprintHash H;
+  H.add(Index.size());
+  for (const BasicBlock &BB : *F) {
+    if (!Index.count(&BB))
+      continue;
+    for (const Instruction &I : BB)
+      if (!isa<DbgInfoIntrinsic>(I))
+        H.add(I.getOpcode());
+
+    // the exits of the loop are all alike
+    const TerminatorInst *Term = BB.getTerminator();
+    H.add(Term->getNumSuccessors());
+    for (unsigned i = 0, e = Term->getNumSuccessors(); i != e; i++) {
+      auto It = Index.find(Term->getSuccessor(i));
+      H.add(It != Index.end() ? It->second : UINT32_MAX);
+    }
+  }
+
+  if (DILocation *Loc = L.getStartLoc().get()) {
+    H.add(Loc->getFilename());
+    unsigned Line = Loc->getLine();
+    if (DISubprogram *SP = Loc->getScope()->getSubprogram())
+      if (SP->getLine() <= Line)
+        Line -= SP->getLine();
+    H.add(Line);
+  }
+
+  return H.Hash ? H.Hash : 1;
+}
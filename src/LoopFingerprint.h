@@ -0,0 +1,30 @@
+//===- llvmtuner/src/LoopFingerprint.h: stable loop identity ----*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A loop's header id is the position of its header in its function, so any
+// change in front of the loop renumbers it.  Its fingerprint is a hash of
+// what the loop itself looks like:
+// + the shape of its CFG: its blocks in function order and which of them
+//   (or an exit) each one branches to
+// + the opcodes of its instructions, debug intrinsics excluded
+// + where it starts in the source: the file and the line relative to the
+//   start of its function, if there is debug info
+// so it stays the same across builds as long as the loop does.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LOOP_FINGERPRINT_H
+#define LOOP_FINGERPRINT_H
+
+#include <llvm/Analysis/LoopInfo.h>
+
+#include <cstdint>
+
+// The fingerprint of loop L, never 0 (which stands for "none")
+uint64_t getLoopFingerprint(const llvm::Loop &L);
+
+#endif // LOOP_FINGERPRINT_H
@@ -12,11 +12,55 @@
 #include <iostream>
 #include "LoopName.h"
 
+bool parseLoopPath(const std::string& Path, std::vector<unsigned>& Ids)
+{
+  Ids.clear();
+  size_t begin = 0;
+  while (begin <= Path.length()) {
+    size_t end = Path.find('/', begin);
+    if (end == std::string::npos)
+      end = Path.length();
+    if (end == begin)
+      return false;
+    char *rest;
+    unsigned long id = std::strtoul(Path.c_str() + begin, &rest, 10);
+    if (rest != Path.c_str() + end)
+      return false;
+    Ids.push_back(id);
+    begin = end + 1;
+  }
+  return !Ids.empty();
+}
+
+std::string formatLoopPath(const std::vector<unsigned>& Ids)
+{
+  std::string path;
+  for (unsigned id : Ids)
+    path += (path.empty() ? "" : "/") + std::to_string(id);
+  return path;
+}
+
+std::string formatFingerprint(uint64_t Fingerprint)
+{
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)Fingerprint);
+  return buf;
+}
+
+uint64_t parseFingerprint(const std::string& Str)
+{
+  char *end;
+  unsigned long long fingerprint = std::strtoull(Str.c_str(), &end, 16);
+  if (Str.empty() || Str.size() > 16 || *end != '\0')
+    return 0;
+  return fingerprint;
+}
+
 // Construct a LoopName from a formatted string, Arg, with format:
-// "function-name,integer-loop-id"
+// "function-name,integer-loop-id" or "function-name,loop-path"
 // moduleName must be part of the func name (i.e, func must be qualified).
 LoopName::LoopName(const std::string& Arg):
-  resolvedModuleName(""), loopId(-1)
+  resolvedModuleName(""), loopId(-1), fingerprint(0)
 {
   size_t sep = Arg.find(',');
   
@@ -25,18 +69,43 @@ LoopName::LoopName(const std::string& Arg):
     std::cerr << "Ill-formatted string initializer";
     return;
   }
-  
+
+  std::string id = Arg.substr(sep+1);
+  size_t hash = id.find('#');
+  if (hash != std::string::npos) {
+    fingerprint = parseFingerprint(id.substr(hash+1));
+    id.erase(hash);
+    if (fingerprint == 0) {
+      std::cerr << "Ill-formatted string initializer";
+      return;
+    }
+  }
+
+  std::vector<unsigned> path;
+  if (!id.empty() || !fingerprint) {
+    if (!parseLoopPath(id, path)) {
+      std::cerr << "Ill-formatted string initializer";
+      return;
+    }
+    loopId = path.back();
+    path.pop_back();
+    outerIds = path;
+  }
+
   functionName = Arg.substr(0, sep);
-  loopId = std::atoi(Arg.substr(sep+1).c_str());
-  if (loopId > 0)
+  if (loopId == 0)
     std::cerr << "LoopName: Header id must be a positive integer\n";
 }
 
 LoopName::LoopName(std::string moduleName,
-		   std::string funcName, unsigned _loopId) :
+		   std::string funcName, unsigned _loopId,
+		   const std::vector<unsigned>& _outerIds,
+		   uint64_t _fingerprint) :
   resolvedModuleName(moduleName),
   functionName(funcName),
-  loopId(_loopId)
+  loopId(_loopId),
+  outerIds(_outerIds),
+  fingerprint(_fingerprint)
 {}
 
 // Print the fully qualified loop ID to a new string
@@ -44,6 +113,50 @@ std::string LoopName::toString() const
 {
   std::string asString;
   asString = (getModule().length() > 0)? getModule() + ":" : "";
-  asString += getFuncName() + ":" + std::to_string(getLoopId());
+  std::vector<unsigned> path(outerIds);
+  path.push_back(getLoopId());
+  asString += getFuncName() + ":" + formatLoopPath(path);
+  if (fingerprint)
+    asString += "#" + formatFingerprint(fingerprint);
   return asString;
 }
+
+// Read "module:function:loop-path#fingerprint" as written by toString(); the
+// module and the fingerprint may be left out.  Function names have no ':',
+// so the last two separate the module, the function and the path.
+std::istream& operator>>(std::istream& is, LoopName& loopName)
+{
+  std::string str;
+  if (!(is >> str))
+    return is;
+
+  size_t pathSep = str.rfind(':');
+  if (pathSep == std::string::npos) {
+    is.setstate(std::ios::failbit);
+    return is;
+  }
+  std::string id = str.substr(pathSep + 1);
+  uint64_t fingerprint = 0;
+  size_t hash = id.find('#');
+  if (hash != std::string::npos) {
+    fingerprint = parseFingerprint(id.substr(hash + 1));
+    id.erase(hash);
+  }
+  std::vector<unsigned> path;
+  if (!parseLoopPath(id, path) || (hash != std::string::npos && !fingerprint)) {
+    is.setstate(std::ios::failbit);
+    return is;
+  }
+  unsigned loopId = path.back();
+  path.pop_back();
+
+  size_t funcSep = str.rfind(':', pathSep - 1);
+  if (pathSep == 0 || funcSep == std::string::npos)
+    loopName = LoopName("", str.substr(0, pathSep), loopId, path,
+                        fingerprint);
+  else
+    loopName = LoopName(str.substr(0, funcSep),
+                        str.substr(funcSep + 1, pathSep - funcSep - 1),
+                        loopId, path, fingerprint);
+  return is;
+}
@@ -9,13 +9,33 @@
 #define LOOP_FUNC_NAME_H
 
 #include <string>
+#include <vector>
 #include <cstdio>
+#include <cstdint>
 #include <climits>
+#include <iosfwd>
+
+// A loop nested in other loops is named by its path, the header ids of the
+// loops enclosing it (outermost first) and its own joined by '/': "3/7" is
+// the loop with header 7 inside the loop with header 3.  Return false if
+// `Path` is ill-formatted.
+bool parseLoopPath(const std::string& Path, std::vector<unsigned>& Ids);
+std::string formatLoopPath(const std::vector<unsigned>& Ids);
+
+// Loop fingerprints (see LoopFingerprint.h) are written as 16 hex digits;
+// parsing returns 0 if `Str` isn't one
+std::string formatFingerprint(uint64_t Fingerprint);
+uint64_t parseFingerprint(const std::string& Str);
 
 class LoopName {
   std::string resolvedModuleName;
   std::string functionName;
   unsigned loopId;
+  // header ids of the enclosing loops, outermost first; only informative,
+  // a header id is unique within its function
+  std::vector<unsigned> outerIds;
+  // identifies the loop across builds (see LoopFingerprint.h), 0 if unknown
+  uint64_t fingerprint;
   friend struct LoopNameComp;
 
   // Writing out and reading back the loop name to a stream
@@ -27,15 +47,23 @@ public:
     resolvedModuleName = loopName.resolvedModuleName;
     functionName = loopName.functionName;
     loopId = loopName.loopId;
+    outerIds = loopName.outerIds;
+    fingerprint = loopName.fingerprint;
     return *this;
   };
 
-  LoopName(): resolvedModuleName(""), functionName(""), loopId(UINT_MAX) {}
+  LoopName(): resolvedModuleName(""), functionName(""), loopId(UINT_MAX),
+	      fingerprint(0) {}
 
-  LoopName(std::string moduleName, std::string funcName, unsigned _loopId);
+  LoopName(std::string moduleName, std::string funcName, unsigned _loopId,
+	   const std::vector<unsigned>& _outerIds = std::vector<unsigned>(),
+	   uint64_t _fingerprint = 0);
   
   // Construct a LoopName from a formatted string, Arg, with format:
-  // "function-name , integer-loop-id"
+  // "function-name , integer-loop-id" or "function-name , loop-path",
+  // optionally followed by "#fingerprint" (16 hex digits).  With a
+  // fingerprint the loop id may be left out ("function-name,#fingerprint"),
+  // the loop id is UINT_MAX then.
   // moduleName must be part of the func name (i.e, func must be qualified).
   LoopName(const std::string& Arg);
 
@@ -43,6 +71,8 @@ public:
   const std::string& getModule()   const { return resolvedModuleName; }
   const std::string& getFuncName() const { return functionName; }
   uint32_t           getLoopId()   const { return loopId; }
+  const std::vector<unsigned>& getOuterIds() const { return outerIds; }
+  uint64_t           getFingerprint() const { return fingerprint; }
   std::string        toString()    const;
 };
 
@@ -52,13 +82,9 @@ inline std::ostream &operator<<(std::ostream &os, const LoopName& loopName)
   return os;
 }
 
-#if 0
-inline std::istream& operator>>(std::istream& is)
-{
-  // Read data from stream, construct a LoopName, and return it
-  return is;
-}
-#endif
+// Read back a loop name written by `operator<<`, up to the next white space;
+// sets failbit if it is ill-formatted
+std::istream& operator>>(std::istream& is, LoopName& loopName);
 
 struct LoopNameComp {
   bool operator() (const LoopName& lhs, const LoopName& rhs) const {
@@ -41,6 +41,8 @@
 #include <cstdio>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <cctype>
 #include <vector>
 #include <map>
 #include <set>
@@ -53,79 +55,82 @@
 // Describes a policy for one module.
 //===----------------------------------------------------------------------===//
 
-class ModulePolicyInfo
+// Retrieving and adding a loop policy for a specified function
+std::vector<LoopName>*
+ModulePolicyInfo::getOrInsertLoopsForFunc(const std::string& funcName)
 {
-public:
-  // Public types
-  typedef std::set<LoopName, struct LoopNameComp> LoopNameSet;
-
-  // Ctors and dtors
-  ModulePolicyInfo(const std::string &_module) : thisModule(_module) { }
-  ~ModulePolicyInfo() {
-    for (auto &mapEntry: funcToLoopMap)
-      delete mapEntry.second;
-  }
-
-  // Insert one top-level loop
-  void addLoop(const LoopName& loopName) {
-    loops.emplace(loopName);
-  }
-
-  // Insert LoopName for a function in the map
-  void addLoopForFunc(const LoopName& loopName, const std::string& funcName) {
-    std::vector<LoopName>* vectorEntry = getOrInsertLoopsForFunc(funcName);
-    vectorEntry->push_back(loopName);
-  }
-  
-  // Query information about the policy
-  const std::string& getModule() const	{ return thisModule; }
-  const LoopNameSet& getLoops()  const	{ return loops; }
-  const std::vector<LoopName>& getLoopsForFunc(const std::string& funcName) {
-    std::vector<LoopName>* vectorEntry = getOrInsertLoopsForFunc(funcName);
-    return * vectorEntry;
-  }
-
-  // Write out and read back one policy
-  void print(std::ostream& os) const;
-
-private:
-  // Internal state
-  const std::string& thisModule;
-  LoopNameSet loops;
-  std::map<std::string, std::vector<LoopName>* > funcToLoopMap;
-  
-  // Retrieving and adding a loop policy for a specified function
-  std::vector<LoopName>* getOrInsertLoopsForFunc(const std::string& funcName) {
-    std::vector<LoopName>*& vectorEntry = funcToLoopMap[funcName];
-    if (vectorEntry == NULL)
-      vectorEntry = new std::vector<LoopName>;
-    assert(funcToLoopMap[funcName] == vectorEntry && "Bad map insertion (1)?");
-    return vectorEntry;
-  }
-
-};
-
+  std::vector<LoopName>*& vectorEntry = funcToLoopMap[funcName];
+  if (vectorEntry == NULL)
+    vectorEntry = new std::vector<LoopName>;
+  assert(funcToLoopMap[funcName] == vectorEntry && "Bad map insertion (1)?");
+  return vectorEntry;
+}
 
 // Write the per-module policy information to an output stream. Format:
-// Line 1: module-name: "loops: " loopid1,...,loopidN "\n"
-// Line 2: module-name: func:qualified-loop-id1,...,qualified-loop-idN "\n"
+//	"loops:"
+//	qualified-loop-id			(one line per top-level loop)
+//	"functions:"
+//	func: qualified-loop-id1 ... qualified-loop-idN	(one line per function)
 void ModulePolicyInfo::print(std::ostream &os) const
 {
   // Write out the descriptors of top-level loops, one per line.
-  os << "loops: " << std::endl;
+  os << "loops:" << std::endl;
   for (auto &LN: loops)
     os << LN << std::endl;
   
   // Write out the list of qualified-loop-ids for each function, one per line
-  os << "functions: " << std::endl;
+  os << "functions:" << std::endl;
   for (auto &mapEntry: funcToLoopMap) {
-    os << mapEntry.first << ": ";
+    os << mapEntry.first << ":";
     for (auto &loopName: *mapEntry.second)
-      os << loopName;
+      os << ' ' << loopName;
     os << std::endl;
   }
 }
 
+// Read a line without trailing white space (as of "loops: ", or "\r")
+static bool getTrimmedLine(std::istream& is, std::string& line)
+{
+  if (!std::getline(is, line))
+    return false;
+  while (!line.empty() && isspace((unsigned char)line.back()))
+    line.pop_back();
+  return true;
+}
+
+// Read back the per-module policy information, up to an empty line or the
+// end of the stream
+bool ModulePolicyInfo::read(std::istream& is)
+{
+  std::string line;
+  if (!getTrimmedLine(is, line) || line != "loops:")
+    return false;
+  while (getTrimmedLine(is, line) && line != "functions:") {
+    std::istringstream fields(line);
+    LoopName loopName;
+    if (!(fields >> loopName))
+      return false;
+    addLoop(loopName);
+  }
+  if (line != "functions:")
+    return false;
+
+  while (getTrimmedLine(is, line) && !line.empty()) {
+    size_t sep = line.find(':');
+    if (sep == std::string::npos || sep == 0)
+      return false;
+    std::vector<LoopName>* vectorEntry =
+      getOrInsertLoopsForFunc(line.substr(0, sep));
+    std::istringstream fields(line.substr(sep + 1));
+    LoopName loopName;
+    while (fields >> loopName)
+      vectorEntry->push_back(loopName);
+    if (!fields.eof())
+      return false;
+  }
+  return true;
+}
+
 inline std::ostream& operator<<(std::ostream& os,
 				const ModulePolicyInfo& policyInfo)
 {
@@ -133,14 +138,14 @@ inline std::ostream& operator<<(std::ostream& os,
   return os;
 }
 
-#if 0
-// Write the per-module policy information to an output stream
-std::istream& operator >>(std::istream& is, ModulePolicyInfo& policyInfo)
+// Read back the per-module policy information from an input stream
+inline std::istream& operator >>(std::istream& is,
+				ModulePolicyInfo& policyInfo)
 {
-  // Read data from stream, construct a ModulePolicyInfo, and return it
+  if (!policyInfo.read(is))
+    is.setstate(std::ios::failbit);
   return is;
 }
-#endif
 
 
 //===----------------------------------------------------------------------===//
@@ -168,6 +173,15 @@ ModulePolicyInfo& LoopPolicy::getOrCreatePolicy(const std::string& moduleName)
   return *policy;
 }
 
+// Look up the policy for a module, null if there is none
+//
+const ModulePolicyInfo*
+LoopPolicy::getPolicy(const std::string& moduleName) const
+{
+  auto It = modulePolicies.find(moduleName);
+  return It == modulePolicies.end() ? NULL : It->second;
+}
+
 // Add a top-level loop
 //
 void LoopPolicy::addLoop(const LoopName& loopName)
@@ -206,22 +220,37 @@ std::ostream& operator<<(std::ostream& os, const LoopPolicy& policy)
   return os;
 }
 
-#if 0
-// Write the per-module policy information to an output stream
-std::istream& operator >>(std::istream& is, LoopPolicy& policy)
+// Read back the policies written by `print`
+bool LoopPolicy::read(std::istream& is)
 {
-  // Read back the map information from a file.
-  // 
-  os << modulePolicies.size() << "\n";
-  for (auto &mapEntry: modulePolicies) {
-    os << mapEntry.first << ":";
-    for (auto &modulePolicies: mapEntry.second)
-      os << modulePolicies;
-    os << "\n";
+  // Start with number of entries, then one policy per module, each one
+  // followed by an empty line.
+  std::string line;
+  unsigned numModules;
+  if (!getTrimmedLine(is, line) ||
+      sscanf(line.c_str(), "%u", &numModules) != 1)
+    return false;
+  for (unsigned i = 0; i != numModules; i++) {
+    while (getTrimmedLine(is, line) && line.empty())
+      ;
+    const std::string prefix = "Module ";
+    if (line.compare(0, prefix.size(), prefix) != 0 || line.back() != ':')
+      return false;
+    std::string moduleName =
+      line.substr(prefix.size(), line.size() - prefix.size() - 1);
+    if (moduleName.empty() || !getOrCreatePolicy(moduleName).read(is))
+      return false;
   }
+  return true;
+}
+
+// Read back the per-module policy information from an input stream
+std::istream& operator >>(std::istream& is, LoopPolicy& policy)
+{
+  if (!policy.read(is))
+    is.setstate(std::ios::failbit);
   return is;
 }
-#endif
 
 
 //===----------------------------------------------------------------------===//
@@ -17,10 +17,67 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <iostream>
 
-class LoopName;
-class ModulePolicyInfo;
+#include "LoopName.h"
+
+//===----------------------------------------------------------------------===//
+// class ModulePolicyInfo
+//
+// Describes a policy for one module.
+//===----------------------------------------------------------------------===//
+
+class ModulePolicyInfo
+{
+public:
+  // Public types
+  typedef std::set<LoopName, struct LoopNameComp> LoopNameSet;
+  typedef std::map<std::string, std::vector<LoopName>* > FuncToLoopMap;
+
+  // Ctors and dtors
+  ModulePolicyInfo(const std::string &_module) : thisModule(_module) { }
+  ~ModulePolicyInfo() {
+    for (auto &mapEntry: funcToLoopMap)
+      delete mapEntry.second;
+  }
+
+  // Insert one top-level loop
+  void addLoop(const LoopName& loopName) {
+    loops.emplace(loopName);
+  }
+
+  // Insert LoopName for a function in the map
+  void addLoopForFunc(const LoopName& loopName, const std::string& funcName) {
+    std::vector<LoopName>* vectorEntry = getOrInsertLoopsForFunc(funcName);
+    vectorEntry->push_back(loopName);
+  }
+
+  // Query information about the policy
+  const std::string& getModule() const	{ return thisModule; }
+  const LoopNameSet& getLoops()  const	{ return loops; }
+  const std::vector<LoopName>& getLoopsForFunc(const std::string& funcName) {
+    std::vector<LoopName>* vectorEntry = getOrInsertLoopsForFunc(funcName);
+    return * vectorEntry;
+  }
+  // The functions of the module and the loops (of any module) each one
+  // must be copied for
+  const FuncToLoopMap& getFuncs() const	{ return funcToLoopMap; }
+
+  // Write out and read back one policy.  Reading returns false if the
+  // policy is ill-formatted.
+  void print(std::ostream& os) const;
+  bool read(std::istream& is);
+
+private:
+  // Internal state
+  const std::string thisModule;
+  LoopNameSet loops;
+  FuncToLoopMap funcToLoopMap;
+
+  // Retrieving and adding a loop policy for a specified function
+  std::vector<LoopName>* getOrInsertLoopsForFunc(const std::string& funcName);
+};
 
 //===----------------------------------------------------------------------===//
 
@@ -28,36 +85,43 @@ class LoopPolicy
 {
   // Types used within this class
   typedef std::map<const std::string, ModulePolicyInfo*> PolicyMap;
-  typedef       PolicyMap::iterator       iterator;
-  typedef const PolicyMap::iterator const_iterator;
 
   // Look up the policy for a module.  Insert an empty one if none exists.
   ModulePolicyInfo& getOrCreatePolicy(const std::string& moduleName);
 
 public:
+  typedef PolicyMap::const_iterator const_iterator;
+
   // dtor: release memory for all ModulePoicyInfo objects in the map
   ~LoopPolicy();
 
   // Add a top-level loop to the policy
   void addLoop(const LoopName& loopName);
-  
+
   // Add one loop for a function
   void addLoopForFunc(const std::string& moduleName,
 		      const std::string& funcName, const LoopName& loopName);
 
-  // Helper for writing out the policies
+  // Look up the policy for a module, null if there is none
+  const ModulePolicyInfo* getPolicy(const std::string& moduleName) const;
+
+  // Iterate over the (module name, policy) pairs
+  const_iterator begin() const	{ return modulePolicies.begin(); }
+  const_iterator end() const	{ return modulePolicies.end(); }
+
+  // Helpers for writing out and reading back the policies
   void print(std::ostream &os) const;
+  bool read(std::istream &is);
 
 private:
   // Internal state implementing this class
   PolicyMap modulePolicies;
 };
 
-// Writing out and reading back the policies
+// Writing out and reading back the policies.  Reading sets failbit if the
+// policies are ill-formatted.
 extern std::ostream& operator <<(std::ostream&, const LoopPolicy&);
-#if 0
-  friend std::istream& operator >>(std::istream&, const LoopPolicy&);
-#endif
+extern std::istream& operator >>(std::istream&, LoopPolicy&);
 
 
 //===----------------------------------------------------------------------===//
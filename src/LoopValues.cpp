@@ -0,0 +1,104 @@
+//===- llvmtuner/src/LoopValues.cpp: values worth specializing on -*- C++ -*-=//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/InstrTypes.h>
+#include <llvm/IR/Instructions.h>
+
+#include "LoopValues.h"
+
+using namespace llvm;
+
+const char *getLoopValueKindName(LoopValue::KindTy Kind) {
+  static const char *const Names[LoopValue::NumKinds] = {"bound", "stride",
+                                                         "align"};
+  return Names[Kind];
+}
+
+// The step of the induction variable `IV` (a header phi or its increment),
+// or null if `IV` isn't one
+static Value *getStep(const Loop &L, Value *IV) {
+  BasicBlock *Latch = L.getLoopLatch();
+  if (!Latch)
+    return nullptr;
+  auto *Inc = dyn_cast<BinaryOperator>(IV);
+  if (auto *Phi = dyn_cast<PHINode>(IV))
+    if (Phi->getParent() == L.getHeader())
+      Inc = dyn_cast<BinaryOperator>(Phi->getIncomingValueForBlock(Latch));
+  if (!Inc || !L.contains(Inc) ||
+      (Inc->getOpcode() != Instruction::Add &&
+       Inc->getOpcode() != Instruction::Sub))
+    return nullptr;
+
+  for (unsigned i = 0; i < 2; i++) {
+    auto *Phi = dyn_cast<PHINode>(Inc->getOperand(i));
+    if (!Phi || Phi->getParent() != L.getHeader() ||
+        Phi->getIncomingValueForBlock(Latch) != Inc)
+      continue;
+    // `step - iv` isn't an induction variable
+    if (i == 1 && Inc->getOpcode() == Instruction::Sub)
+      return nullptr;
+    return Inc->getOperand(1 - i);
+  }
+  return nullptr;
+}
+
+static bool isSmallInteger(Value *V) {
+  return V->getType()->isIntegerTy() &&
+         V->getType()->getIntegerBitWidth() <= 64;
+}
+
+std::vector<LoopValue> getLoopValues(const Loop &L) {
+  std::vector<LoopValue> Values;
+  SmallPtrSet<Value *, 16> Seen;
+  auto add = [&](LoopValue::KindTy Kind, Value *V) {
+    if (V && !isa<Constant>(V) && L.isLoopInvariant(V) &&
+        Seen.insert(V).second)
+      Values.push_back({Kind, V});
+  };
+
+  for (BasicBlock *BB : L.blocks()) {
+    auto *Br = dyn_cast<BranchInst>(BB->getTerminator());
+    if (!Br || !Br->isConditional() || !L.isLoopExiting(BB))
+      continue;
+    auto *Cmp = dyn_cast<ICmpInst>(Br->getCondition());
+    if (!Cmp || !isSmallInteger(Cmp->getOperand(0)))
+      continue;
+    for (unsigned i = 0; i < 2; i++) {
+      Value *Bound = Cmp->getOperand(i);
+      if (!L.isLoopInvariant(Bound))
+        continue;
+      add(LoopValue::Bound, Bound);
+      add(LoopValue::Stride, getStep(L, Cmp->getOperand(1 - i)));
+    }
+  }
+
+  // the alignment of a stack slot is known already
+  unsigned NumPointers = 0;
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB) {
+      Value *Ptr = nullptr;
+      if (auto *Load = dyn_cast<LoadInst>(&I))
+        Ptr = Load->getPointerOperand();
+      else if (auto *Store = dyn_cast<StoreInst>(&I))
+        Ptr = Store->getPointerOperand();
+      else if (auto *GEP = dyn_cast<GetElementPtrInst>(&I))
+        Ptr = GEP->getPointerOperand();
+      if (!Ptr || NumPointers == MaxAlignedPointers)
+        continue;
+      Ptr = Ptr->stripPointerCasts();
+      if (isa<AllocaInst>(Ptr))
+        continue;
+      unsigned NumValues = Values.size();
+      add(LoopValue::Align, Ptr);
+      NumPointers += Values.size() - NumValues;
+    }
+
+  return Values;
+}
@@ -0,0 +1,50 @@
+//===- llvmtuner/src/LoopValues.h: values worth specializing on -*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The values live into a loop that `instrument-loops -value-profile` records
+// at its preheader and `specialize-loops` specializes the loop on:
+// + the bound its exit conditions compare an integer against
+// + the step of the induction variable compared, if it isn't a constant
+// + the pointers it addresses memory through, of which the alignment is
+//   recorded
+// Both tools find them with `getLoopValues`, so a loop's values are numbered
+// the same as long as the module is.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LOOP_VALUES_H
+#define LOOP_VALUES_H
+
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/Value.h>
+
+#include <vector>
+
+// at most this many pointers of a loop have their alignment recorded, and
+// alignments are recorded up to that of a cache line (as in prof.cpp)
+const unsigned MaxAlignedPointers = 8;
+const unsigned MaxRecordedAlign = 64;
+
+struct LoopValue {
+  // as in prof.cpp
+  enum KindTy { Bound, Stride, Align, NumKinds };
+
+  KindTy Kind;
+  llvm::Value *V;
+};
+
+// the name of a kind in `loop-prof.values.csv`
+const char *getLoopValueKindName(LoopValue::KindTy Kind);
+
+// The values of `L` (in simplify form) to record, in a fixed order: those
+// of the exit conditions in the order of the exiting blocks, then the
+// pointers in the order of their first use.  Bounds and strides are
+// integers of at most 64 bits; none of the values is a constant or
+// defined in `L`.
+std::vector<LoopValue> getLoopValues(const llvm::Loop &L);
+
+#endif // LOOP_VALUES_H
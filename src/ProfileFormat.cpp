@@ -0,0 +1,103 @@
+//===- llvmtuner/src/ProfileFormat.cpp: packed profile file ----*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ProfileFormat.h"
+
+using namespace llvm;
+
+bool PackedProfile::open(const std::string& FileName)
+{
+  // mapped rather than read if it's large enough to be worth it
+  auto BufferOrErr = MemoryBuffer::getFile(FileName, -1,
+                                           /*RequiresNullTerminator*/ false);
+  if (!BufferOrErr)
+    return false;
+  std::unique_ptr<MemoryBuffer> Buf = std::move(BufferOrErr.get());
+  const char *Start = Buf->getBufferStart();
+  uint64_t Size = Buf->getBufferSize();
+
+  const PackHeader *Header = (const PackHeader *)Start;
+  if (Size < sizeof(PackHeader) ||
+      memcmp(Header->Magic, PackMagic, sizeof(PackMagic)) != 0 ||
+      Header->Version != PackVersion || Header->FileSize != Size ||
+      (Size - sizeof(PackHeader)) / sizeof(PackSection) <
+          Header->NumSections)
+    return false;
+
+  const PackSection *Sections = (const PackSection *)(Header + 1);
+  Strings = Nodes = Edges = Contexts = nullptr;
+  Columns.clear();
+  for (unsigned i = 0; i != Header->NumSections; i++) {
+    const PackSection& Section = Sections[i];
+    if (Section.Offset % 8 != 0 || Section.Offset > Size ||
+        (Section.EntrySize &&
+         (Size - Section.Offset) / Section.EntrySize < Section.Count))
+      return false;
+    uint32_t MinEntrySize = 0;
+    const PackSection **Slot = nullptr;
+    switch (Section.Kind) {
+    case PackStrings:
+      MinEntrySize = 1;
+      Slot = &Strings;
+      break;
+    case PackNodes:
+      MinEntrySize = sizeof(PackNode);
+      Slot = &Nodes;
+      break;
+    case PackEdges:
+      MinEntrySize = sizeof(PackEdge);
+      Slot = &Edges;
+      break;
+    case PackContexts:
+      MinEntrySize = sizeof(PackContext);
+      Slot = &Contexts;
+      break;
+    case PackColumn:
+      if (Section.EntrySize != sizeof(double))
+        return false;
+      Columns.push_back(&Section);
+      continue;
+    default:
+      continue;
+    }
+    if (Section.EntrySize < MinEntrySize || *Slot)
+      return false;
+    *Slot = &Section;
+  }
+
+  if (!Strings || !Nodes || !Edges || !Contexts || Strings->Count == 0 ||
+      Start[Strings->Offset + Strings->Count - 1] != '\0')
+    return false;
+  for (const PackSection *Column : Columns)
+    if (Column->Count != Nodes->Count)
+      return false;
+  Buffer = std::move(Buf);
+  return true;
+}
+
+const char *PackedProfile::getString(uint32_t Offset) const
+{
+  if (Offset >= Strings->Count)
+    return "";
+  return Buffer->getBufferStart() + Strings->Offset + Offset;
+}
+
+const double *PackedProfile::getColumn(const std::string& Name) const
+{
+  for (const PackSection *Column : Columns)
+    if (Name == getString(Column->Name))
+      return (const double *)(Buffer->getBufferStart() + Column->Offset);
+  return nullptr;
+}
+
+std::vector<std::string> PackedProfile::getColumnNames() const
+{
+  std::vector<std::string> Names;
+  for (const PackSection *Column : Columns)
+    Names.push_back(getString(Column->Name));
+  return Names;
+}
@@ -0,0 +1,274 @@
+//===- llvmtuner/src/ProfileFormat.h: packed profile file ------*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// `loop-prof.pack` holds the flat, graph and context profiles in one file
+// of fixed-size entries that is mapped into memory rather than parsed:
+//
+//	PackHeader
+//	PackSection[NumSections]
+//	the sections' entries, each section starting 8-byte aligned
+//
+// in the byte order of the machine that wrote it.  The sections are
+// + PackStrings: the NUL-terminated module and function names, each once;
+//   names are referred to by their offset in it, 0 being ""
+// + PackNodes: a PackNode for each row of the flat profile, in its order
+// + PackEdges: the graph profile, sorted by `From` then `To`
+// + PackContexts: the calling context tree, parents before children
+// + PackColumn, any number: another column of the flat profile (cycles,
+//   ipc, ...) named by the section, a double for each node
+// A new version of the format may append fields to the entries (readers go
+// by `EntrySize`) and add kinds of sections (readers skip those they don't
+// know); anything else changes `PackVersion`.
+//
+// The writer is kept in this header for the profiler runtime, which links
+// nothing else; `PackedProfile` (ProfileFormat.cpp) maps the file, and
+// `LoopCallProfile::readPack` copies the entries into its tables.  Only
+// `profpack.py` works on the mapping in place.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef PROFILE_FORMAT_H
+#define PROFILE_FORMAT_H
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+const char PackMagic[8] = {'L', 'O', 'O', 'P', 'P', 'A', 'C', 'K'};
+const uint32_t PackVersion = 2;
+
+enum PackSectionKind : uint32_t {
+  PackStrings = 1,
+  PackNodes,
+  PackEdges,
+  PackContexts,
+  PackColumn,
+};
+
+struct PackHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t NumSections;
+  uint64_t FileSize;    // to tell a truncated file
+};
+
+struct PackSection {
+  uint32_t Kind;
+  uint32_t EntrySize;
+  uint32_t Name;        // offset in the strings, 0 if unnamed
+  uint32_t Reserved;
+  uint64_t Offset;      // from the start of the file
+  uint64_t Count;       // number of entries
+};
+
+// a row of the flat profile (see LoopCallProfile::NodeStats)
+struct PackNode {
+  uint32_t Module, Function; // offsets in the strings
+  uint32_t HeaderId, ParentId;
+  uint64_t Fingerprint;
+  uint64_t Runs;
+  uint64_t Samples;
+  float Time, TimeMs, TimeLo, TimeHi;
+};
+
+struct PackEdge {
+  uint32_t From, To;
+  uint64_t Freq;
+};
+
+struct PackContext {
+  uint32_t Parent, Node;
+  uint64_t Inclusive, Exclusive;
+};
+
+static_assert(sizeof(PackHeader) == 24 && sizeof(PackSection) == 32 &&
+                  sizeof(PackNode) == 56 && sizeof(PackEdge) == 16 &&
+                  sizeof(PackContext) == 24,
+              "the Python reader (profpack.py) assumes these layouts");
+
+//===----------------------------------------------------------------------===//
+// class PackWriter: collects a profile and writes it as a pack
+//===----------------------------------------------------------------------===//
+
+class PackWriter {
+  std::string Strings;
+  std::map<std::string, uint32_t> StringOffsets;
+  std::vector<PackNode> Nodes;
+  std::vector<PackEdge> Edges;
+  std::vector<PackContext> Contexts;
+  // the extra columns by name, in the order they were first set
+  std::vector<std::pair<uint32_t, std::vector<double>>> Columns;
+  std::map<std::string, unsigned> ColumnIds;
+
+  static uint64_t alignTo8(uint64_t Offset) { return (Offset + 7) & ~7ULL; }
+
+public:
+  PackWriter(): Strings(1, '\0') {}
+
+  // The offset of `Str` in the strings, adding it if it isn't there yet
+  uint32_t intern(const std::string& Str) {
+    if (Str.empty())
+      return 0;
+    auto It = StringOffsets.find(Str);
+    if (It != StringOffsets.end())
+      return It->second;
+    uint32_t Offset = Strings.size();
+    Strings.append(Str.c_str(), Str.size() + 1);
+    StringOffsets.emplace(Str, Offset);
+    return Offset;
+  }
+
+  // Append a node; its names are set from `Module` and `Function`
+  void addNode(const std::string& Module, const std::string& Function,
+               PackNode Node) {
+    Node.Module = intern(Module);
+    Node.Function = intern(Function);
+    Nodes.push_back(Node);
+  }
+
+  void addEdge(uint32_t From, uint32_t To, uint64_t Freq) {
+    Edges.push_back({From, To, Freq});
+  }
+
+  void addContext(uint32_t Parent, uint32_t Node, uint64_t Inclusive,
+                  uint64_t Exclusive) {
+    Contexts.push_back({Parent, Node, Inclusive, Exclusive});
+  }
+
+  // Set column `Name` of node `Node`; the nodes it isn't set for get 0
+  void setColumn(const std::string& Name, unsigned Node, double Value) {
+    auto It = ColumnIds.find(Name);
+    if (It == ColumnIds.end()) {
+      It = ColumnIds.emplace(Name, Columns.size()).first;
+      Columns.emplace_back(intern(Name), std::vector<double>());
+    }
+    std::vector<double>& Values = Columns[It->second].second;
+    if (Values.size() <= Node)
+      Values.resize(Node + 1, 0);
+    Values[Node] = Value;
+  }
+
+  // Write the pack to `FileName`, replacing it at once so that readers
+  // mapping the old one keep it whole.  Return false on an error.
+  bool write(const std::string& FileName) {
+    std::sort(Edges.begin(), Edges.end(),
+              [](const PackEdge& A, const PackEdge& B) {
+                return A.From != B.From ? A.From < B.From : A.To < B.To;
+              });
+    for (auto& Column : Columns)
+      Column.second.resize(Nodes.size(), 0);
+
+    std::vector<PackSection> Sections;
+    std::vector<const void *> Data;
+    auto addSection = [&](uint32_t Kind, uint32_t EntrySize, uint32_t Name,
+                          const void *Entries, uint64_t Count) {
+      Sections.push_back({Kind, EntrySize, Name, 0, 0, Count});
+      Data.push_back(Entries);
+    };
+    addSection(PackStrings, 1, 0, Strings.data(), Strings.size());
+    addSection(PackNodes, sizeof(PackNode), 0, Nodes.data(), Nodes.size());
+    addSection(PackEdges, sizeof(PackEdge), 0, Edges.data(), Edges.size());
+    addSection(PackContexts, sizeof(PackContext), 0, Contexts.data(),
+               Contexts.size());
+    for (auto& Column : Columns)
+      addSection(PackColumn, sizeof(double), Column.first,
+                 Column.second.data(), Column.second.size());
+
+    uint64_t Offset =
+        sizeof(PackHeader) + Sections.size() * sizeof(PackSection);
+    for (PackSection& Section : Sections) {
+      Section.Offset = Offset = alignTo8(Offset);
+      Offset += Section.EntrySize * Section.Count;
+    }
+    PackHeader Header;
+    memcpy(Header.Magic, PackMagic, sizeof(PackMagic));
+    Header.Version = PackVersion;
+    Header.NumSections = Sections.size();
+    Header.FileSize = Offset;
+
+    std::string TmpName = FileName + ".tmp";
+    FILE *Out = fopen(TmpName.c_str(), "wb");
+    if (!Out)
+      return false;
+    bool OK = fwrite(&Header, sizeof(Header), 1, Out) == 1 &&
+              fwrite(Sections.data(), sizeof(PackSection), Sections.size(),
+                     Out) == Sections.size();
+    uint64_t Written = sizeof(PackHeader) +
+                       Sections.size() * sizeof(PackSection);
+    static const char Padding[8] = {0};
+    for (unsigned i = 0; OK && i != Sections.size(); i++) {
+      const PackSection& Section = Sections[i];
+      uint64_t Size = Section.EntrySize * Section.Count;
+      OK = fwrite(Padding, 1, Section.Offset - Written, Out) ==
+               Section.Offset - Written &&
+           fwrite(Data[i], 1, Size, Out) == Size;
+      Written = Section.Offset + Size;
+    }
+    OK &= fclose(Out) == 0;
+    if (!OK || rename(TmpName.c_str(), FileName.c_str()) != 0) {
+      remove(TmpName.c_str());
+      return false;
+    }
+    return true;
+  }
+};
+
+//===----------------------------------------------------------------------===//
+// class PackedProfile: a pack mapped into memory
+//===----------------------------------------------------------------------===//
+
+class PackedProfile {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  const PackSection *Strings, *Nodes, *Edges, *Contexts;
+  std::vector<const PackSection *> Columns;
+
+  const char *getEntry(const PackSection *Section, uint64_t i) const {
+    return Buffer->getBufferStart() + Section->Offset +
+           i * Section->EntrySize;
+  }
+
+public:
+  PackedProfile(): Strings(nullptr), Nodes(nullptr), Edges(nullptr),
+                   Contexts(nullptr) {}
+
+  // Map `FileName`; return false if there is none or it isn't a pack of
+  // this version
+  bool open(const std::string& FileName);
+
+  // A string by its offset ("" if out of bounds)
+  const char *getString(uint32_t Offset) const;
+
+  unsigned getNumNodes() const { return Nodes->Count; }
+  const PackNode& getNode(unsigned i) const {
+    return *(const PackNode *)getEntry(Nodes, i);
+  }
+
+  unsigned getNumEdges() const { return Edges->Count; }
+  const PackEdge& getEdge(unsigned i) const {
+    return *(const PackEdge *)getEntry(Edges, i);
+  }
+
+  unsigned getNumContexts() const { return Contexts->Count; }
+  const PackContext& getContext(unsigned i) const {
+    return *(const PackContext *)getEntry(Contexts, i);
+  }
+
+  // The values of the extra column `Name` by node, null if there is none
+  const double *getColumn(const std::string& Name) const;
+  // The names of the extra columns
+  std::vector<std::string> getColumnNames() const;
+};
+
+#endif // PROFILE_FORMAT_H
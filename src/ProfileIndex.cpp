@@ -0,0 +1,189 @@
+//===- llvmtuner/src/ProfileIndex.cpp: profile queries ----------*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ProfileIndex.h"
+
+#include <map>
+
+using namespace llvm;
+
+ProfileIndex::ProfileIndex(const LoopCallProfile& Profile)
+    : Profile(Profile), Nodes(Profile.GraphNodeMeta()),
+      Contexts(Profile.getContexts()), TotalSamples(0)
+{
+  unsigned NumNodes = Nodes.size();
+  for (unsigned X = 0; X != NumNodes; X++) {
+    const LoopHeader& Node = Nodes[X];
+    Modules.insert(Node.ModuleName);
+    FirstModules.emplace(Node.Function, Node.ModuleName);
+    // the first row wins, as in `LoopCallProfile::findNode`
+    std::string Key = Node.ModuleName + ':' + Node.Function;
+    if (Node.HeaderId == 0)
+      FunctionIds.emplace(Key, X);
+    else
+      LoopIds.emplace(std::make_pair(Key, Node.HeaderId), X);
+    if (Node.Fingerprint) {
+      auto Inserted = FingerprintIds.emplace(
+          std::make_pair(Key, Node.Fingerprint), X);
+      if (!Inserted.second)
+        Inserted.first->second = NoNode;
+    }
+  }
+
+  // the profile's edges come sorted by source, then destination
+  EdgeBegin.assign(NumNodes + 1, 0);
+  for (const auto& Pair : Profile.getEdges())
+    if (Pair.first.first < NumNodes && Pair.first.second < NumNodes) {
+      EdgeBegin[Pair.first.first + 1]++;
+      Edges.push_back({Pair.first.second, Pair.second});
+    }
+  for (unsigned X = 0; X != NumNodes; X++)
+    EdgeBegin[X + 1] += EdgeBegin[X];
+
+  Inclusive.assign(NumNodes, 0);
+  Exclusive.assign(NumNodes, 0);
+  if (Contexts.empty()) {
+    // the node sampled most knows the total best
+    unsigned Hottest = NoNode;
+    for (unsigned X = 0; X != NumNodes; X++) {
+      Inclusive[X] = getFreq(X, X);
+      const LoopCallProfile::NodeStats& NS = Profile.getNodeStats(X);
+      if (NS.Time > 0 &&
+          (Hottest == NoNode ||
+           NS.Samples > Profile.getNodeStats(Hottest).Samples))
+        Hottest = X;
+    }
+    if (Hottest != NoNode) {
+      const LoopCallProfile::NodeStats& NS = Profile.getNodeStats(Hottest);
+      TotalSamples = NS.Samples * 100.0 / NS.Time + 0.5;
+    }
+  } else {
+    TotalSamples = Contexts[0].Inclusive;
+    // both lists by counting sort, the root (context 0) being nobody's
+    unsigned NumContexts = Contexts.size();
+    ChildBegin.assign(NumContexts + 1, 0);
+    NodeContextBegin.assign(NumNodes + 1, 0);
+    for (unsigned C = 1; C != NumContexts; C++) {
+      ChildBegin[Contexts[C].Parent + 1]++;
+      if (Contexts[C].Node < NumNodes)
+        NodeContextBegin[Contexts[C].Node + 1]++;
+    }
+    for (unsigned C = 0; C != NumContexts; C++)
+      ChildBegin[C + 1] += ChildBegin[C];
+    for (unsigned X = 0; X != NumNodes; X++)
+      NodeContextBegin[X + 1] += NodeContextBegin[X];
+    Children.resize(NumContexts - 1);
+    NodeContexts.resize(NodeContextBegin[NumNodes]);
+    std::vector<unsigned> NextChild(ChildBegin.begin(), ChildBegin.end() - 1);
+    std::vector<unsigned> NextContext(NodeContextBegin.begin(),
+                                      NodeContextBegin.end() - 1);
+    for (unsigned C = 1; C != NumContexts; C++) {
+      const LoopCallProfile::Context& Ctx = Contexts[C];
+      Children[NextChild[Ctx.Parent]++] = C;
+      if (Ctx.Node >= NumNodes)
+        continue;
+      NodeContexts[NextContext[Ctx.Node]++] = C;
+      // a node occurs at most once in a context, so no sample counts twice
+      Inclusive[Ctx.Node] += Ctx.Inclusive;
+      Exclusive[Ctx.Node] += Ctx.Exclusive;
+    }
+  }
+
+  ByTime.resize(NumNodes);
+  for (unsigned X = 0; X != NumNodes; X++)
+    ByTime[X] = X;
+  std::stable_sort(ByTime.begin(), ByTime.end(),
+                   [&](unsigned X, unsigned Y) {
+                     return getInclusiveTime(X) > getInclusiveTime(Y);
+                   });
+}
+
+std::string ProfileIndex::getKey(const std::string& Module,
+                                 const std::string& Function) const
+{
+  if (!Modules.count(Module)) {
+    auto It = FirstModules.find(Function);
+    if (It != FirstModules.end())
+      return It->second + ':' + Function;
+  }
+  return Module + ':' + Function;
+}
+
+unsigned ProfileIndex::findFunction(const std::string& Module,
+                                    const std::string& Function) const
+{
+  auto It = FunctionIds.find(getKey(Module, Function));
+  return It == FunctionIds.end() ? NoNode : It->second;
+}
+
+unsigned ProfileIndex::findLoop(const std::string& Module,
+                                const std::string& Function, unsigned HeaderId,
+                                uint64_t Fingerprint) const
+{
+  std::string Key = getKey(Module, Function);
+  if (Fingerprint) {
+    auto It = FingerprintIds.find(std::make_pair(Key, Fingerprint));
+    if (It != FingerprintIds.end() && It->second != NoNode)
+      return It->second;
+  }
+  auto It = LoopIds.find(std::make_pair(Key, HeaderId));
+  if (It == LoopIds.end())
+    return NoNode;
+  // in another build, the same header id may be another loop
+  uint64_t Found = Nodes[It->second].Fingerprint;
+  if (Fingerprint && Found && Found != Fingerprint)
+    return NoNode;
+  return It->second;
+}
+
+uint64_t ProfileIndex::getFreq(unsigned X, unsigned Y) const
+{
+  ArrayRef<Edge> Out = getEdges(X);
+  auto It = std::lower_bound(Out.begin(), Out.end(), Y,
+                             [](const Edge& E, unsigned To) {
+                               return E.To < To;
+                             });
+  return It != Out.end() && It->To == Y ? It->Freq : 0;
+}
+
+float ProfileIndex::getExclusiveTime(unsigned X) const
+{
+  return TotalSamples ? 100.0f * Exclusive[X] / TotalSamples : 0;
+}
+
+std::vector<unsigned> ProfileIndex::getHotCallees(unsigned X,
+                                                  float MinShare) const
+{
+  std::vector<unsigned> Callees;
+  uint64_t N = Inclusive[X];
+  if (Contexts.empty()) {
+    for (const Edge& E : getEdges(X))
+      if (E.To != X && isFunction(E.To) && E.Freq > 0 &&
+          E.Freq >= MinShare * N)
+        Callees.push_back(E.To);
+    return Callees;
+  }
+
+  // the samples of every node in the subtrees of X's contexts
+  std::map<unsigned, uint64_t> Nested;
+  std::vector<unsigned> Worklist(
+      NodeContexts.begin() + NodeContextBegin[X],
+      NodeContexts.begin() + NodeContextBegin[X + 1]);
+  while (!Worklist.empty()) {
+    unsigned C = Worklist.back();
+    Worklist.pop_back();
+    Nested[Contexts[C].Node] += Contexts[C].Inclusive;
+    Worklist.insert(Worklist.end(), Children.begin() + ChildBegin[C],
+                    Children.begin() + ChildBegin[C + 1]);
+  }
+  for (auto& Pair : Nested)
+    if (Pair.first != X && Pair.first < Nodes.size() &&
+        isFunction(Pair.first) && Pair.second > 0 &&
+        Pair.second >= MinShare * N)
+      Callees.push_back(Pair.first);
+  return Callees;
+}
@@ -0,0 +1,148 @@
+//===- llvmtuner/src/ProfileIndex.h: profile queries ------------*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// ProfileIndex is a read-only view of a LoopCallProfile for the tools that
+// query a profile rather than build one.  It is built once the profile is
+// read, and then never changes:
+// + the nodes by module and function name, and the loops by header id and
+//   fingerprint, in hash tables
+// + the graph profile and the calling context tree in compressed sparse row
+//   form: the edges leaving each node, sorted by destination, the contexts
+//   of each node and the children of each context
+// + the samples each node ran in (inclusive) and was innermost in
+//   (exclusive), and the nodes ranked by their share of the time
+// Looking something up never changes the profile, unlike
+// `LoopCallProfile::getFreq`.  The profile must outlive the index.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef PROFILE_INDEX_H
+#define PROFILE_INDEX_H
+
+#include <llvm/ADT/ArrayRef.h>
+
+#include "LoopCallProfile.h"
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <climits>
+
+class ProfileIndex {
+public:
+  // an edge of the graph profile: `Freq` samples ran `To` nested in the
+  // source (its own samples for the edge to itself)
+  struct Edge {
+    unsigned To;
+    uint64_t Freq;
+  };
+
+  static const unsigned NoNode = UINT_MAX;
+
+  explicit ProfileIndex(const LoopCallProfile& Profile);
+
+  unsigned getNumNodes() const { return Nodes.size(); }
+  const LoopHeader& getNode(unsigned X) const { return Nodes[X]; }
+  const LoopCallProfile::NodeStats& getNodeStats(unsigned X) const {
+    return Profile.getNodeStats(X);
+  }
+  bool isFunction(unsigned X) const { return Nodes[X].HeaderId == 0; }
+
+  // The node of a function of module `Module`, or NoNode.  If `Module`
+  // isn't in the profile (say, it was renamed or copied since), the
+  // function is looked for in the first module of the profile that has it.
+  unsigned findFunction(const std::string& Module,
+                        const std::string& Function) const;
+  // The node of a loop of `Function`, by fingerprint if it has one that is
+  // in the profile and no other loop of the function has, otherwise by
+  // header id; NoNode if there is none.  As
+  // with `LoopCallProfile::findNode`, a header id doesn't match a loop with
+  // another fingerprint.
+  // Modules are looked for as by `findFunction`.
+  unsigned findLoop(const std::string& Module, const std::string& Function,
+                    unsigned HeaderId, uint64_t Fingerprint = 0) const;
+
+  // The edges leaving node X, by destination
+  llvm::ArrayRef<Edge> getEdges(unsigned X) const {
+    return llvm::makeArrayRef(Edges.data() + EdgeBegin[X],
+                              Edges.data() + EdgeBegin[X + 1]);
+  }
+  // The frequency of edge (X, Y), 0 if there is none
+  uint64_t getFreq(unsigned X, unsigned Y) const;
+
+  bool hasContexts() const { return !Contexts.empty(); }
+  // The samples of the whole profile; estimated from the flat profile if
+  // there is no calling context tree
+  uint64_t getTotalSamples() const { return TotalSamples; }
+  // The samples in which node X ran, and in which it was the innermost
+  // node.  Without a calling context tree, the first is its self edge and
+  // the second is 0.
+  uint64_t getInclusive(unsigned X) const { return Inclusive[X]; }
+  uint64_t getExclusive(unsigned X) const { return Exclusive[X]; }
+  // The same as shares of all samples, in %; the inclusive one is the
+  // share of the flat profile
+  float getInclusiveTime(unsigned X) const { return getNodeStats(X).Time; }
+  float getExclusiveTime(unsigned X) const;
+
+  // The `K` nodes (at most) that took the largest shares of the time,
+  // hottest first
+  llvm::ArrayRef<unsigned> getHottest(unsigned K) const {
+    return llvm::makeArrayRef(ByTime.data(),
+                              std::min<size_t>(K, ByTime.size()));
+  }
+
+  // The functions that ran nested in node X, directly or not, for at least
+  // `MinShare` of its samples, by node.  With a calling context tree only
+  // the samples under X's contexts count; otherwise the graph profile's
+  // edges are used, which cover indirect calls as well.
+  std::vector<unsigned> getHotCallees(unsigned X, float MinShare) const;
+
+private:
+  const LoopCallProfile& Profile;
+  const std::vector<LoopHeader>& Nodes;
+
+  // The key of `Function` of `Module` in the tables below
+  std::string getKey(const std::string& Module,
+                     const std::string& Function) const;
+
+  // by "module:function"; and the loops by (module:function, header id)
+  // and by (module:function, fingerprint), NoNode for a fingerprint loops
+  // of the function share
+  struct KeyHash {
+    size_t operator()(const std::pair<std::string, uint64_t>& Key) const {
+      return std::hash<std::string>()(Key.first) ^
+             (std::hash<uint64_t>()(Key.second) * 0x9E3779B97F4A7C15ULL);
+    }
+  };
+  typedef std::unordered_map<std::pair<std::string, uint64_t>, unsigned,
+                             KeyHash> LoopMap;
+  std::unordered_map<std::string, unsigned> FunctionIds;
+  LoopMap LoopIds, FingerprintIds;
+  // the modules of the profile, and the first one of each function
+  std::unordered_set<std::string> Modules;
+  std::unordered_map<std::string, std::string> FirstModules;
+
+  // the edges of node X are Edges[EdgeBegin[X], EdgeBegin[X + 1])
+  std::vector<unsigned> EdgeBegin;
+  std::vector<Edge> Edges;
+
+  // the calling context tree: the node of each context, its children in
+  // Children[ChildBegin[C], ChildBegin[C + 1]), and the contexts of node X
+  // in NodeContexts[NodeContextBegin[X], NodeContextBegin[X + 1])
+  const std::vector<LoopCallProfile::Context>& Contexts;
+  std::vector<unsigned> ChildBegin, Children;
+  std::vector<unsigned> NodeContextBegin, NodeContexts;
+  uint64_t TotalSamples;
+
+  std::vector<uint64_t> Inclusive, Exclusive;
+  std::vector<unsigned> ByTime;
+};
+
+#endif // PROFILE_INDEX_H
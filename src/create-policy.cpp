@@ -25,18 +25,23 @@
 #include "LoopName.h"
 #include "LoopPolicy.h"
 #include "LoopCallProfile.h"
+#include "ProfileIndex.h"
 
 #include <set>
 #include <string>
 #include <vector>
 #include <climits>
 #include <iostream>
+#include <fstream>
 #include <sstream>
 
 using namespace llvm;
 
 uint32_t TUNING_UPPERBOUND = UINT_MAX;
 uint32_t TUNING_LOWERBOUND = 0;
+// a loop nested in a candidate replaces it if it takes at least this share
+// (in %) of the candidate's time
+uint32_t TUNING_INNER_SHARE = 90;
 
 
 //===----------------------------------------------------------------------===//
@@ -104,14 +109,16 @@ LoopPolicy* ExtractPolicyBase::makeFormattedPolicy
 
   // First, add all the top-level loops
   for (auto& LH: candidateLoops)
-    newPolicy->addLoop(LoopName(LH.ModuleName, LH.Function, LH.HeaderId));
+    newPolicy->addLoop(LoopName(LH.ModuleName, LH.Function, LH.HeaderId,
+				LH.OuterIds, LH.Fingerprint));
 
-  // Then, add the loops (across the whole pgm) for each function
+  // Then, add the loops (across the whole pgm) for each function, to the
+  // policy of the module defining the function
   for (auto& policyPair: thePolicy) {
     unsigned topLevelLoop = policyPair.first;
     unsigned funcToCall   = policyPair.second;
-    newPolicy->addLoopForFunc("",
-			      DynCG.getLoopNameForId(funcToCall).getFuncName(),
+    const LoopName& funcName = DynCG.getLoopNameForId(funcToCall);
+    newPolicy->addLoopForFunc(funcName.getModule(), funcName.getFuncName(),
 			      DynCG.getLoopNameForId(topLevelLoop));
   }
   return newPolicy;
@@ -251,39 +258,56 @@ LoopPolicy* ExtractThresholdPolicy::computePolicy()
   RawPolicyMap thePolicy;
   
   // Use base class method to read in the two profile files into:
-  // this->CGNodes: Array listing the nodes
   // this->DynCG  : Matrix of profile info per loop and function
-  const std::vector<LoopHeader>& CGNodes = DynCG.GraphNodeMeta();
+  // and index it for the queries below
+  ProfileIndex Index(DynCG);
   
-  // Sort the nesting graph to help compare thresholds
-  LoopCallProfile& sortedCG = DynCG; //topologicalSort(DynCG);
-  
-  // Sorting above guarantees that the caller appears before the callee
-  // (outer loop before inner loop) in the sortedCG.  
-  // Visit only outermost loops.
-  std::set<unsigned> ignoreInner;
-  //for (auto& ??: sortedCG) {	// FIXME: Compute sorted CG
-  for (auto& LH: CGNodes) {
-    unsigned i = LH.HeaderId;
-    if (ignoreInner.find(i) != ignoreInner.end())
+  // Visit the nodes hottest first, so that a loop is seen before the loops
+  // and functions nested in it (they can't take more of the time).
+  // Visit only outermost loops; functions are extracted along with the
+  // loops calling them, so they don't hide the loops they call.
+  std::vector<bool> ignoreInner(Index.getNumNodes(), false);
+  for (unsigned i : Index.getHottest(Index.getNumNodes())) {
+    if (ignoreInner[i] || Index.isFunction(i))
       continue;
-    float time = (float) sortedCG.getFreq(i,i);
-    if (time >= TUNING_LOWERBOUND && time <= TUNING_UPPERBOUND) {
-      // If this is a loop, add it to the policy
-      if (! DynCG.isFunction(LH.HeaderId))
-	candidateLoops.push_back(LH);
+    // Only take loops that are above the lower bound with 95% confidence,
+    // so that short, noisy profiles don't make candidates out of nothing
+    const LoopCallProfile::NodeStats& NS = Index.getNodeStats(i);
+    if (NS.TimeLo >= TUNING_LOWERBOUND && NS.Time <= TUNING_UPPERBOUND) {
+      // Remember nested loops to ignore
+      for (const ProfileIndex::Edge& E : Index.getEdges(i))
+	ignoreInner[E.To] = true;
+
+      // A loop nesting a loop that takes nearly all its time is tuned
+      // through the inner loop, which is smaller
+      unsigned chosen = i;
+      for (bool found = true; found;) {
+	found = false;
+	for (const ProfileIndex::Edge& E : Index.getEdges(chosen)) {
+	  unsigned j = E.To;
+	  if (j == chosen || !Index.getNode(j).isNestedIn(Index.getNode(chosen)))
+	    continue;
+	  if (Index.getInclusiveTime(j) * 100 >=
+	      Index.getInclusiveTime(chosen) * TUNING_INNER_SHARE) {
+	    chosen = j;
+	    found = true;
+	    break;
+	  }
+	}
+      }
+
+      // Add the loop to the policy
+      candidateLoops.push_back(Index.getNode(chosen));
 
       // Now add the loop for all the functions called by the loop
-      for (auto j: DynCG.getNested(i)) {
-	ignoreInner.emplace(j);		 // Remember nested loops to ignore
-	
-	// Add the functions called from the loop 'i' to the policy
-	if (DynCG.isFunction(j))
-	  thePolicy.emplace(i, j);	// Function j is called from loop i
-
-      }//endfor j: DynCG.nested(i)
+      for (const ProfileIndex::Edge& E : Index.getEdges(chosen)) {
+	// Add the functions called from the loop to the policy
+	if (E.To != chosen && Index.isFunction(E.To))
+	  thePolicy.emplace(chosen, E.To);	// Function is called from it
+
+      }//endfor E: Index.getEdges(chosen)
     }//endif (time is within the required range)
-  }//endfor i: sortedCG
+  }//endfor i: Index.getHottest()
 
   return makeFormattedPolicy(candidateLoops, thePolicy);
 }
@@ -300,6 +324,18 @@ static cl::opt<int> pmax("pmax", cl::init(-1), cl::value_desc("max%"),
 			 cl::desc("retain loops with %time <= this value "
 				  "(default max: 100%)"));
 
+static cl::opt<std::string> OutputFilename("o", cl::init(""),
+					   cl::value_desc("filename"),
+					   cl::desc("write the policy to this "
+						    "file, for extract-loops "
+						    "-policy (default: "
+						    "stdout)"));
+
+static cl::opt<int> pinner("inner-share", cl::init(-1), cl::value_desc("%"),
+			   cl::desc("tune a loop nested in a retained loop "
+				    "instead if it takes at least this share "
+				    "of its time (default: 90%)"));
+
 int main(int argc, char** argv)
 {
   ExtractThresholdPolicy thresholdPolicyObj;
@@ -309,15 +345,27 @@ int main(int argc, char** argv)
     TUNING_LOWERBOUND = pmin;
   if (pmax < 100)
     TUNING_UPPERBOUND = pmax;
+  if (pinner >= 0)
+    TUNING_INNER_SHARE = pinner;
 #ifndef NDEBUG
-  std::cout<< argv[0]<< " pmin="<< pmin<< "% pmax="<< pmax<< "%" << std::endl;
+  std::cerr<< argv[0]<< " pmin="<< pmin<< "% pmax="<< pmax<< "%" << std::endl;
 #endif
 
   LoopPolicy* policy = thresholdPolicyObj.computePolicy();
-  if (policy != nullptr) {
+  if (policy == nullptr)
+    return 0;
+  if (OutputFilename.empty()) {
     std::cout << *policy;
-    delete policy;
+  } else {
+    std::ofstream out(OutputFilename);
+    out << *policy;
+    if (!out) {
+      std::cerr << "Cannot write " << OutputFilename << std::endl;
+      delete policy;
+      return 1;
+    }
   }
+  delete policy;
   return 0;
 }
 
@@ -24,6 +24,7 @@
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
 #include "LoopCallProfile.h"
+#include "ProfileIndex.h"
 
 using namespace llvm;
 
@@ -37,7 +38,7 @@ cl::opt<unsigned> DevirtThreshold("devirt-threshold", cl::init(20),
 class Devirtualization : public ModulePass {
   std::vector<CallSite> findIndirectCalls(Module&);
   std::vector<Function *> getTargets(const CallSite &IndirectCall,
-                                     LoopCallProfile &DynCG);
+                                     const ProfileIndex &Index);
   bool devirtualize(CallSite &IndirectCall,
                     const std::vector<Function *>& Targets);
 public:
@@ -70,17 +71,22 @@ std::vector<CallSite> Devirtualization::findIndirectCalls(Module &M)
 
 /// get a list of "hot" targets
 std::vector<Function *>
-Devirtualization::getTargets(const CallSite &IndirectCall, LoopCallProfile &DynCG)
+Devirtualization::getTargets(const CallSite &IndirectCall,
+                             const ProfileIndex &Index)
 { 
   std::vector<Function *> Targets;
   auto *Caller = IndirectCall.getCaller();
   auto *M = Caller->getParent();
-  unsigned CallerId = DynCG.getFuncIdForFuncName(Caller->getName().str());
-  for (unsigned CalleeId : DynCG.getNested(CallerId)) {
-    auto &CalleeName = DynCG.getLoopNameForId(CalleeId).getFuncName(); 
-    auto *Callee = cast<Function>(M->getFunction(CalleeName));
-    if (DynCG.getFreq(CallerId, CalleeId) > DevirtThreshold &&
-        Callee->hasAddressTaken()) {
+  unsigned CallerId = Index.findFunction(M->getModuleIdentifier(),
+                                         Caller->getName().str());
+  if (CallerId == ProfileIndex::NoNode)
+    return Targets;
+  for (const ProfileIndex::Edge &E : Index.getEdges(CallerId)) {
+    // callees of other modules can't be called directly
+    if (E.To == CallerId || !Index.isFunction(E.To))
+      continue;
+    auto *Callee = M->getFunction(Index.getNode(E.To).Function);
+    if (Callee && E.Freq > DevirtThreshold && Callee->hasAddressTaken()) {
       Targets.push_back(Callee);
     }
   }
@@ -198,11 +204,12 @@ bool Devirtualization::runOnModule(Module &M)
   auto IndirectCalls = findIndirectCalls(M);
   LoopCallProfile DynCG;
   DynCG.readProfiles();
+  ProfileIndex Index(DynCG);
 
   bool Changed = false;
 
   for (CallSite& CS : IndirectCalls) {
-    std::vector<Function *> Targets = getTargets(CS, DynCG);
+    std::vector<Function *> Targets = getTargets(CS, Index);
     Changed |= devirtualize(CS, Targets);
   }
 
@@ -0,0 +1,288 @@
+//===- llvmtuner/src/diff-profiles.cpp: compare loop profiles -*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compare the loop profile of a new build (or input, or rollout) with that
+// of a base one, loop by loop, to find what got slower:
+//
+//	diff-profiles base/ new/ -o diff.csv -edges edges.diff.csv
+//	diff-profiles base/ new/ -max-regression 10 -min-share 1
+//
+// Loops are matched by module, function and fingerprint, or header id where
+// there is no fingerprint (see ProfileIndex::findLoop).  For every loop and
+// function the diff gives its share of the time and its time in ms in both
+// profiles, with the p-value of the change: a two-proportion z-test of the
+// samples for the share, and a z-test of the two times, each taken to be
+// as precise as its samples (Poisson), for the time.  The edges of the
+// graph profiles (how much of the time one node ran nested in another)
+// are compared like shares.
+//
+// With -max-regression, the exit code is 1 if a loop or function that took
+// at least -min-share % of the time in either profile got slower by more
+// than that many % with p < -alpha, so the diff can gate a build; 2 is an
+// error.  "Slower" is in ms if both profiles have times, in shares if not.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/Support/CommandLine.h>
+
+#include "LoopCallProfile.h"
+#include "ProfileIndex.h"
+
+#include <map>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+BasePrefix(cl::Positional, cl::desc("<base profile prefix>"), cl::Required);
+
+static cl::opt<std::string>
+NewPrefix(cl::Positional, cl::desc("<new profile prefix>"), cl::Required);
+
+static cl::opt<std::string>
+OutputFilename("o", cl::desc("Write the diff of loops and functions here"),
+               cl::value_desc("filename"), cl::init("-"));
+
+static cl::opt<std::string>
+EdgesFilename("edges", cl::desc("Write the diff of graph edges here"),
+              cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<float>
+MaxRegression("max-regression",
+              cl::desc("Fail if a hot loop got slower by more than this %"),
+              cl::value_desc("pct"), cl::init(0));
+
+static cl::opt<float>
+MinShare("min-share",
+         cl::desc("Time share (%) of the loops -max-regression applies to"),
+         cl::value_desc("pct"), cl::init(1));
+
+static cl::opt<float>
+Alpha("alpha", cl::desc("Significance level of regressions"),
+      cl::init(0.05));
+
+// Two-sided p-value of a z score
+static double getPValue(double Z)
+{
+  return std::erfc(std::fabs(Z) / std::sqrt(2.0));
+}
+
+// p-value of the difference between shares Ka/Na and Kb/Nb
+static double testShares(double Ka, double Na, double Kb, double Nb)
+{
+  if (Na <= 0 || Nb <= 0)
+    return 1;
+  double Pooled = (Ka + Kb) / (Na + Nb);
+  double Var = Pooled * (1 - Pooled) * (1 / Na + 1 / Nb);
+  if (Var <= 0)
+    return Ka / Na == Kb / Nb ? 1 : 0;
+  return getPValue((Kb / Nb - Ka / Na) / std::sqrt(Var));
+}
+
+// p-value of the difference between times Ta and Tb (in ms) measured with
+// Ka and Kb samples
+static double testTimes(double Ta, double Ka, double Tb, double Kb)
+{
+  double Var = (Ka > 0 ? Ta * Ta / Ka : 0) + (Kb > 0 ? Tb * Tb / Kb : 0);
+  if (Var <= 0)
+    return Ta == Tb ? 1 : 0;
+  return getPValue((Tb - Ta) / std::sqrt(Var));
+}
+
+// Relative change from A to B in %
+static double getChange(double A, double B)
+{
+  if (A == 0)
+    return B == 0 ? 0 : INFINITY;
+  return 100 * (B - A) / A;
+}
+
+static std::string getNodeName(const LoopHeader& Node)
+{
+  if (isFunction(Node.HeaderId))
+    return Node.Function;
+  return Node.Function + ":loop " + Node.getPath();
+}
+
+static bool hasTimes(const ProfileIndex& Index)
+{
+  for (unsigned X = 0, E = Index.getNumNodes(); X != E; X++)
+    if (Index.getNodeStats(X).TimeMs > 0)
+      return true;
+  return false;
+}
+
+// A loop or function of either profile, and what became of it
+struct NodeDiff {
+  unsigned Base, New; // nodes in either profile, NoNode if it isn't there
+  double ShareP, TimeP;
+  double Change;      // the one -max-regression applies to
+  double Delta;       // of the time, or of the share
+};
+
+int main(int argc, char** argv)
+{
+  cl::ParseCommandLineOptions(argc, argv, "Compare loop profiles");
+
+  LoopCallProfile BaseProfile, NewProfile;
+  BaseProfile.readProfiles(BasePrefix);
+  NewProfile.readProfiles(NewPrefix);
+  if (BaseProfile.GraphNodeMeta().empty() ||
+      NewProfile.GraphNodeMeta().empty()) {
+    std::cerr << "No profile found in "
+              << (BaseProfile.GraphNodeMeta().empty() ? BasePrefix
+                                                      : NewPrefix)
+              << std::endl;
+    return 2;
+  }
+  ProfileIndex Base(BaseProfile), New(NewProfile);
+  double Na = Base.getTotalSamples(), Nb = New.getTotalSamples();
+  bool InMs = hasTimes(Base) && hasTimes(New);
+
+  // match the nodes of the base profile in the new one
+  const unsigned NoNode = ProfileIndex::NoNode;
+  std::vector<unsigned> BaseToNew(Base.getNumNodes(), NoNode);
+  std::vector<unsigned> NewToBase(New.getNumNodes(), NoNode);
+  for (unsigned X = 0, E = Base.getNumNodes(); X != E; X++) {
+    const LoopHeader& Node = Base.getNode(X);
+    unsigned Y = Base.isFunction(X)
+                     ? New.findFunction(Node.ModuleName, Node.Function)
+                     : New.findLoop(Node.ModuleName, Node.Function,
+                                    Node.HeaderId, Node.Fingerprint);
+    if (Y != NoNode && NewToBase[Y] == NoNode) {
+      BaseToNew[X] = Y;
+      NewToBase[Y] = X;
+    }
+  }
+
+  static const LoopCallProfile::NodeStats None;
+  auto getStats = [&](const ProfileIndex& Index, unsigned X)
+      -> const LoopCallProfile::NodeStats& {
+    return X == NoNode ? None : Index.getNodeStats(X);
+  };
+
+  std::vector<NodeDiff> Diffs;
+  auto addDiff = [&](unsigned X, unsigned Y) {
+    const LoopCallProfile::NodeStats& A = getStats(Base, X);
+    const LoopCallProfile::NodeStats& B = getStats(New, Y);
+    NodeDiff D;
+    D.Base = X;
+    D.New = Y;
+    D.ShareP = testShares(A.Samples, Na, B.Samples, Nb);
+    D.TimeP = testTimes(A.TimeMs, A.Samples, B.TimeMs, B.Samples);
+    D.Change = InMs ? getChange(A.TimeMs, B.TimeMs)
+                    : getChange(A.Time, B.Time);
+    D.Delta = InMs ? B.TimeMs - A.TimeMs : B.Time - A.Time;
+    Diffs.push_back(D);
+  };
+  for (unsigned X = 0, E = Base.getNumNodes(); X != E; X++)
+    addDiff(X, BaseToNew[X]);
+  for (unsigned Y = 0, E = New.getNumNodes(); Y != E; Y++)
+    if (NewToBase[Y] == NoNode)
+      addDiff(NoNode, Y);
+  // what got slower first
+  std::stable_sort(Diffs.begin(), Diffs.end(),
+                   [](const NodeDiff& L, const NodeDiff& R) {
+                     return L.Delta > R.Delta;
+                   });
+
+  std::ofstream Fout;
+  if (OutputFilename != "-")
+    Fout.open(OutputFilename);
+  std::ostream& Out = OutputFilename != "-" ? Fout : std::cout;
+  Out << "module,function,header-id,fingerprint,status,"
+         "time-base(pct),time-new(pct),time-p,time-base(ms),time-new(ms),"
+         "ms-p,change(pct),regressed\n";
+  unsigned NumRegressed = 0;
+  for (const NodeDiff& D : Diffs) {
+    const LoopHeader& Node =
+        D.New != NoNode ? New.getNode(D.New) : Base.getNode(D.Base);
+    const LoopCallProfile::NodeStats& A = getStats(Base, D.Base);
+    const LoopCallProfile::NodeStats& B = getStats(New, D.New);
+    // a loop that is new or gone has nothing to regress from
+    bool Regressed = MaxRegression.getNumOccurrences() &&
+                     D.Base != NoNode && D.New != NoNode &&
+                     std::max(A.Time, B.Time) >= MinShare &&
+                     D.Change > MaxRegression &&
+                     (InMs ? D.TimeP : D.ShareP) < Alpha;
+    char Fingerprint[17];
+    snprintf(Fingerprint, sizeof(Fingerprint), "%016llx",
+             (unsigned long long)Node.Fingerprint);
+    Out << Node.ModuleName << ',' << Node.Function << ','
+        << Node.HeaderId << ',' << Fingerprint << ','
+        << (D.Base == NoNode ? "new" : D.New == NoNode ? "gone" : "matched")
+        << ',' << A.Time << ',' << B.Time << ',' << D.ShareP << ','
+        << A.TimeMs << ',' << B.TimeMs << ',' << D.TimeP << ','
+        << D.Change << ',' << (Regressed ? "yes" : "no") << '\n';
+    if (Regressed) {
+      std::cerr << "Regressed: " << getNodeName(Node) << ", "
+                << (InMs ? A.TimeMs : A.Time) << " -> "
+                << (InMs ? B.TimeMs : B.Time) << (InMs ? " ms" : "%")
+                << " (+" << D.Change << "%, p="
+                << (InMs ? D.TimeP : D.ShareP) << ")" << std::endl;
+      NumRegressed++;
+    }
+  }
+  if (!Out) {
+    std::cerr << "Cannot write " << OutputFilename << std::endl;
+    return 2;
+  }
+
+  if (!EdgesFilename.empty()) {
+    // the edges between distinct nodes, by the nodes of either profile;
+    // self edges are the nodes' own samples, diffed above
+    std::map<std::pair<unsigned, unsigned>, std::pair<uint64_t, uint64_t>>
+        BaseEdges, NewEdges;
+    for (unsigned X = 0, E = Base.getNumNodes(); X != E; X++)
+      for (const ProfileIndex::Edge& Edge : Base.getEdges(X))
+        if (Edge.To != X)
+          BaseEdges[std::make_pair(X, Edge.To)] =
+              std::make_pair(Edge.Freq, uint64_t(0));
+    for (unsigned Y = 0, E = New.getNumNodes(); Y != E; Y++)
+      for (const ProfileIndex::Edge& Edge : New.getEdges(Y)) {
+        if (Edge.To == Y)
+          continue;
+        unsigned X = NewToBase[Y], To = NewToBase[Edge.To];
+        if (X != NoNode && To != NoNode &&
+            BaseEdges.count(std::make_pair(X, To)))
+          BaseEdges[std::make_pair(X, To)].second = Edge.Freq;
+        else
+          NewEdges[std::make_pair(Y, Edge.To)] =
+              std::make_pair(uint64_t(0), Edge.Freq);
+      }
+
+    std::ofstream EdgeOut(EdgesFilename);
+    EdgeOut << "from,to,freq-base,freq-new,share-base(pct),share-new(pct),"
+               "share-p\n";
+    auto writeEdge = [&](const LoopHeader& From, const LoopHeader& To,
+                         std::pair<uint64_t, uint64_t> Freqs) {
+      EdgeOut << getNodeName(From) << ',' << getNodeName(To) << ','
+              << Freqs.first << ',' << Freqs.second << ','
+              << (Na > 0 ? 100 * Freqs.first / Na : 0) << ','
+              << (Nb > 0 ? 100 * Freqs.second / Nb : 0) << ','
+              << testShares(Freqs.first, Na, Freqs.second, Nb) << '\n';
+    };
+    for (auto& Pair : BaseEdges)
+      writeEdge(Base.getNode(Pair.first.first),
+                Base.getNode(Pair.first.second), Pair.second);
+    for (auto& Pair : NewEdges)
+      writeEdge(New.getNode(Pair.first.first),
+                New.getNode(Pair.first.second), Pair.second);
+    if (!EdgeOut) {
+      std::cerr << "Cannot write " << EdgesFilename << std::endl;
+      return 2;
+    }
+  }
+  return NumRegressed ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+//===- llvmtuner/src/export-profile.cpp: export loop profiles -*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Export the calling context tree of a loop profile for viewers that don't
+// know about loops.  Every function and loop is a frame: "foo" for function
+// foo, "foo:loop 3/7" for its loop 7 nested in loop 3.
+//
+//	export-profile -folded prof.folded	# flamegraph.pl prof.folded
+//	export-profile -trace prof.json		# chrome://tracing, Perfetto
+//
+// -folded writes one line of collapsed stacks ("main;main:loop 3;foo 42")
+// for every context the samples were taken in, weighted by its exclusive
+// samples.  -trace writes Chrome trace events: the profile of each window
+// between two snapshots of the process (see LOOP_PROF_SNAPSHOT_INTERVAL),
+// and of the last one up to its exit, as a flame chart laid over the
+// window's wall-clock time.  Without snapshots, that's a single window.
+//
+// The profile of the last snapshot is read whole, calling context tree
+// included, to name the frames and write the collapsed stacks.  The trace
+// streams the contexts of each snapshot one at a time and keeps a few words
+// per distinct context of the one before, so it needs no more memory than
+// that for any number of snapshots.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/Support/CommandLine.h>
+
+#include "LoopCallProfile.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+FoldedFilename("folded",
+               cl::desc("Write collapsed stacks to this file (- for stdout)"),
+               cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<std::string>
+TraceFilename("trace",
+              cl::desc("Write Chrome trace events to this file (- for stdout)"),
+              cl::value_desc("filename"), cl::init(""));
+
+// The frames of the nodes of a profile
+static std::vector<std::string> getFrameNames(const LoopCallProfile& Profile)
+{
+  std::vector<std::string> Names;
+  for (const LoopHeader& Node : Profile.GraphNodeMeta()) {
+    std::string Name = Node.Function;
+    if (!isFunction(Node.HeaderId))
+      Name += ":loop " + Node.getPath();
+    // ';' separates frames of collapsed stacks
+    for (char& C : Name)
+      if (C == ';')
+        C = ':';
+    Names.push_back(Name);
+  }
+  return Names;
+}
+
+static std::string escapeJSON(const std::string& Str)
+{
+  std::string Escaped;
+  for (char C : Str) {
+    if (C == '"' || C == '\\')
+      Escaped += '\\';
+    if ((unsigned char)C >= ' ')
+      Escaped += C;
+  }
+  return Escaped;
+}
+
+// Write the stacks of the contexts of `Profile`
+static void writeFolded(const LoopCallProfile& Profile,
+                        const std::vector<std::string>& Names,
+                        std::ostream& Out)
+{
+  const std::vector<LoopCallProfile::Context>& Contexts =
+      Profile.getContexts();
+  std::string Stack;
+  for (unsigned Ctx = 1, E = Contexts.size(); Ctx != E; Ctx++) {
+    if (!Contexts[Ctx].Exclusive)
+      continue;
+    Stack.clear();
+    for (unsigned Node : Profile.getContextPath(Ctx)) {
+      if (!Stack.empty())
+        Stack += ';';
+      Stack += Node < Names.size() ? Names[Node] : "?";
+    }
+    Out << Stack << ' ' << Contexts[Ctx].Exclusive << '\n';
+  }
+}
+
+// The wall-clock window of a snapshot (or of the final profile) in ms,
+// from its info file; false if there is none
+static bool readWindow(const std::string& FileName, double& Begin,
+                       double& End, int& Pid)
+{
+  std::ifstream Fin(FileName);
+  if (!Fin)
+    return false;
+  Begin = End = 0;
+  Pid = 0;
+  std::string Line;
+  while (std::getline(Fin, Line)) {
+    size_t Eq = Line.find('=');
+    if (Eq == std::string::npos)
+      continue;
+    std::string Key = Line.substr(0, Eq);
+    std::istringstream Value(Line.substr(Eq + 1));
+    if (Key == "window-begin(ms)")
+      Value >> Begin;
+    else if (Key == "window-end(ms)")
+      Value >> End;
+    else if (Key == "pid")
+      Value >> Pid;
+  }
+  return End > Begin;
+}
+
+// The snapshots of a profile in the order they were taken: 1, 2, ... and
+// then the final profile (0), if the process exited
+static std::vector<unsigned> findSnapshots(const std::string& Prefix)
+{
+  std::vector<unsigned> Snapshots;
+  for (unsigned Snapshot = 1;; Snapshot++) {
+    if (!std::ifstream(LoopCallProfile::getFileName(Prefix, ContextFileName,
+                                                    Snapshot)))
+      break;
+    Snapshots.push_back(Snapshot);
+  }
+  if (std::ifstream(Prefix + ContextFileName))
+    Snapshots.push_back(0);
+  return Snapshots;
+}
+
+// Write the trace events of the windows of `Snapshots`.  Snapshots are
+// cumulative and the runtime only appends contexts, so the samples of a
+// window are the difference between its snapshot and the one before it,
+// context by context.  In a window, the samples of a context span a share
+// of the window's time, and its children are laid out one after the other
+// in its span.
+static void writeTrace(const std::string& Prefix,
+                       const std::vector<unsigned>& Snapshots,
+                       const std::vector<std::string>& Names,
+                       std::ostream& Out)
+{
+  // of the previous snapshot: the parent, node and inclusive samples of
+  // every context
+  std::vector<unsigned> Parents, Nodes;
+  std::vector<uint64_t> Inclusive;
+  // of this window: where the next child of each context starts (in us)
+  std::vector<double> NextStart;
+  const char* Separator = "\n";
+  Out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  for (unsigned Snapshot : Snapshots) {
+    double Begin, End;
+    int Pid;
+    if (!readWindow(LoopCallProfile::getFileName(Prefix, ProfileInfoFileName,
+                                                 Snapshot),
+                    Begin, End, Pid))
+      continue;
+    std::string Window =
+        Snapshot ? "snapshot " + std::to_string(Snapshot) : "exit";
+
+    double UsPerSample = 0;
+    unsigned Ctx = 0;
+    LoopCallProfile::streamContexts(
+        LoopCallProfile::getFileName(Prefix, ContextFileName, Snapshot),
+        [&](unsigned Parent, unsigned Node, uint64_t Incl, uint64_t) {
+          uint64_t Samples = Incl;
+          if (Ctx < Nodes.size() && Parents[Ctx] == Parent &&
+              Nodes[Ctx] == Node) {
+            Samples -= std::min(Samples, Inclusive[Ctx]);
+          } else {
+            // a new context, or another process
+            Parents.resize(Ctx + 1);
+            Nodes.resize(Ctx + 1);
+            Inclusive.resize(Ctx + 1);
+            Parents[Ctx] = Parent;
+            Nodes[Ctx] = Node;
+          }
+          Inclusive[Ctx] = Incl;
+          NextStart.resize(Ctx + 1);
+
+          double Start, Duration;
+          if (Ctx == 0) {
+            Start = Begin * 1e3;
+            Duration = (End - Begin) * 1e3;
+            UsPerSample = Samples ? Duration / Samples : 0;
+          } else {
+            Start = Parent < Ctx ? NextStart[Parent] : Begin * 1e3;
+            Duration = Samples * UsPerSample;
+            if (Parent < Ctx)
+              NextStart[Parent] += Duration;
+          }
+          NextStart[Ctx] = Start;
+          const std::string& Name =
+              Ctx == 0 ? Window : Node < Names.size() ? Names[Node] : "?";
+          Ctx++;
+          if (Samples == 0)
+            return;
+
+          Out << Separator << "{\"name\":\"" << escapeJSON(Name)
+              << "\",\"ph\":\"X\",\"pid\":" << Pid
+              << ",\"tid\":0,\"ts\":" << (uint64_t)Start
+              << ",\"dur\":" << (uint64_t)Duration
+              << ",\"args\":{\"samples\":" << Samples << "}}";
+          Separator = ",\n";
+        });
+  }
+  Out << "\n]}\n";
+}
+
+int main(int argc, char** argv)
+{
+  cl::ParseCommandLineOptions(argc, argv, "Export loop profiles");
+  if (FoldedFilename.empty() && TraceFilename.empty()) {
+    std::cerr << "Nothing to export: give -folded or -trace" << std::endl;
+    return 1;
+  }
+
+  // the nodes of a profile are those of the snapshots before it and more,
+  // so the last one names them all
+  std::vector<unsigned> Snapshots = findSnapshots(ProfilePrefix);
+  LoopCallProfile Profile;
+  if (!Snapshots.empty())
+    Profile.readProfiles(ProfilePrefix, Snapshots.back());
+  if (Profile.getContexts().empty()) {
+    std::cerr << "No calling context tree in " << ProfilePrefix
+              << ContextFileName << std::endl;
+    return 1;
+  }
+  std::vector<std::string> Names = getFrameNames(Profile);
+
+  if (FoldedFilename == "-") {
+    writeFolded(Profile, Names, std::cout);
+  } else if (!FoldedFilename.empty()) {
+    std::ofstream Out(FoldedFilename);
+    writeFolded(Profile, Names, Out);
+    if (!Out) {
+      std::cerr << "Cannot write " << FoldedFilename << std::endl;
+      return 1;
+    }
+  }
+  if (TraceFilename == "-") {
+    writeTrace(ProfilePrefix, Snapshots, Names, std::cout);
+  } else if (!TraceFilename.empty()) {
+    std::ofstream Out(TraceFilename);
+    writeTrace(ProfilePrefix, Snapshots, Names, Out);
+    if (!Out) {
+      std::cerr << "Cannot write " << TraceFilename << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
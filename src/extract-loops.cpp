@@ -8,11 +8,14 @@
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker/Linker.h>
 #include <llvm/Pass.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/Debug.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/PrettyStackTrace.h>
 #include <llvm/Support/Signals.h>
 #include <llvm/Support/SourceMgr.h>
@@ -26,15 +29,23 @@
 #include <llvm/Transforms/Scalar.h>
 
 #include "LoopCallProfile.h"
+#include "LoopFingerprint.h"
 #include "LoopName.h"
+#include "LoopPolicy.h"
+#include "ProfileIndex.h"
+#include <atomic>
 #include <fstream>
 #include <sstream>
 #include <utility>
+#include <tuple>
+#include <algorithm>
 #include <set>
 #include <memory>
 #include <string>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <thread>
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
@@ -60,11 +71,31 @@ struct LoopHeaderParser : public cl::parser<LoopHeader> {
       return true;
 
     LH.Function = Arg.substr(0, sep);
-    int Id = LH.HeaderId = std::atoi(Arg.substr(sep + 1).c_str());
-    if (Id <= 0) {
+    std::string Id = Arg.substr(sep + 1);
+    size_t Hash = Id.find('#');
+    LH.Fingerprint = 0;
+    if (Hash != std::string::npos) {
+      LH.Fingerprint = parseFingerprint(Id.substr(Hash + 1));
+      Id.erase(Hash);
+      if (!LH.Fingerprint) {
+        errs() << "Fingerprint must be 16 hex digits\n";
+        return true;
+      }
+    }
+
+    // the header id may be left out if the fingerprint is given
+    LH.HeaderId = UINT_MAX;
+    LH.OuterIds.clear();
+    if (Id.empty() && LH.Fingerprint)
+      return false;
+    std::vector<unsigned> Path;
+    if (!parseLoopPath(Id, Path) || std::count(Path.begin(), Path.end(), 0)) {
       errs() << "Header id must be a positive integer\n";
       return true;
     }
+    LH.HeaderId = Path.back();
+    Path.pop_back();
+    LH.OuterIds = Path;
 
     return false;
   }
@@ -74,8 +105,9 @@ static cl::opt<std::string> ExtractedListFile(
     "e", cl::desc("file where name of extracted functions will be listed"),
     cl::init("extracted.list"));
 
-static cl::opt<std::string>
-    InputFilename(cl::Positional, cl::desc("<input file>"), cl::Required);
+static cl::list<std::string>
+    InputFilenames(cl::Positional, cl::desc("<input file>..."),
+                   cl::OneOrMore);
 
 static cl::opt<std::string> OuputPrefix("p", cl::desc("Specify output prefix"),
                                         cl::value_desc("output prefix"),
@@ -84,8 +116,77 @@ static cl::opt<std::string> OuputPrefix("p", cl::desc("Specify output prefix"),
 static cl::list<LoopHeader, bool, LoopHeaderParser>
     LoopsToExtract("l",
                    cl::desc("Specify loop(s) to extract.\nDescribe a loop in "
-                            "this format:\n\"[function],[loop header]\""),
-                   cl::OneOrMore, cl::Prefix);
+                            "this format:\n\"[function],[loop header]\"\n"
+                            "or, for a nested loop, optionally "
+                            "\"[function],[outer header]/.../[loop header]\"\n"
+                            "followed by \"#[fingerprint]\" to find it by "
+                            "its fingerprint"),
+                   cl::ZeroOrMore, cl::Prefix);
+
+static cl::opt<std::string> PolicyFilename(
+    "policy",
+    cl::desc("Extract the loops of a policy written by create-policy -o "
+             "from the (unlinked) input modules, instead of -l"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<std::string> BlockMapFilename(
+    "block-map",
+    cl::desc("Find the loops of -l by the ids they had when profiled, in an "
+             "input laid out by reorder-functions -edge-profile -block-map"),
+    cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<unsigned>
+    NumThreads("j",
+               cl::desc("Number of modules to extract from at once with "
+                        "-policy (default: one per core)"),
+               cl::init(0));
+
+static cl::opt<float> HotCalleeThreshold(
+    "hot-callee",
+    cl::desc("Only copy callees that run for at least this fraction of the "
+             "time of the loop they are extracted with"),
+    cl::init(0.01));
+
+// The loops to extract from one input module, and what became of them.
+// Each module is extracted from on its own, in a context of its own, so
+// that modules can be extracted from at once.
+struct ModuleExtraction {
+  std::string InputFilename;
+  // of its output modules, numbered from 0
+  std::string OutputPrefix;
+  unsigned NumOutputs;
+
+  std::vector<LoopHeader> Loops;
+  // with a policy: the names of the loops in it, the functions of this
+  // module to copy along with each loop, and the functions to copy into
+  // the modules of loops of other modules (by loop name)
+  std::vector<std::string> LoopNames;
+  std::vector<std::vector<std::string>> LocalCallees;
+  std::map<std::string, std::vector<std::string>> ForeignCallees;
+  // the loops (of `Loops`) that also get functions of other modules
+  std::vector<bool> NeedsLinking;
+
+  // the extracted loops, their headers and the index of each in `Loops`
+  std::vector<GlobalValue *> ExtractedLoops;
+  std::vector<LoopHeader> Headers;
+  std::vector<unsigned> Requested;
+  std::map<std::string, std::string> Renaming;
+  // mapping <extracted loop> -> <names of functions that needs to be
+  // copied and extracted together with the map>
+  std::map<std::string, std::vector<std::string>> Called;
+
+  // its lines of the list of extracted modules
+  std::string List;
+  // the bitcode of the copies of `ForeignCallees`, by loop name
+  std::map<std::string, std::string> Exports;
+  // the modules of loops waiting for functions of other modules
+  struct UnlinkedModule {
+    std::string LoopName, FileName, ExtractedName, Bitcode;
+  };
+  std::vector<UnlinkedModule> Unlinked;
+
+  ModuleExtraction() : NumOutputs(0) {}
+};
 
 struct LoopExtractor : public ModulePass {
   static char ID;
@@ -94,11 +195,18 @@ struct LoopExtractor : public ModulePass {
 
   virtual void getAnalysisUsage(AnalysisUsage &) const override;
 
-  LoopExtractor() : ModulePass(ID) {
+  // with a policy, the callees come from it rather than from the profile
+  LoopExtractor(ModuleExtraction *Job = nullptr,
+                const ProfileIndex *Index = nullptr)
+      : ModulePass(ID), Job(Job), Index(Index) {
     initializeLoopExtractorPass(*PassRegistry::getPassRegistry());
   }
 
   const char *getPassName() const override { return "LoopExtractor pass"; }
+
+private:
+  ModuleExtraction *Job;
+  const ProfileIndex *Index;
 };
 
 void LoopExtractor::getAnalysisUsage(AnalysisUsage &AU) const {
@@ -114,13 +222,29 @@ INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
 INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
 INITIALIZE_PASS_END(LoopExtractor, "", "", true, true)
 
-static std::vector<GlobalValue *> ExtractedLoops;
-static std::vector<LoopHeader> Headers;
-static std::map<std::string, std::string> Renaming;
+// mapping function -> <old id> -> <new id> of the blocks that moved, as
+// written by reorder-functions -block-map
+static std::map<std::string, std::map<unsigned, unsigned>> BlockMap;
 
-// mapping <extracted loop> -> <names of functions that needs to be copied and
-// extracted together with the map>
-static std::map<std::string, std::vector<std::string>> Called;
+static bool readBlockMap() {
+  std::ifstream Fin(BlockMapFilename.c_str());
+  if (!Fin)
+    return false;
+  std::string Line;
+
+  // skip header
+  std::getline(Fin, Line);
+  while (std::getline(Fin, Line)) {
+    std::istringstream Fields(Line);
+    std::string Function;
+    unsigned Old, New;
+    char Comma;
+    std::getline(Fields, Function, ',');
+    if (Fields >> Old >> Comma >> New)
+      BlockMap[Function][Old] = New;
+  }
+  return true;
+}
 
 // read meta data of the call graph node
 std::vector<LoopHeader> readGraphNodeMeta() {
@@ -144,17 +268,15 @@ std::vector<LoopHeader> readGraphNodeMeta() {
 
 bool LoopExtractor::runOnModule(Module &M) {
   bool Changed = false;
+  auto &Renaming = Job->Renaming;
 
-  LoopCallProfile DynCG;
-  DynCG.readProfiles();
-  std::vector<LoopHeader> CGNodes = DynCG.GraphNodeMeta();
-
-  // mapping function -> ids of basic blocks
-  std::map<std::string, std::set<unsigned>> Loops;
-  for (LoopHeader &LH : LoopsToExtract)
-    Loops[LH.Function].insert(LH.HeaderId);
+  // mapping function -> loops to extract from it, by index in `Job->Loops`
+  std::map<std::string, std::vector<unsigned>> Loops;
+  for (unsigned k = 0, e = Job->Loops.size(); k != e; k++)
+    Loops[Job->Loops[k].Function].push_back(k);
 
-  std::vector<std::pair<Loop *, LoopHeader>> ToExtract;
+  // the loops and their headers, with the index of the loop asked for
+  std::vector<std::tuple<Loop *, LoopHeader, unsigned>> ToExtract;
 
   for (auto &I : Loops) {
     Function *F = M.getFunction(I.first);
@@ -167,28 +289,98 @@ bool LoopExtractor::runOnModule(Module &M) {
       }
     }
 
-    std::set<unsigned> &Ls = I.second;
-
     LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
     DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
 
     unsigned i = 0;
+    std::map<BasicBlock *, unsigned> HeaderIds;
+    std::map<unsigned, uint64_t> Fingerprints;
+    std::multimap<uint64_t, unsigned> LoopsByFingerprint;
+    for (BasicBlock &BB : *F) {
+      HeaderIds[&BB] = ++i;
+      Loop *L = LI.getLoopFor(&BB);
+      if (L && L->getHeader() == &BB) {
+        Fingerprints[i] = getLoopFingerprint(*L);
+        LoopsByFingerprint.emplace(Fingerprints[i], i);
+      }
+    }
+    i = 0;
+
+    // the blocks of a function laid out since it was profiled have new ids,
+    // and its loops new fingerprints: its loops are found by their old ids
+    auto Moved = BlockMap.find(I.first);
+    bool LaidOut = Moved != BlockMap.end();
+    auto getNewId = [&](unsigned Id) {
+      if (!LaidOut || !Moved->second.count(Id))
+        return Id;
+      return Moved->second[Id];
+    };
+
+    // mapping ids of basic blocks -> the loop asked for and the enclosing
+    // loops' ids given with it, if any.  A loop given by fingerprint may have
+    // moved since it was profiled; its path is stale then.
+    std::map<unsigned, std::pair<unsigned, std::vector<unsigned>>> Ls;
+    for (unsigned k : I.second) {
+      const LoopHeader &LH = Job->Loops[k];
+      if (LaidOut) {
+        if (LH.HeaderId == UINT_MAX)
+          error("the blocks of " + I.first + " were laid out again, give "
+                "the header id of loop " + formatFingerprint(LH.Fingerprint));
+        std::vector<unsigned> OuterIds;
+        for (unsigned Id : LH.OuterIds)
+          OuterIds.push_back(getNewId(Id));
+        Ls[getNewId(LH.HeaderId)] = std::make_pair(k, OuterIds);
+        continue;
+      }
+      unsigned Id = LH.HeaderId;
+      if (LH.Fingerprint && Fingerprints[Id] != LH.Fingerprint) {
+        // identical loops share their fingerprint (without debug info)
+        unsigned Matches = LoopsByFingerprint.count(LH.Fingerprint);
+        if (Matches != 1)
+          error(std::to_string(Matches) + " loops of " + I.first +
+                " have fingerprint " + formatFingerprint(LH.Fingerprint));
+        Id = LoopsByFingerprint.find(LH.Fingerprint)->second;
+        if (LH.HeaderId != UINT_MAX)
+          errs() << "[Warning]: loop " << LH.HeaderId << " of " << I.first
+                 << " is loop " << Id << " now\n";
+      }
+      Ls[Id] = std::make_pair(
+          k, Id == LH.HeaderId ? LH.OuterIds : std::vector<unsigned>());
+    }
 
     // find basic blocks that are loop headers of loops that the user
     // wants to extract
     for (BasicBlock &BB : *F) {
-      if (Ls.find(++i) == Ls.end())
+      auto LIt = Ls.find(++i);
+      if (LIt == Ls.end())
         continue;
 
       Loop *L = LI.getLoopFor(&BB);
-      if (!L || L->getParentLoop() || &BB != L->getHeader() ||
-          !L->isLoopSimplifyForm())
-        error("basic block " + std::to_string(i) +
-              " is not a loop header of top level loop");
-
-      // "remember" this loop and extract it later
-      ToExtract.emplace_back(
-        std::pair<Loop *, LoopHeader>(L, LoopHeader(F->getName(), i)));
+      if (!L || &BB != L->getHeader() || !L->isLoopSimplifyForm())
+        error("basic block " + std::to_string(i) + " is not a loop header");
+
+      // the path given must name loops enclosing this one, and a loop
+      // can't be extracted together with a loop nested in it
+      std::set<unsigned> Outer;
+      for (Loop *P = L->getParentLoop(); P; P = P->getParentLoop()) {
+        unsigned Id = HeaderIds[P->getHeader()];
+        Outer.insert(Id);
+        if (Ls.count(Id))
+          error("loop " + std::to_string(i) + " of " + I.first +
+                " is nested in loop " + std::to_string(Id) +
+                ", which is extracted too");
+      }
+      for (unsigned Id : LIt->second.second)
+        if (!Outer.count(Id))
+          error("loop " + std::to_string(i) + " of " + I.first +
+                " is not nested in loop " + std::to_string(Id));
+
+      // "remember" this loop and extract it later, by the name it has in
+      // the profile
+      const LoopHeader &LH = Job->Loops[LIt->second.first];
+      LoopHeader Header(F->getName(), LaidOut ? LH.HeaderId : i);
+      Header.Fingerprint = LaidOut ? LH.Fingerprint : getLoopFingerprint(*L);
+      ToExtract.emplace_back(L, Header, LIt->second.first);
       Changed = true;
     }
 
@@ -196,9 +388,9 @@ bool LoopExtractor::runOnModule(Module &M) {
     SplitAllCriticalEdges(*F, CriticalEdgeSplittingOptions(&DT, &LI));
 
     // actually extract loops
-    for (auto &Pair : ToExtract) {
-      Loop *L = Pair.first;
-      LoopHeader &Header = Pair.second;
+    for (auto &Tuple : ToExtract) {
+      Loop *L = std::get<0>(Tuple);
+      LoopHeader &Header = std::get<1>(Tuple);
       CodeExtractor CE(DT, *L, true);
       Function *Extracted = CE.extractCodeRegion();
       if (!Extracted)
@@ -206,30 +398,31 @@ bool LoopExtractor::runOnModule(Module &M) {
 
       Extracted->setVisibility(GlobalValue::DefaultVisibility);
       Extracted->setLinkage(GlobalValue::ExternalLinkage);
-      ExtractedLoops.push_back(Extracted);
-      Headers.push_back(Header);
-
-      unsigned CallerIdx = -1;
-      for (unsigned i = 0, e = CGNodes.size(); i != e; i++) {
-        if (CGNodes[i] == Header) {
-          CallerIdx = i;
-          break;
-        }
+      Job->ExtractedLoops.push_back(Extracted);
+      Job->Headers.push_back(Header);
+      Job->Requested.push_back(std::get<2>(Tuple));
+
+      // the policy says which functions of this module go with the loop
+      if (!Index) {
+        Job->Called[Extracted->getName()] =
+            Job->LocalCallees[std::get<2>(Tuple)];
+        continue;
       }
-      assert(CallerIdx >= 0 && "Extracted loop index not found?");
 
-      unsigned N = DynCG.getFreq(CallerIdx, CallerIdx);
-      // find out what functions are called by the loops
-      for (unsigned CalleeIdx=0, E=CGNodes.size(); CalleeIdx < E; CalleeIdx++) {
-        if (CalleeIdx == CallerIdx)
-          continue;
-        float TimeSpent = (float)DynCG.getFreq(CallerIdx, CalleeIdx) / N;
-        if (!std::isnan(TimeSpent) && TimeSpent > 0) {
-          auto &Node = CGNodes[CalleeIdx];
-          if (Node.HeaderId == 0)
-            Called[Extracted->getName()].push_back(Node.Function);
-        }
-      }
+      // a profile of another build has other header ids
+      unsigned CallerIdx =
+          Index->findLoop(M.getModuleIdentifier(), Header.Function,
+                          Header.HeaderId, Header.Fingerprint);
+      if (CallerIdx == ProfileIndex::NoNode)
+        error("loop " + std::to_string(Header.HeaderId) + " of " +
+              Header.Function + " is not in the profile");
+
+      // Find out what functions are called by the loops.  With a calling
+      // context tree, only keep those that are hot under this loop.
+      float MinShare = Index->hasContexts() ? (float)HotCalleeThreshold : 0;
+      for (unsigned CalleeIdx : Index->getHotCallees(CallerIdx, MinShare))
+        Job->Called[Extracted->getName()].push_back(
+            Index->getNode(CalleeIdx).Function);
     }
     ToExtract.resize(0);
   }
@@ -237,18 +430,19 @@ bool LoopExtractor::runOnModule(Module &M) {
   return Changed;
 }
 
-std::string newFileName() {
-  static int ModuleId = 0;
-  return OuputPrefix + "." + std::to_string(ModuleId++) + ".bc";
+
+std::string newFileName(ModuleExtraction &Job) {
+  return Job.OutputPrefix + "." + std::to_string(Job.NumOutputs++) + ".bc";
 }
 
 // return functions called (including those called indirectly) by `Caller`)
-std::vector<GlobalValue *> getCalledFuncs(Module *M, Function *Caller) {
+std::vector<GlobalValue *> getCalledFuncs(ModuleExtraction &Job, Module *M,
+                                          Function *Caller) {
   std::vector<GlobalValue *> Funcs;
-  for (auto &CalleeName : Called[Caller->getName()]) {
+  for (auto &CalleeName : Job.Called[Caller->getName()]) {
     auto *F = M->getFunction(CalleeName);
     if (!F)
-      F = M->getFunction(Renaming[CalleeName]);
+      F = M->getFunction(Job.Renaming[CalleeName]);
     assert(F && "Called function not found in new module");
     Funcs.push_back(F);
   }
@@ -261,14 +455,14 @@ struct GraphNodeMeta {
   bool IsFunc; // could be a loop
 };
 
-void externalizeSymbol(GlobalValue &G) {
+void externalizeSymbol(ModuleExtraction &Job, GlobalValue &G) {
   char FilePath[PATH_MAX];
-  realpath(InputFilename.c_str(), FilePath);
+  realpath(Job.InputFilename.c_str(), FilePath);
   if (G.hasHiddenVisibility() || G.hasInternalLinkage() ||
       G.hasPrivateLinkage()) {
     auto NewName = std::string("autotuner.internals.") + FilePath + "." +
                    G.getName().str();
-    Renaming[G.getName().str()] = NewName;
+    Job.Renaming[G.getName().str()] = NewName;
     G.setName(NewName);
     G.setVisibility(GlobalValue::DefaultVisibility);
     G.setLinkage(GlobalValue::ExternalLinkage);
@@ -277,41 +471,48 @@ void externalizeSymbol(GlobalValue &G) {
 
 // change internal non-constant globals to external and rename to avoid
 // name-conflict
-void externalize(Module &M) {
+void externalize(ModuleExtraction &Job, Module &M) {
   for (GlobalVariable &G : M.globals()) {
-    externalizeSymbol(G);
+    externalizeSymbol(Job, G);
   }
   for (Function &F : M.functions()) {
-    externalizeSymbol(F);
+    externalizeSymbol(Job, F);
   }
 }
 
-int main(int argc, char **argv) {
-  // Print a stack trace if we signal out.
-  sys::PrintStackTraceOnErrorSignal();
-  PrettyStackTraceProgram X(argc, argv);
-
-  cl::ParseCommandLineOptions(argc, argv, "top-level loop extractor");
+// GVExtractor turns appending linkage into external linkage
+static void removeAppendingGlobals(Module &M) {
+  SmallVector<GlobalVariable *, 4> ToRemove;
+  for (GlobalVariable &GV : M.globals())
+    if (GV.hasAppendingLinkage())
+      ToRemove.push_back(&GV);
+  for (GlobalVariable *GV : ToRemove)
+    GV->removeFromParent();
+}
 
-  LLVMContext &Context = getGlobalContext();
+// Extract the loops of `Job` from its module: write the module without them
+// and a module for each one, with its callees in the module.  A loop that
+// also gets callees of other modules is kept in memory instead, as are the
+// copies of this module's callees for loops of other modules.
+static bool extractModule(ModuleExtraction &Job, const ProfileIndex *Index,
+                          const char *ProgName, raw_ostream &ErrOS) {
+  LLVMContext Context;
   SMDiagnostic Err;
-  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  std::unique_ptr<Module> M = parseIRFile(Job.InputFilename, Err, Context);
 
   if (!M.get()) {
-    Err.print(argv[0], errs());
-    return 1;
+    Err.print(ProgName, ErrOS);
+    return false;
   }
 
   std::error_code EC;
 
-  std::ofstream ExtractedList(ExtractedListFile);
-
   legacy::PassManager Extraction;
 
-  externalize(*M.get());
+  externalize(Job, *M.get());
 
   // extract loops
-  Extraction.add(new LoopExtractor());
+  Extraction.add(new LoopExtractor(&Job, Index));
   Extraction.add(createJumpThreadingPass());
   Extraction.add(createCFGSimplificationPass());
   Extraction.run(*M.get());
@@ -319,54 +520,63 @@ int main(int argc, char **argv) {
   Module *CopiedModule = CloneModule(M.get());
 
   legacy::PassManager PM;
-  std::string MainModuleName = newFileName();
+  std::string MainModuleName = newFileName(Job);
   tool_output_file Out(MainModuleName, EC, sys::fs::F_None);
   if (EC) {
-    errs() << EC.message() << '\n';
-    return 1;
+    ErrOS << EC.message() << '\n';
+    return false;
   }
   // remove extracted loops from the main module
-  PM.add(createGVExtractionPass(ExtractedLoops, true));
+  PM.add(createGVExtractionPass(Job.ExtractedLoops, true));
   PM.add(createBitcodeWriterPass(Out.os(), true));
   PM.run(*M.get());
 
-  ExtractedList << MainModuleName << '\n';
+  Job.List += MainModuleName + '\n';
 
   // now remove everything in a new module except
   // the extracted loop and its callees (which will also be internalized)
-  for (unsigned i = 0, e = ExtractedLoops.size(); i != e; i++) {
-    GlobalValue *Extracted = ExtractedLoops[i];
-    LoopHeader &Header = Headers[i];
+  for (unsigned i = 0, e = Job.ExtractedLoops.size(); i != e; i++) {
+    GlobalValue *Extracted = Job.ExtractedLoops[i];
+    LoopHeader &Header = Job.Headers[i];
+    unsigned k = Job.Requested[i];
 
     Module *NewModule = CloneModule(CopiedModule);
     std::string ExtractedName = Extracted->getName();
     Function *ExtractedF = NewModule->getFunction(ExtractedName);
     std::vector<GlobalValue *> ToPreserve =
-        getCalledFuncs(NewModule, ExtractedF);
+        getCalledFuncs(Job, NewModule, ExtractedF);
     ToPreserve.push_back(ExtractedF);
 
-    std::string BitcodeFName = newFileName();
+    std::string BitcodeFName = newFileName(Job);
 
     // report which loop was in which bitcode file
-    ExtractedList << ExtractedName << '\t' << Header.Function << '\t'
-                  << Header.HeaderId << '\t' << BitcodeFName << '\n';
-
-    tool_output_file ExtractedOut(BitcodeFName, EC, sys::fs::F_None);
-    if (EC) {
-      errs() << EC.message() << '\n';
-      return 1;
-    }
+    Job.List += ExtractedName + '\t' + Header.Function + '\t' +
+                std::to_string(Header.HeaderId) + '\t' + BitcodeFName + '\n';
 
-    // GVExtractor turns appending linkage into external linkage
-    SmallVector<GlobalVariable *, 4> ToRemove;
-    for (GlobalVariable &GV : NewModule->globals())
-      if (GV.hasAppendingLinkage())
-        ToRemove.push_back(&GV);
-    for (GlobalVariable *GV : ToRemove)
-      GV->removeFromParent();
+    removeAppendingGlobals(*NewModule);
 
     legacy::PassManager PM;
     PM.add(createGVExtractionPass(ToPreserve, false));
+    if (!Job.NeedsLinking.empty() && Job.NeedsLinking[k]) {
+      // internalized once the callees of other modules are linked in
+      ModuleExtraction::UnlinkedModule Unlinked;
+      Unlinked.LoopName = Job.LoopNames[k];
+      Unlinked.FileName = BitcodeFName;
+      Unlinked.ExtractedName = ExtractedName;
+      raw_string_ostream BitcodeOS(Unlinked.Bitcode);
+      PM.add(createBitcodeWriterPass(BitcodeOS, true));
+      PM.run(*NewModule);
+      BitcodeOS.flush();
+      Job.Unlinked.push_back(std::move(Unlinked));
+      delete NewModule;
+      continue;
+    }
+
+    tool_output_file ExtractedOut(BitcodeFName, EC, sys::fs::F_None);
+    if (EC) {
+      ErrOS << EC.message() << '\n';
+      return false;
+    }
     PM.add(createInternalizePass(
         std::vector<const char *>{ExtractedName.c_str()}));
     PM.add(createBitcodeWriterPass(ExtractedOut.os(), true));
@@ -376,6 +586,254 @@ int main(int argc, char **argv) {
     delete NewModule;
   }
 
+  // copy the callees of loops of other modules
+  for (auto &Pair : Job.ForeignCallees) {
+    Module *NewModule = CloneModule(CopiedModule);
+    std::vector<GlobalValue *> ToPreserve;
+    for (auto &CalleeName : Pair.second) {
+      Function *F = NewModule->getFunction(CalleeName);
+      if (!F)
+        F = NewModule->getFunction(Job.Renaming[CalleeName]);
+      if (!F || F->isDeclaration()) {
+        ErrOS << "[Warning]: " << Job.InputFilename << " doesn't define "
+              << CalleeName << ", called by " << Pair.first << '\n';
+        continue;
+      }
+      ToPreserve.push_back(F);
+    }
+    removeAppendingGlobals(*NewModule);
+
+    legacy::PassManager PM;
+    raw_string_ostream BitcodeOS(Job.Exports[Pair.first]);
+    PM.add(createGVExtractionPass(ToPreserve, false));
+    PM.add(createBitcodeWriterPass(BitcodeOS, true));
+    PM.run(*NewModule);
+    BitcodeOS.flush();
+    delete NewModule;
+  }
+
   Out.keep();
+  delete CopiedModule;
+  return true;
+}
+
+// Link the callees of other modules into the module of a loop, and write it
+static bool
+linkLoopModule(const ModuleExtraction::UnlinkedModule &Unlinked,
+               const std::vector<const std::string *> &Callees,
+               const char *ProgName, raw_ostream &ErrOS) {
+  LLVMContext Context;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIR(
+      MemoryBufferRef(Unlinked.Bitcode, Unlinked.FileName), Err, Context);
+  if (!M) {
+    Err.print(ProgName, ErrOS);
+    return false;
+  }
+  for (const std::string *Bitcode : Callees) {
+    std::unique_ptr<Module> Src =
+        parseIR(MemoryBufferRef(*Bitcode, Unlinked.FileName), Err, Context);
+    if (!Src) {
+      Err.print(ProgName, ErrOS);
+      return false;
+    }
+    if (Linker::linkModules(*M, std::move(Src))) {
+      ErrOS << "Cannot link the callees of " << Unlinked.LoopName << " into "
+            << Unlinked.FileName << '\n';
+      return false;
+    }
+  }
+
+  std::error_code EC;
+  tool_output_file ExtractedOut(Unlinked.FileName, EC, sys::fs::F_None);
+  if (EC) {
+    ErrOS << EC.message() << '\n';
+    return false;
+  }
+  legacy::PassManager PM;
+  PM.add(createInternalizePass(
+      std::vector<const char *>{Unlinked.ExtractedName.c_str()}));
+  PM.add(createBitcodeWriterPass(ExtractedOut.os(), true));
+  PM.run(*M);
+  ExtractedOut.keep();
+  return true;
+}
+
+// Run `Work(i, ErrOS)` for i in [0, N) on -j threads, the calling one
+// included.  Return false if any of them does.
+template <typename FnTy> static bool runParallel(unsigned N, FnTy Work) {
+  unsigned NumWorkers = NumThreads;
+  if (!NumWorkers)
+    NumWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+  NumWorkers = std::min(NumWorkers, N);
+
+  std::atomic<unsigned> Next(0);
+  std::atomic<bool> Failed(false);
+  std::mutex ErrLock;
+  auto work = [&]() {
+    for (unsigned i; (i = Next++) < N;) {
+      std::string Errors;
+      raw_string_ostream ErrOS(Errors);
+      if (!Work(i, ErrOS))
+        Failed = true;
+      // not interleaved with those of the other jobs
+      ErrOS.flush();
+      if (!Errors.empty()) {
+        std::lock_guard<std::mutex> Lock(ErrLock);
+        errs() << Errors;
+      }
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned i = 1; i < NumWorkers; i++)
+    Workers.emplace_back(work);
+  work();
+  for (auto &Worker : Workers)
+    Worker.join();
+  return !Failed;
+}
+
+// The policy of an input module: the one of its name, or else the only one
+// of its file name, as the profile may name it by another path
+static const ModulePolicyInfo *findPolicy(const LoopPolicy &Policy,
+                                          const std::string &InputFilename) {
+  if (const ModulePolicyInfo *MP = Policy.getPolicy(InputFilename))
+    return MP;
+  const ModulePolicyInfo *Found = nullptr;
+  for (auto &Pair : Policy) {
+    if (sys::path::filename(Pair.first) != sys::path::filename(InputFilename))
+      continue;
+    if (Found)
+      return nullptr;
+    Found = Pair.second;
+  }
+  return Found;
+}
+
+// Set up the extraction from each input module to follow a policy
+static bool readPolicy(const LoopPolicy &Policy,
+                       std::vector<ModuleExtraction> &Jobs) {
+  // mapping loop -> the job extracting it and its index there; a loop may
+  // be named with or without its fingerprint
+  std::map<LoopName, std::pair<unsigned, unsigned>, LoopNameComp> LoopJobs;
+  std::vector<const ModulePolicyInfo *> Policies;
+  std::set<const ModulePolicyInfo *> Used;
+  for (unsigned j = 0, e = Jobs.size(); j != e; j++) {
+    ModuleExtraction &Job = Jobs[j];
+    const ModulePolicyInfo *MP = findPolicy(Policy, Job.InputFilename);
+    Policies.push_back(MP);
+    if (!MP)
+      continue;
+    if (!Used.insert(MP).second) {
+      errs() << "[Error]: module " << MP->getModule()
+             << " of the policy is given twice\n";
+      return false;
+    }
+    for (const LoopName &LN : MP->getLoops()) {
+      LoopJobs[LN] = std::make_pair(j, Job.Loops.size());
+      Job.Loops.push_back(LoopHeader(LN));
+      Job.LoopNames.push_back(LN.toString());
+    }
+    Job.LocalCallees.resize(Job.Loops.size());
+    Job.NeedsLinking.resize(Job.Loops.size());
+  }
+  for (auto &Pair : Policy)
+    if (!Used.count(Pair.second) && !Pair.second->getLoops().empty())
+      errs() << "[Warning]: no input module for " << Pair.first
+             << ", its loops are not extracted\n";
+
+  // each callee is copied from the module defining it
+  for (unsigned j = 0, e = Jobs.size(); j != e; j++) {
+    if (!Policies[j])
+      continue;
+    for (auto &Pair : Policies[j]->getFuncs())
+      for (const LoopName &LN : *Pair.second) {
+        auto It = LoopJobs.find(LN);
+        if (It == LoopJobs.end())
+          continue;
+        unsigned Owner = It->second.first, k = It->second.second;
+        if (Owner == j) {
+          Jobs[j].LocalCallees[k].push_back(Pair.first);
+        } else {
+          Jobs[j].ForeignCallees[Jobs[Owner].LoopNames[k]].push_back(
+              Pair.first);
+          Jobs[Owner].NeedsLinking[k] = true;
+        }
+      }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv, "top-level loop extractor");
+
+  // one job per input module, numbering its outputs apart from the others'
+  std::vector<ModuleExtraction> Jobs(InputFilenames.size());
+  for (unsigned j = 0, e = Jobs.size(); j != e; j++) {
+    Jobs[j].InputFilename = InputFilenames[j];
+    Jobs[j].OutputPrefix =
+        e == 1 ? OuputPrefix : OuputPrefix + "." + std::to_string(j);
+  }
+
+  // the callees of each loop come from the policy if there is one, or else
+  // from the profile, read once for all modules
+  LoopPolicy Policy;
+  LoopCallProfile DynCG;
+  std::unique_ptr<ProfileIndex> Index;
+  if (!PolicyFilename.empty()) {
+    if (!LoopsToExtract.empty()) {
+      errs() << argv[0] << ": give either -policy or -l\n";
+      return 1;
+    }
+    std::ifstream Fin(PolicyFilename.c_str());
+    if (!(Fin >> Policy)) {
+      errs() << "Cannot read a policy from " << PolicyFilename << '\n';
+      return 1;
+    }
+    if (!readPolicy(Policy, Jobs))
+      return 1;
+  } else {
+    if (Jobs.size() != 1 || LoopsToExtract.empty()) {
+      errs() << argv[0] << ": give one input module and -l, or -policy\n";
+      return 1;
+    }
+    Jobs[0].Loops.assign(LoopsToExtract.begin(), LoopsToExtract.end());
+    if (!BlockMapFilename.empty() && !readBlockMap()) {
+      errs() << "Cannot read " << BlockMapFilename << '\n';
+      return 1;
+    }
+    DynCG.readProfiles();
+    Index.reset(new ProfileIndex(DynCG));
+  }
+
+  // registered before the workers start
+  initializeLoopExtractorPass(*PassRegistry::getPassRegistry());
+  bool Extracted = runParallel(Jobs.size(), [&](unsigned j, raw_ostream &OS) {
+    return extractModule(Jobs[j], Index.get(), argv[0], OS);
+  });
+
+  // then the modules of loops with callees in other modules
+  std::vector<const ModuleExtraction::UnlinkedModule *> Unlinked;
+  for (auto &Job : Jobs)
+    for (auto &U : Job.Unlinked)
+      Unlinked.push_back(&U);
+  bool Linked = runParallel(Unlinked.size(), [&](unsigned i, raw_ostream &OS) {
+    std::vector<const std::string *> Callees;
+    for (auto &Job : Jobs) {
+      auto It = Job.Exports.find(Unlinked[i]->LoopName);
+      if (It != Job.Exports.end())
+        Callees.push_back(&It->second);
+    }
+    return linkLoopModule(*Unlinked[i], Callees, argv[0], OS);
+  });
+
+  std::ofstream ExtractedList(ExtractedListFile);
+  for (auto &Job : Jobs)
+    ExtractedList << Job.List;
   ExtractedList.close();
+  return Extracted && Linked ? 0 : 1;
 }
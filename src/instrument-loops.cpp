@@ -15,6 +15,8 @@
 #include <llvm/IR/Type.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/Bitcode/BitcodeWriterPass.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/FileSystem.h>
@@ -25,20 +27,136 @@
 #include <llvm/Support/SystemUtils.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
 
 #include <vector>
+#include <map>
 #include <set>
+#include <string>
 #include <utility>
 #include <initializer_list>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "LoopCallProfile.h"
+#include "LoopFingerprint.h"
+#include "LoopValues.h"
 
 using namespace llvm;
 
 cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<input file>"),
-                                   cl::Required);
+                                   cl::init(""));
 
 cl::opt<std::string> OutputFilename("o", cl::desc("Specify output file name"),
                                     cl::value_desc("<output file>"));
 
+cl::opt<bool> ThreadLocal("thread-local",
+                          cl::desc("Keep the loop nesting state in "
+                                   "thread-local storage and profile each "
+                                   "thread separately"),
+                          cl::init(false));
+
+cl::opt<bool> ExactTiming("exact-timing",
+                          cl::desc("Also count the cycles spent in each "
+                                   "function and profiled loop with the "
+                                   "cycle counter"),
+                          cl::init(false));
+
+cl::opt<bool> LowOverhead("low-overhead",
+                          cl::desc("Keep the counters of each thread in one "
+                                   "cache-line aligned block, the run counts "
+                                   "apart from the loop descriptions, and "
+                                   "don't probe tiny functions"),
+                          cl::init(false));
+
+cl::opt<unsigned> MinInstrs("min-instrs",
+                            cl::desc("Don't probe functions without loops "
+                                     "that have fewer instructions than this "
+                                     "(default 20 with -low-overhead)"),
+                            cl::init(0));
+
+cl::opt<float> CandidateThreshold(
+    "candidate-threshold",
+    cl::desc("Only probe the functions and loops that took at "
+             "least this share of the time (in %) in the profile read "
+             "from -prof-prefix"),
+    cl::init(0));
+
+cl::opt<bool> TripCounts("trip-counts",
+                         cl::desc("Keep a log2 histogram of the iterations "
+                                  "per entry of each profiled loop"),
+                         cl::init(false));
+
+cl::opt<bool> LoopLatency("loop-latency",
+                          cl::desc("Keep a log2 histogram of the cycles per "
+                                   "entry (and, with -trip-counts, per "
+                                   "iteration) of each profiled loop"),
+                          cl::init(false));
+
+cl::opt<bool> EdgeCounts("edge-counts",
+                         cl::desc("Count how often each edge of the CFG of "
+                                  "the probed functions is taken (to lay "
+                                  "out their blocks)"),
+                         cl::init(false));
+
+cl::opt<bool> ValueProfile("value-profile",
+                           cl::desc("Record the most frequent trip-count "
+                                    "bounds and strides of the profiled "
+                                    "loops and the alignment of the "
+                                    "pointers they use, at their preheaders"),
+                           cl::init(false));
+
+cl::opt<unsigned> MemSample("mem-sample",
+                            cl::desc("Sample the memory accesses of the "
+                                     "profiled top-level loops to one in "
+                                     "this many cache lines, for their "
+                                     "working sets and reuse distances "
+                                     "(0: don't)"),
+                            cl::init(0));
+
+cl::opt<std::string> BatchFilename("batch",
+                                   cl::desc("Instrument the modules listed in "
+                                            "this file, as lines of \"<input "
+                                            "file> <output file>\", instead"),
+                                   cl::value_desc("filename"), cl::init(""));
+
+cl::opt<unsigned> NumThreads("j",
+                             cl::desc("Instrument this many modules of "
+                                      "-batch at once (default: one per "
+                                      "core)"),
+                             cl::init(0));
+
+cl::opt<unsigned> LoopDepth("loop-depth",
+                            cl::desc("Profile the loops nested at most this "
+                                     "deep (1: top-level loops only, 0: all "
+                                     "loops)"),
+                            cl::init(1));
+
+// number of buckets of a histogram, and their kinds (as in prof.cpp)
+static const unsigned HistBuckets = 48;
+enum { HistTrips, HistCycles, HistCyclesPerIter, NumHistKinds };
+
+// number of values kept per loop value (as in prof.cpp)
+static const unsigned ValueSlots = 4;
+
+// `-mem-sample` samples the accesses to the cache lines whose hash, the
+// line times this constant, is below the threshold for the rate
+static const unsigned MemLineShift = 6;
+static const uint64_t MemLineHash = 0x9E3779B97F4A7C15ULL;
+
+static bool hasHistograms() { return TripCounts || LoopLatency; }
+
+// TLS model of the profiler's thread-local globals. The runtime reads them
+// from a signal handler, so they must not be allocated lazily.
+static GlobalVariable::ThreadLocalMode getProfilerTLSMode() {
+  return ThreadLocal ? GlobalVariable::InitialExecTLSModel
+                     : GlobalVariable::NotThreadLocal;
+}
+
 // create an IRBuilder that inserts instructions in the first
 // non-phi and non-pad instructions
 IRBuilder<> createFrontBuilder(BasicBlock *BB) {
@@ -66,21 +184,95 @@ struct LoopInstrumentation : public ModulePass {
 
   ArrayType *ProfileArrTy;
   ArrayType *RunningArrTy;
-
-  LoopInstrumentation() : ModulePass(ID) {
+  ArrayType *TimingArrTy;
+  // `-low-overhead`: `_prof_loops_running` and the run counts of a thread,
+  // each on cache lines of their own
+  StructType *CountersTy;
+  ArrayType *HistArrTy;
+  // `-edge-counts`: the edges counted, as `struct cfg_edge` initializers,
+  // the index of the first one of each function and their counters
+  StructType *CfgEdgeTy;
+  std::vector<Constant *> CfgEdges;
+  std::map<Function *, unsigned> FirstCfgEdge;
+  ArrayType *CfgEdgeCountsTy;
+  // `-value-profile`: the values recorded, as `struct loop_value`
+  // initializers, the index of the first one of each loop (by the index of
+  // its profile entry) and the function recording them
+  StructType *LoopValueTy;
+  StructType *ValueCountsTy;
+  std::vector<Constant *> LoopValues;
+  std::map<unsigned, unsigned> FirstLoopValue;
+  ArrayType *ValueCountsArrTy;
+  Constant *RecordValueFunc;
+  // `-mem-sample`: the `struct mem_profile` initializers of the loops
+  // sampled, the index of each one's (by the index of its profile entry)
+  // and the function recording a sampled access
+  StructType *MemProfileTy;
+  std::vector<Constant *> MemProfiles;
+  std::map<unsigned, unsigned> MemProfileIdx;
+  ArrayType *MemProfileArrTy;
+  Constant *RecordMemFunc;
+
+  // functions created by this pass, which must not be instrumented
+  std::set<Function *> ProfilerFuncs;
+
+  // `-candidate-threshold`: the (function, header id) of the loops and
+  // functions to probe, if the profile covers this module, or the
+  // (function, fingerprint) of the loops if the profile has them
+  std::set<std::pair<std::string, unsigned>> Candidates;
+  std::set<std::pair<std::string, uint64_t>> CandidatePrints;
+  bool HasCandidates;
+  // the profile to read them from, shared by the modules of `-batch`; read
+  // by `readCandidates` if null
+  const LoopCallProfile *Profile;
+
+  LoopInstrumentation(const LoopCallProfile *Profile = nullptr)
+      : ModulePass(ID), Profile(Profile) {
     initializeLoopInstrumentationPass(*PassRegistry::getPassRegistry());
   };
 
   virtual bool runOnModule(Module &) override;
 
   StructType *LoopProfileTy;
+  StructType *LoopTimingTy;
+  StructType *LoopHistTy;
 
   // return a constant `struct loop_profile` initializer for a loop or (a
   // function)
-  Constant *getLoopProfileInitializer(Constant *Fn, unsigned Id);
+  Constant *getLoopProfileInitializer(Constant *Fn, unsigned Id,
+                                      unsigned ParentId = 0,
+                                      uint64_t Fingerprint = 0);
 
   // declare and initialize data for profiler
-  Function *initGlobals(std::vector<Constant *> &);
+  void initGlobals(std::vector<Constant *> &, unsigned NumProfiledLoops);
+
+  // a loop to profile: its header id and that of the closest enclosing
+  // loop that is profiled too (0 if there is none), and with
+  // `-value-profile` the values to record
+  struct ProfiledLoop {
+    Loop *L;
+    unsigned HeaderId, ParentId;
+    uint64_t Fingerprint;
+    std::vector<LoopValue> Values;
+  };
+  // the loops of `F` to profile, in the order of their headers; call it
+  // before probing any of them, the probes would change the fingerprints
+  std::vector<ProfiledLoop> getProfiledLoops(Function &F, LoopInfo &LI);
+
+  // create a function returning the calling thread's copy of a
+  // (thread-local) profiler global, or of one of its fields
+  Function *createGetter(GlobalVariable *GV, StringRef Name, Type *PtrTy,
+                         int Field = -1);
+
+  // read the candidates for probing from a previous profile
+  void readCandidates();
+  // whether to probe a function (`HeaderId` 0) or one of its loops
+  bool shouldInstrument(Function &F, unsigned HeaderId, bool HasLoops,
+                        uint64_t Fingerprint = 0);
+
+  // addresses of `_prof_loops_running[idx]` and of the run count of a loop
+  Value *getRunningAddr(IRBuilder<> &Builder, unsigned Idx);
+  Value *getRunsAddr(IRBuilder<> &Builder, unsigned Idx);
 
   void getAnalysisUsage(AnalysisUsage &AU) const override {
     AU.addRequired<LoopInfoWrapperPass>();
@@ -90,19 +282,201 @@ struct LoopInstrumentation : public ModulePass {
   // matching address
   // in `_prof_loops_running`
   Value *instrumentEntry(BasicBlock *Entry, unsigned Idx,
-                         bool Exclusive = true);
-  void instrumentExit(BasicBlock *Exit, Value *RunningAddr,
-                      bool Exclusive = true);
+                         bool Exclusive = true, int HistIdx = -1);
+  void instrumentExit(BasicBlock *Exit, Value *RunningAddr, unsigned Idx,
+                      bool Exclusive = true, int HistIdx = -1);
+  // emit the `-exact-timing` part of an entry or exit probe, `Running` being
+  // the value of `_prof_loops_running[idx]` outside of the loop/function
+  void instrumentTiming(IRBuilder<> &Builder, unsigned Idx, Value *Running,
+                        bool IsEntry);
+  // emit the `-trip-counts`/`-loop-latency` part of the entry or exit probe
+  // of the `HistIdx`th profiled loop
+  void instrumentHistogram(IRBuilder<> &Builder, unsigned HistIdx,
+                           Value *Running, bool IsEntry);
   // instrument a loop to record loop entrance/exit
-  void instrumentLoop(unsigned Idx, Loop *L);
+  void instrumentLoop(unsigned Idx, unsigned HistIdx, Loop *L);
+
+  // the CFG edges of `F` that `-edge-counts` counts, those leaving a branch
+  // or a switch, as pairs of block ids in the order of their blocks and
+  // successors
+  std::vector<std::pair<unsigned, unsigned>> getCountedEdges(Function &F);
+  // count the edges of `F`, the first being the `FirstEdge`th of the module
+  void instrumentEdges(Function &F, unsigned FirstEdge);
+  // record the values of a loop, the first being the `FirstValue`th of the
+  // module
+  void instrumentValues(ProfiledLoop &PL, unsigned FirstValue);
+  // the loads and stores of a loop, to sample; find them before the loop
+  // (or any other in its function) is probed
+  std::vector<Instruction *> getMemAccesses(Loop *L);
+  // sample a load or store of the `MemIdx`th loop sampled
+  void instrumentMemAccess(Instruction *I, unsigned MemIdx);
 
   const char *getPassName() const override {
     return "LoopInstrumentation pass";
   }
 };
 
+// Only the outermost activation of a loop or function is timed, i.e. when
+// its entry in `_prof_loops_running` goes from/to 0:
+// ```
+// entry: if (!running) { timing.start = now; timing.start_probes = probes; }
+//        timing.calls++; probes++;
+// exit:  probes++;
+//        if (!running) { timing.cycles += now - timing.start;
+//                        timing.probes += probes - timing.start_probes; }
+// ```
+// `_prof_probes` counts the probes executed by the thread so that the
+// runtime can subtract their cost.  The conditions are computed with
+// selects to keep the CFG as it is.
+void LoopInstrumentation::instrumentTiming(IRBuilder<> &Builder, unsigned Idx,
+                                           Value *Running, bool IsEntry) {
+  LLVMContext &Ctx = CurModule->getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
+  GlobalVariable *Timings =
+      CurModule->getGlobalVariable("_prof_loops_timing",
+                                   /*AllowInternal*/ true);
+  GlobalVariable *ProbesAddr =
+      CurModule->getGlobalVariable("_prof_probes",
+                                   /*AllowInternal*/ true);
+
+  Value *Now = Builder.CreateCall(
+      Intrinsic::getDeclaration(CurModule, Intrinsic::readcyclecounter), {});
+  Value *Probes = Builder.CreateAdd(Builder.CreateLoad(ProbesAddr),
+                                    ConstantInt::get(Int64Ty, 1));
+  Builder.CreateStore(Probes, ProbesAddr);
+  Value *IsOutermost =
+      Builder.CreateICmpEQ(Running, ConstantInt::get(Int32Ty, 0));
+
+  auto getFieldAddr = [&](unsigned Field) {
+    std::vector<Value *> Indexes{ConstantInt::get(Int32Ty, 0),
+                                 ConstantInt::get(Int32Ty, Idx),
+                                 ConstantInt::get(Int32Ty, Field)};
+    return Builder.CreateInBoundsGEP(TimingArrTy, Timings, Indexes);
+  };
+  // fields of `struct loop_timing`
+  enum { Cycles, Calls, NestedProbes, Start, StartProbes };
+
+  if (IsEntry) {
+    Value *StartAddr = getFieldAddr(Start);
+    Builder.CreateStore(
+        Builder.CreateSelect(IsOutermost, Now, Builder.CreateLoad(StartAddr)),
+        StartAddr);
+    Value *StartProbesAddr = getFieldAddr(StartProbes);
+    Builder.CreateStore(Builder.CreateSelect(IsOutermost, Probes,
+                                             Builder.CreateLoad(StartProbesAddr)),
+                        StartProbesAddr);
+    Value *CallsAddr = getFieldAddr(Calls);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(CallsAddr),
+                                          ConstantInt::get(Int64Ty, 1)),
+                        CallsAddr);
+    return;
+  }
+
+  Constant *Zero = ConstantInt::get(Int64Ty, 0);
+  Value *Elapsed =
+      Builder.CreateSub(Now, Builder.CreateLoad(getFieldAddr(Start)));
+  Value *CyclesAddr = getFieldAddr(Cycles);
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(CyclesAddr),
+                        Builder.CreateSelect(IsOutermost, Elapsed, Zero)),
+      CyclesAddr);
+  Value *Nested =
+      Builder.CreateSub(Probes, Builder.CreateLoad(getFieldAddr(StartProbes)));
+  Value *NestedProbesAddr = getFieldAddr(NestedProbes);
+  Builder.CreateStore(
+      Builder.CreateAdd(Builder.CreateLoad(NestedProbesAddr),
+                        Builder.CreateSelect(IsOutermost, Nested, Zero)),
+      NestedProbesAddr);
+}
+
+// Like timings, histograms only count the outermost activation of a loop:
+// ```
+// entry:  if (!running) { hist.trips = 0; hist.start = now; }
+// header: hist.trips++;
+// exit:   if (!running) { hist.buckets[TRIPS][log2(hist.trips)]++;
+//                         hist.buckets[CYCLES][log2(now - hist.start)]++; ...}
+// ```
+void LoopInstrumentation::instrumentHistogram(IRBuilder<> &Builder,
+                                              unsigned HistIdx, Value *Running,
+                                              bool IsEntry) {
+  LLVMContext &Ctx = CurModule->getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
+  GlobalVariable *Hists =
+      CurModule->getGlobalVariable("_prof_loop_hists",
+                                   /*AllowInternal*/ true);
+  Constant *Zero = ConstantInt::get(Int64Ty, 0);
+  Value *IsOutermost =
+      Builder.CreateICmpEQ(Running, ConstantInt::get(Int32Ty, 0));
+
+  // fields of `struct loop_histogram`
+  enum { Trips, Start, Buckets };
+  auto getFieldAddr = [&](unsigned Field) {
+    std::vector<Value *> Indexes{ConstantInt::get(Int32Ty, 0),
+                                 ConstantInt::get(Int32Ty, HistIdx),
+                                 ConstantInt::get(Int32Ty, Field)};
+    return Builder.CreateInBoundsGEP(HistArrTy, Hists, Indexes);
+  };
+  auto readCycles = [&]() -> Value * {
+    return Builder.CreateCall(
+        Intrinsic::getDeclaration(CurModule, Intrinsic::readcyclecounter), {});
+  };
+
+  if (IsEntry) {
+    if (TripCounts) {
+      Value *TripsAddr = getFieldAddr(Trips);
+      Builder.CreateStore(Builder.CreateSelect(IsOutermost, Zero,
+                                               Builder.CreateLoad(TripsAddr)),
+                          TripsAddr);
+    }
+    if (LoopLatency) {
+      Value *StartAddr = getFieldAddr(Start);
+      Builder.CreateStore(Builder.CreateSelect(IsOutermost, readCycles(),
+                                               Builder.CreateLoad(StartAddr)),
+                          StartAddr);
+    }
+    return;
+  }
+
+  // bucket log2(V), i.e. the number of significant bits of V
+  Value *Count = Builder.CreateZExt(IsOutermost, Int64Ty);
+  Value *Ctlz = Intrinsic::getDeclaration(CurModule, Intrinsic::ctlz, Int64Ty);
+  Constant *LastBucket = ConstantInt::get(Int64Ty, HistBuckets - 1);
+  auto addToBucket = [&](unsigned Kind, Value *V) {
+    Value *Bucket = Builder.CreateSub(
+        ConstantInt::get(Int64Ty, 64),
+        Builder.CreateCall(Ctlz, {V, Builder.getFalse()}));
+    Bucket = Builder.CreateSelect(Builder.CreateICmpUGT(Bucket, LastBucket),
+                                  LastBucket, Bucket);
+    std::vector<Value *> Indexes{ConstantInt::get(Int32Ty, 0),
+                                 ConstantInt::get(Int32Ty, HistIdx),
+                                 ConstantInt::get(Int32Ty, Buckets),
+                                 ConstantInt::get(Int32Ty, Kind), Bucket};
+    Value *Addr = Builder.CreateInBoundsGEP(HistArrTy, Hists, Indexes);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Addr), Count),
+                        Addr);
+  };
+
+  Value *NumTrips = nullptr;
+  if (TripCounts) {
+    NumTrips = Builder.CreateLoad(getFieldAddr(Trips));
+    addToBucket(HistTrips, NumTrips);
+  }
+  if (LoopLatency) {
+    Value *Cycles =
+        Builder.CreateSub(readCycles(), Builder.CreateLoad(getFieldAddr(Start)));
+    addToBucket(HistCycles, Cycles);
+    if (TripCounts) {
+      Value *Iters = Builder.CreateSelect(
+          Builder.CreateICmpEQ(NumTrips, Zero), ConstantInt::get(Int64Ty, 1),
+          NumTrips);
+      addToBucket(HistCyclesPerIter, Builder.CreateUDiv(Cycles, Iters));
+    }
+  }
+}
+
 void LoopInstrumentation::instrumentExit(BasicBlock *Exit, Value *RunningAddr,
-                                         bool Exclusive) {
+                                         unsigned Idx, bool Exclusive,
+                                         int HistIdx) {
   LLVMContext &Ctx = CurModule->getContext();
   Type *Int32Ty = Type::getInt32Ty(Ctx);
   GlobalVariable *LoopEntryAddr =
@@ -115,41 +489,33 @@ void LoopInstrumentation::instrumentExit(BasicBlock *Exit, Value *RunningAddr,
   Value *LoopEntry = Builder.CreateLoad(LoopEntryAddr);
 
   // emit `_prof_loops_running[idx] -= _prof_entry`
-  Builder.CreateStore(Builder.CreateBinOp(Instruction::Sub,
-                                          Builder.CreateLoad(RunningAddr),
-                                          LoopEntry),
-                      RunningAddr);
+  Value *Running = Builder.CreateBinOp(Instruction::Sub,
+                                       Builder.CreateLoad(RunningAddr),
+                                       LoopEntry);
+  Builder.CreateStore(Running, RunningAddr);
 
   // emit `_prof_entry -= 1`
   Value *DecLoopEntry = Builder.CreateBinOp(Instruction::Sub, LoopEntry,
                                             ConstantInt::get(Int32Ty, 1));
   Builder.CreateStore(DecLoopEntry, LoopEntryAddr);
+
+  if (ExactTiming)
+    instrumentTiming(Builder, Idx, Running, /*IsEntry*/ false);
+  if (HistIdx >= 0)
+    instrumentHistogram(Builder, HistIdx, Running, /*IsEntry*/ false);
 }
 
 Value *LoopInstrumentation::instrumentEntry(BasicBlock *Entry, unsigned Idx,
-                                            bool Exclusive) {
+                                            bool Exclusive, int HistIdx) {
   LLVMContext &Ctx = CurModule->getContext();
   Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
 
-  GlobalVariable *Profiles =
-      CurModule->getGlobalVariable("_prof_loops",
-                                   /*AllowInternal*/ true);
-  GlobalVariable *RunningArr =
-      CurModule->getGlobalVariable("_prof_loops_running",
-                                   /*AllowInternal*/ true);
   GlobalVariable *LoopEntryAddr =
       CurModule->getGlobalVariable("_prof_entry",
                                    /*AllowInternal*/ true);
 
   auto Builder = Exclusive ? IRBuilder<>(Entry, Entry->getTerminator())
                            : createFrontBuilder(Entry);
-  Constant *Zero = ConstantInt::get(Int32Ty, 0),
-           *RunsIdx = ConstantInt::get(Int32Ty, 2);
-
-  // get Profile from global array
-  std::vector<Value *> ProfileIndexes{Zero, ConstantInt::get(Int32Ty, Idx)};
-  Value *Profile = Builder.Insert(GetElementPtrInst::CreateInBounds(
-      ProfileArrTy, Profiles, ProfileIndexes));
 
   // emit code for `++_prof_entry`
   Value *LoopEntry =
@@ -158,44 +524,264 @@ Value *LoopInstrumentation::instrumentEntry(BasicBlock *Entry, unsigned Idx,
   Builder.CreateStore(LoopEntry, LoopEntryAddr);
 
   // emit `_prof_loops_running[idx] += ++_prof_entry`
-  std::vector<Value *> RunningIndexes{Zero, ConstantInt::get(Int32Ty, Idx)};
-  Value *RunningAddr = Builder.Insert(GetElementPtrInst::CreateInBounds(
-      RunningArrTy, RunningArr, RunningIndexes));
+  Value *RunningAddr = getRunningAddr(Builder, Idx);
+  Value *Running = Builder.CreateLoad(RunningAddr);
   Builder.CreateStore(Builder.CreateBinOp(Instruction::Add, LoopEntry,
-                                          Builder.CreateLoad(RunningAddr)),
+                                          Running),
                       RunningAddr);
 
   // emit `_prof_loops[idx].runs++`
-  std::vector<Value *> RunsIndexes{Zero, RunsIdx};
-  Value *RunsAddr =
-      Builder.CreateInBoundsGEP(LoopProfileTy, Profile, RunsIndexes);
+  Value *RunsAddr = getRunsAddr(Builder, Idx);
   Value *OldRuns = Builder.CreateLoad(RunsAddr);
   Value *NewRuns = Builder.CreateBinOp(Instruction::Add, OldRuns,
                                        ConstantInt::get(Int64Ty, 1));
   Builder.CreateStore(NewRuns, RunsAddr);
 
+  if (ExactTiming)
+    instrumentTiming(Builder, Idx, Running, /*IsEntry*/ true);
+  if (HistIdx >= 0)
+    instrumentHistogram(Builder, HistIdx, Running, /*IsEntry*/ true);
+
   return RunningAddr;
 }
 
-void LoopInstrumentation::instrumentLoop(unsigned Idx, Loop *L) {
+Value *LoopInstrumentation::getRunningAddr(IRBuilder<> &Builder,
+                                           unsigned Idx) {
+  Type *Int32Ty = Type::getInt32Ty(CurModule->getContext());
+  Constant *Zero = ConstantInt::get(Int32Ty, 0);
+  if (LowOverhead) {
+    GlobalVariable *Counters =
+        CurModule->getGlobalVariable("_prof_counters",
+                                     /*AllowInternal*/ true);
+    std::vector<Value *> Indexes{Zero, Zero, ConstantInt::get(Int32Ty, Idx)};
+    return Builder.Insert(
+        GetElementPtrInst::CreateInBounds(CountersTy, Counters, Indexes));
+  }
+
+  GlobalVariable *RunningArr =
+      CurModule->getGlobalVariable("_prof_loops_running",
+                                   /*AllowInternal*/ true);
+  std::vector<Value *> Indexes{Zero, ConstantInt::get(Int32Ty, Idx)};
+  return Builder.Insert(
+      GetElementPtrInst::CreateInBounds(RunningArrTy, RunningArr, Indexes));
+}
+
+Value *LoopInstrumentation::getRunsAddr(IRBuilder<> &Builder, unsigned Idx) {
+  Type *Int32Ty = Type::getInt32Ty(CurModule->getContext());
+  Constant *Zero = ConstantInt::get(Int32Ty, 0);
+  if (LowOverhead) {
+    GlobalVariable *Counters =
+        CurModule->getGlobalVariable("_prof_counters",
+                                     /*AllowInternal*/ true);
+    std::vector<Value *> Indexes{Zero, ConstantInt::get(Int32Ty, 1),
+                                 ConstantInt::get(Int32Ty, Idx)};
+    return Builder.Insert(
+        GetElementPtrInst::CreateInBounds(CountersTy, Counters, Indexes));
+  }
+
+  // the `runs` field of `_prof_loops[idx]`
+  GlobalVariable *Profiles =
+      CurModule->getGlobalVariable("_prof_loops",
+                                   /*AllowInternal*/ true);
+  std::vector<Value *> Indexes{Zero, ConstantInt::get(Int32Ty, Idx),
+                               ConstantInt::get(Int32Ty, 3)};
+  return Builder.Insert(
+      GetElementPtrInst::CreateInBounds(ProfileArrTy, Profiles, Indexes));
+}
+
+void LoopInstrumentation::instrumentLoop(unsigned Idx, unsigned HistIdx,
+                                         Loop *L) {
+  int Hist = hasHistograms() ? HistIdx : -1;
   BasicBlock *Preheader = L->getLoopPreheader();
-  Value *RunningAddr = instrumentEntry(Preheader, Idx);
+  Value *RunningAddr = instrumentEntry(Preheader, Idx, true, Hist);
+
+  // emit `_prof_loop_hists[hist].trips++` for every iteration
+  if (TripCounts) {
+    LLVMContext &Ctx = CurModule->getContext();
+    Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
+    GlobalVariable *Hists =
+        CurModule->getGlobalVariable("_prof_loop_hists",
+                                     /*AllowInternal*/ true);
+    auto Builder = createFrontBuilder(L->getHeader());
+    std::vector<Value *> Indexes{ConstantInt::get(Int32Ty, 0),
+                                 ConstantInt::get(Int32Ty, HistIdx),
+                                 ConstantInt::get(Int32Ty, 0)};
+    Value *TripsAddr = Builder.CreateInBoundsGEP(HistArrTy, Hists, Indexes);
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(TripsAddr),
+                          ConstantInt::get(Int64Ty, 1)),
+        TripsAddr);
+  }
 
   SmallVector<BasicBlock *, 4> Exits;
   L->getExitBlocks(Exits);
   std::set<BasicBlock *> UniqExits(Exits.begin(), Exits.end());
 
   for (BasicBlock *BB : UniqExits) {
-    instrumentExit(BB, RunningAddr);
+    instrumentExit(BB, RunningAddr, Idx, true, Hist);
+  }
+}
+
+std::vector<std::pair<unsigned, unsigned>>
+LoopInstrumentation::getCountedEdges(Function &F) {
+  std::map<BasicBlock *, unsigned> Ids;
+  for (BasicBlock &BB : F)
+    Ids.emplace(&BB, Ids.size() + 1);
+
+  std::vector<std::pair<unsigned, unsigned>> Edges;
+  for (BasicBlock &BB : F) {
+    TerminatorInst *Term = BB.getTerminator();
+    if (!isa<BranchInst>(Term) && !isa<SwitchInst>(Term))
+      continue;
+    for (unsigned i = 0, e = Term->getNumSuccessors(); i != e; i++)
+      Edges.emplace_back(Ids[&BB], Ids[Term->getSuccessor(i)]);
   }
+  return Edges;
 }
 
-Function *
-LoopInstrumentation::initGlobals(std::vector<Constant *> &LoopProfiles) {
+void LoopInstrumentation::instrumentEdges(Function &F, unsigned FirstEdge) {
+  Type *Int64Ty = Type::getInt64Ty(CurModule->getContext());
+  Constant *One = ConstantInt::get(Int64Ty, 1);
+  GlobalVariable *Counts =
+      CurModule->getGlobalVariable("_prof_cfg_edge_counts",
+                                   /*AllowInternal*/ true);
+
+  // emit `_prof_cfg_edge_counts[edge++] += N` before the terminator
+  unsigned Edge = FirstEdge;
+  auto addCount = [&](IRBuilder<> &Builder, Value *N) {
+    Value *Addr =
+        Builder.CreateConstInBoundsGEP2_32(CfgEdgeCountsTy, Counts, 0, Edge++);
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(Addr), N), Addr);
+  };
+
+  // the edges are counted in the block they leave, so the CFG (and the
+  // block ids) stay the same
+  for (BasicBlock &BB : F) {
+    TerminatorInst *Term = BB.getTerminator();
+    IRBuilder<> Builder(Term);
+    if (auto *Br = dyn_cast<BranchInst>(Term)) {
+      if (Br->isUnconditional()) {
+        addCount(Builder, One);
+        continue;
+      }
+      Value *Taken = Builder.CreateZExt(Br->getCondition(), Int64Ty);
+      Value *NotTaken = Builder.CreateSub(One, Taken);
+      addCount(Builder, Taken);
+      addCount(Builder, NotTaken);
+    } else if (auto *Switch = dyn_cast<SwitchInst>(Term)) {
+      // the default destination comes first, taken if no case matched
+      std::vector<Value *> Matches;
+      Value *Default = One;
+      for (auto Case : Switch->cases()) {
+        Value *Match = Builder.CreateZExt(
+            Builder.CreateICmpEQ(Switch->getCondition(), Case.getCaseValue()),
+            Int64Ty);
+        Matches.push_back(Match);
+        Default = Builder.CreateSub(Default, Match);
+      }
+      addCount(Builder, Default);
+      for (Value *Match : Matches)
+        addCount(Builder, Match);
+    }
+  }
+}
+
+// The values are recorded before the preheader branches to the loop, i.e.
+// after its entry probe:
+// ```
+// record_loop_value(&_prof_loop_value_counts[value++], (int64_t)v, kind);
+// ```
+void LoopInstrumentation::instrumentValues(ProfiledLoop &PL,
+                                           unsigned FirstValue) {
+  LLVMContext &Ctx = CurModule->getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
+  GlobalVariable *Counts =
+      CurModule->getGlobalVariable("_prof_loop_value_counts",
+                                   /*AllowInternal*/ true);
+
+  IRBuilder<> Builder(PL.L->getLoopPreheader()->getTerminator());
+  unsigned Slot = FirstValue;
+  for (LoopValue &LV : PL.Values) {
+    Value *V = LV.Kind == LoopValue::Align
+                   ? Builder.CreatePtrToInt(LV.V, Int64Ty)
+                   : Builder.CreateSExtOrTrunc(LV.V, Int64Ty);
+    Builder.CreateCall(
+        RecordValueFunc,
+        {Builder.CreateConstInBoundsGEP2_32(ValueCountsArrTy, Counts, 0,
+                                            Slot++),
+         V, ConstantInt::get(Int32Ty, LV.Kind)});
+  }
+}
+
+std::vector<Instruction *> LoopInstrumentation::getMemAccesses(Loop *L) {
+  std::vector<Instruction *> Accesses;
+  for (BasicBlock *BB : L->blocks())
+    for (Instruction &I : *BB) {
+      Value *Ptr = nullptr;
+      if (auto *Load = dyn_cast<LoadInst>(&I))
+        Ptr = Load->getPointerOperand();
+      else if (auto *Store = dyn_cast<StoreInst>(&I))
+        Ptr = Store->getPointerOperand();
+      // the runtime takes addresses in the default address space
+      if (Ptr && Ptr->getType()->getPointerAddressSpace() == 0)
+        Accesses.push_back(&I);
+    }
+  return Accesses;
+}
+
+// An access is sampled if the hash of its cache line is below the
+// threshold, which a `1 / MemSample` share of the hashes is:
+// ```
+// if ((addr >> MemLineShift) * MemLineHash < UINT64_MAX / MemSample)
+//   record_mem_access(&_prof_mem_profiles[idx], addr);
+// ```
+void LoopInstrumentation::instrumentMemAccess(Instruction *I,
+                                              unsigned MemIdx) {
+  LLVMContext &Ctx = CurModule->getContext();
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  GlobalVariable *Profiles =
+      CurModule->getGlobalVariable("_prof_mem_profiles",
+                                   /*AllowInternal*/ true);
+  Value *Ptr = isa<LoadInst>(I) ? cast<LoadInst>(I)->getPointerOperand()
+                                : cast<StoreInst>(I)->getPointerOperand();
+
+  IRBuilder<> Builder(I);
+  Value *Line = Builder.CreateLShr(Builder.CreatePtrToInt(Ptr, Int64Ty),
+                                   MemLineShift);
+  Value *Hash = Builder.CreateMul(Line, ConstantInt::get(Int64Ty, MemLineHash));
+  Value *Sampled = Builder.CreateICmpULT(
+      Hash, ConstantInt::get(Int64Ty, UINT64_MAX / MemSample));
+  MDNode *Weights = MDBuilder(Ctx).createBranchWeights(1, MemSample);
+  TerminatorInst *Then = SplitBlockAndInsertIfThen(Sampled, I, false, Weights);
+
+  Builder.SetInsertPoint(Then);
+  Builder.CreateCall(
+      RecordMemFunc,
+      {Builder.CreateConstInBoundsGEP2_32(MemProfileArrTy, Profiles, 0, MemIdx),
+       Builder.CreatePointerCast(Ptr, Type::getInt8PtrTy(Ctx))});
+}
+
+Function *LoopInstrumentation::createGetter(GlobalVariable *GV, StringRef Name,
+                                            Type *PtrTy, int Field) {
+  LLVMContext &Ctx = CurModule->getContext();
+  FunctionType *GetterTy = FunctionType::get(PtrTy, /*isVarArg*/ false);
+  Function *Getter = Function::Create(GetterTy, GlobalValue::InternalLinkage,
+                                      Name, CurModule);
+  IRBuilder<> IRB(BasicBlock::Create(Ctx, "", Getter));
+  Value *Ptr = GV;
+  if (Field >= 0)
+    Ptr = IRB.CreateConstInBoundsGEP2_32(GV->getValueType(), GV, 0, Field);
+  IRB.CreateRet(IRB.CreateBitCast(Ptr, PtrTy));
+  ProfilerFuncs.insert(Getter);
+  return Getter;
+}
+
+void LoopInstrumentation::initGlobals(std::vector<Constant *> &LoopProfiles,
+                                      unsigned NumProfiledLoops) {
   LLVMContext &Ctx = CurModule->getContext();
   unsigned NumLoops = LoopProfiles.size();
 
-  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
 
   // declare `_prof_loops`
   ProfileArrTy = ArrayType::get(LoopProfileTy, NumLoops);
@@ -204,12 +790,52 @@ LoopInstrumentation::initGlobals(std::vector<Constant *> &LoopProfiles) {
       *CurModule, ProfileArrTy, false, GlobalValue::PrivateLinkage, ArrContent,
       "_prof_loops", nullptr, GlobalVariable::NotThreadLocal, 0);
 
-  RunningArrTy = ArrayType::get(Int32Ty, NumLoops);
-  // declare `_prof_loops_running`
-  GlobalVariable *Prof_Loops_Running_GVar = new GlobalVariable(
-      *CurModule, RunningArrTy, false, GlobalValue::PrivateLinkage,
-      ConstantAggregateZero::get(RunningArrTy), "_prof_loops_running", nullptr,
-      GlobalVariable::NotThreadLocal, 0);
+  // declare `_prof_loops_running`, or with `-low-overhead`
+  // ```
+  // struct loop_counters {
+  //     int32_t running[NumLoops rounded up to a cache line];
+  //     int64_t runs[NumLoops];
+  // } _prof_counters __attribute__((aligned(64)));
+  // ```
+  // whose first field serves as `_prof_loops_running`
+  GlobalVariable *Prof_Loops_Running_GVar;
+  if (LowOverhead) {
+    unsigned PaddedLoops = (NumLoops + 15) / 16 * 16;
+    std::vector<Type *> Fields{ArrayType::get(Int32Ty, PaddedLoops),
+                               ArrayType::get(Int64Ty, NumLoops)};
+    CountersTy = StructType::create(Ctx, Fields, "LoopCounters");
+    Prof_Loops_Running_GVar = new GlobalVariable(
+        *CurModule, CountersTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(CountersTy), "_prof_counters", nullptr,
+        getProfilerTLSMode(), 0);
+    Prof_Loops_Running_GVar->setAlignment(64);
+  } else {
+    RunningArrTy = ArrayType::get(Int32Ty, NumLoops);
+    Prof_Loops_Running_GVar = new GlobalVariable(
+        *CurModule, RunningArrTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(RunningArrTy), "_prof_loops_running",
+        nullptr, getProfilerTLSMode(), 0);
+  }
+
+  // declare `_prof_loops_timing`
+  GlobalVariable *Prof_Loops_Timing_GVar = nullptr;
+  if (ExactTiming) {
+    TimingArrTy = ArrayType::get(LoopTimingTy, NumLoops);
+    Prof_Loops_Timing_GVar = new GlobalVariable(
+        *CurModule, TimingArrTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(TimingArrTy), "_prof_loops_timing", nullptr,
+        getProfilerTLSMode(), 0);
+  }
+
+  // declare `_prof_loop_hists`, one per profiled loop
+  GlobalVariable *Prof_Loop_Hists_GVar = nullptr;
+  if (hasHistograms()) {
+    HistArrTy = ArrayType::get(LoopHistTy, NumProfiledLoops);
+    Prof_Loop_Hists_GVar = new GlobalVariable(
+        *CurModule, HistArrTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(HistArrTy), "_prof_loop_hists", nullptr,
+        getProfilerTLSMode(), 0);
+  }
 
   // also define `_prof_num_loop`
   Constant *NumLoop = ConstantInt::get(Int32Ty, NumLoops, true);
@@ -242,13 +868,133 @@ LoopInstrumentation::initGlobals(std::vector<Constant *> &LoopProfiles) {
       IRB.CreateBitCast(Prof_Loops_GVar, PointerType::get(LoopProfileTy, 0)),
       IRB.CreateBitCast(Prof_Loops_Running_GVar, Type::getInt32PtrTy(Ctx))};
   IRB.CreateCall(descFuncDecl, arrayRefList);
+
+  // Tell the runtime how to find each thread's copy of the nesting state
+  if (ThreadLocal) {
+    Constant *getterFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_running_getter", Type::getVoidTy(Ctx),
+        PointerType::get(FunctionType::get(Type::getInt32PtrTy(Ctx), false),
+                         0),
+        nullptr);
+    Value *Getter = createGetter(Prof_Loops_Running_GVar, "_prof_get_running",
+                                 Type::getInt32PtrTy(Ctx));
+    IRB.CreateCall(getterFuncDecl, {Getter});
+  }
+
+  // Tell the runtime where (each thread's copy of) the run counts are
+  if (LowOverhead) {
+    Type *RunsPtrTy = Type::getInt64PtrTy(Ctx);
+    Constant *runsFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_runs", Type::getVoidTy(Ctx),
+        PointerType::get(FunctionType::get(RunsPtrTy, false), 0), nullptr);
+    Value *Getter = createGetter(Prof_Loops_Running_GVar, "_prof_get_runs",
+                                 RunsPtrTy, /*Field*/ 1);
+    IRB.CreateCall(runsFuncDecl, {Getter});
+  }
+
+  // Tell the runtime where (each thread's copy of) the histograms are
+  if (hasHistograms()) {
+    Type *HistPtrTy = PointerType::get(LoopHistTy, 0);
+    Constant *histFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_histograms", Type::getVoidTy(Ctx),
+        PointerType::get(FunctionType::get(HistPtrTy, false), 0), Int32Ty,
+        nullptr);
+    Value *Getter =
+        createGetter(Prof_Loop_Hists_GVar, "_prof_get_histograms", HistPtrTy);
+    IRB.CreateCall(histFuncDecl,
+                   {Getter, ConstantInt::get(Int32Ty, NumProfiledLoops)});
+  }
+
+  // Tell the runtime which edges are counted, and where
+  if (EdgeCounts) {
+    unsigned NumEdges = CfgEdges.size();
+    ArrayType *EdgesTy = ArrayType::get(CfgEdgeTy, NumEdges);
+    GlobalVariable *Edges = new GlobalVariable(
+        *CurModule, EdgesTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(EdgesTy, CfgEdges), "_prof_cfg_edges");
+    CfgEdgeCountsTy = ArrayType::get(Int64Ty, NumEdges);
+    GlobalVariable *Counts = new GlobalVariable(
+        *CurModule, CfgEdgeCountsTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(CfgEdgeCountsTy), "_prof_cfg_edge_counts",
+        nullptr, getProfilerTLSMode(), 0);
+    Type *CountsPtrTy = Type::getInt64PtrTy(Ctx);
+    Constant *edgesFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_cfg_edges", Type::getVoidTy(Ctx),
+        PointerType::get(CfgEdgeTy, 0),
+        PointerType::get(FunctionType::get(CountsPtrTy, false), 0), Int32Ty,
+        nullptr);
+    Value *Getter =
+        createGetter(Counts, "_prof_get_cfg_edge_counts", CountsPtrTy);
+    IRB.CreateCall(edgesFuncDecl,
+                   {IRB.CreateConstInBoundsGEP2_32(EdgesTy, Edges, 0, 0),
+                    Getter, ConstantInt::get(Int32Ty, NumEdges)});
+  }
+
+  // Tell the runtime which loop values are recorded, and where
+  if (ValueProfile) {
+    unsigned NumValues = LoopValues.size();
+    ArrayType *ValuesTy = ArrayType::get(LoopValueTy, NumValues);
+    GlobalVariable *Values = new GlobalVariable(
+        *CurModule, ValuesTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(ValuesTy, LoopValues), "_prof_loop_values");
+    ValueCountsArrTy = ArrayType::get(ValueCountsTy, NumValues);
+    GlobalVariable *Counts = new GlobalVariable(
+        *CurModule, ValueCountsArrTy, false, GlobalValue::PrivateLinkage,
+        ConstantAggregateZero::get(ValueCountsArrTy),
+        "_prof_loop_value_counts", nullptr, getProfilerTLSMode(), 0);
+    Type *CountsPtrTy = PointerType::get(ValueCountsTy, 0);
+    Constant *valuesFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_loop_values", Type::getVoidTy(Ctx),
+        PointerType::get(LoopValueTy, 0),
+        PointerType::get(FunctionType::get(CountsPtrTy, false), 0), Int32Ty,
+        nullptr);
+    Value *Getter =
+        createGetter(Counts, "_prof_get_loop_value_counts", CountsPtrTy);
+    IRB.CreateCall(valuesFuncDecl,
+                   {IRB.CreateConstInBoundsGEP2_32(ValuesTy, Values, 0, 0),
+                    Getter, ConstantInt::get(Int32Ty, NumValues)});
+    RecordValueFunc = CurModule->getOrInsertFunction(
+        "record_loop_value", Type::getVoidTy(Ctx),
+        PointerType::get(ValueCountsTy, 0), Int64Ty, Int32Ty, nullptr);
+  }
+
+  // Tell the runtime which loops' memory accesses are sampled, and where
+  if (MemSample) {
+    MemProfileArrTy = ArrayType::get(MemProfileTy, MemProfiles.size());
+    GlobalVariable *Profiles = new GlobalVariable(
+        *CurModule, MemProfileArrTy, false, GlobalValue::PrivateLinkage,
+        ConstantArray::get(MemProfileArrTy, MemProfiles),
+        "_prof_mem_profiles");
+    Constant *memFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_mem_profiles", Type::getVoidTy(Ctx),
+        PointerType::get(MemProfileTy, 0), Int32Ty, Int32Ty, nullptr);
+    IRB.CreateCall(memFuncDecl,
+                   {IRB.CreateConstInBoundsGEP2_32(MemProfileArrTy, Profiles,
+                                                   0, 0),
+                    ConstantInt::get(Int32Ty, MemProfiles.size()),
+                    ConstantInt::get(Int32Ty, MemSample)});
+    RecordMemFunc = CurModule->getOrInsertFunction(
+        "record_mem_access", Type::getVoidTy(Ctx),
+        PointerType::get(MemProfileTy, 0), Type::getInt8PtrTy(Ctx), nullptr);
+  }
+
+  // Tell the runtime where (each thread's copy of) the cycle counts are
+  if (ExactTiming) {
+    Type *TimingPtrTy = PointerType::get(LoopTimingTy, 0);
+    Constant *timingFuncDecl = CurModule->getOrInsertFunction(
+        "add_module_timing", Type::getVoidTy(Ctx),
+        PointerType::get(FunctionType::get(TimingPtrTy, false), 0), nullptr);
+    Value *Getter =
+        createGetter(Prof_Loops_Timing_GVar, "_prof_get_timing", TimingPtrTy);
+    IRB.CreateCall(timingFuncDecl, {Getter});
+  }
   IRB.CreateRetVoid();
 
   // And append the new function to the global ctors list so it gets called
   llvm::appendToGlobalCtors(*CurModule, newF, 65535);
 
-  // Return the newly created function so it isn't instrumented!
-  return newF;
+  // Remember the newly created function so it isn't instrumented!
+  ProfilerFuncs.insert(newF);
 }
 
 char LoopInstrumentation::ID = 1;
@@ -258,17 +1004,94 @@ INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
 INITIALIZE_PASS_END(LoopInstrumentation, "", "", true, true)
 
 Constant *LoopInstrumentation::getLoopProfileInitializer(Constant *Fn,
-                                                         unsigned Id) {
+                                                         unsigned Id,
+                                                         unsigned ParentId,
+                                                         uint64_t Fingerprint) {
   LLVMContext &Ctx = CurModule->getContext();
   Type *Int32Ty = Type::getInt32Ty(Ctx), *Int64Ty = Type::getInt64Ty(Ctx);
 
   // declare instance of `struct loop_data`
   std::vector<Constant *> Fields{Fn, ConstantInt::get(Int32Ty, Id),
-                                 ConstantInt::get(Int64Ty, 0)};
+                                 ConstantInt::get(Int32Ty, ParentId),
+                                 ConstantInt::get(Int64Ty, 0),
+                                 ConstantInt::get(Int64Ty, Fingerprint)};
 
   return ConstantStruct::get(LoopProfileTy, Fields);
 }
 
+std::vector<LoopInstrumentation::ProfiledLoop>
+LoopInstrumentation::getProfiledLoops(Function &F, LoopInfo &LI) {
+  std::vector<ProfiledLoop> Loops;
+  std::map<Loop *, unsigned> HeaderIds;
+  unsigned i = 0;
+  for (BasicBlock &BB : F) {
+    ++i;
+    Loop *L = LI.getLoopFor(&BB);
+
+    if (!L || !L->isLoopSimplifyForm() || L->getHeader() != &BB ||
+        (LoopDepth && L->getLoopDepth() > LoopDepth))
+      continue;
+
+    Loops.push_back({L, i, 0, getLoopFingerprint(*L),
+                     ValueProfile ? getLoopValues(*L)
+                                  : std::vector<LoopValue>()});
+    HeaderIds[L] = i;
+  }
+
+  // a loop that isn't in simplify form isn't profiled, so look past it
+  for (ProfiledLoop &PL : Loops)
+    for (Loop *P = PL.L->getParentLoop(); P; P = P->getParentLoop())
+      if (HeaderIds.count(P)) {
+        PL.ParentId = HeaderIds[P];
+        break;
+      }
+  return Loops;
+}
+
+void LoopInstrumentation::readCandidates() {
+  LoopCallProfile OwnProfile;
+  if (!Profile)
+    OwnProfile.readProfiles();
+  const LoopCallProfile &Prof = Profile ? *Profile : OwnProfile;
+  const std::vector<LoopHeader> &Nodes = Prof.GraphNodeMeta();
+  for (unsigned i = 0, e = Nodes.size(); i != e; i++) {
+    if (Nodes[i].ModuleName != CurModule->getName())
+      continue;
+    HasCandidates = true;
+    if (Prof.getNodeStats(i).Time < CandidateThreshold)
+      continue;
+    // a profile of an older build still finds its loops by fingerprint
+    if (Nodes[i].Fingerprint)
+      CandidatePrints.emplace(Nodes[i].Function, Nodes[i].Fingerprint);
+    else
+      Candidates.emplace(Nodes[i].Function, Nodes[i].HeaderId);
+  }
+  if (!HasCandidates)
+    errs() << "warning: no profile of " << CurModule->getName()
+           << ", probing all of it\n";
+}
+
+bool LoopInstrumentation::shouldInstrument(Function &F, unsigned HeaderId,
+                                           bool HasLoops,
+                                           uint64_t Fingerprint) {
+  if (HasCandidates &&
+      !Candidates.count(std::make_pair(F.getName().str(), HeaderId)) &&
+      !CandidatePrints.count(std::make_pair(F.getName().str(), Fingerprint)))
+    return false;
+  if (HeaderId != 0 || HasLoops)
+    return true;
+
+  // the probes of a tiny function may cost more than the function itself;
+  // its time goes to its caller instead
+  unsigned Threshold = MinInstrs;
+  if (LowOverhead && !MinInstrs.getNumOccurrences())
+    Threshold = 20;
+  unsigned NumInstrs = 0;
+  for (BasicBlock &BB : F)
+    NumInstrs += BB.size();
+  return NumInstrs >= Threshold;
+}
+
 bool LoopInstrumentation::runOnModule(Module &M) {
   CurModule = &M;
   LLVMContext &Ctx = M.getContext();
@@ -278,26 +1101,105 @@ bool LoopInstrumentation::runOnModule(Module &M) {
   // struct loop_profile {
   //     char *func;
   //     int32_t header_id;
+  //     int32_t parent_id;
   //     int64_t runs;
+  //     uint64_t fingerprint;
   // };
   // ```
   LoopProfileTy = StructType::create(Ctx, "LoopProfile");
   std::vector<Type *> Fields{Type::getInt8PtrTy(Ctx), Type::getInt32Ty(Ctx),
+                             Type::getInt32Ty(Ctx), Type::getInt64Ty(Ctx),
                              Type::getInt64Ty(Ctx)};
   LoopProfileTy->setBody(Fields);
 
+  // declare
+  // ```
+  // struct loop_timing {
+  //     uint64_t cycles, calls, probes;
+  //     uint64_t start, start_probes;
+  // };
+  // ```
+  LoopTimingTy = StructType::create(Ctx, "LoopTiming");
+  LoopTimingTy->setBody(std::vector<Type *>(5, Type::getInt64Ty(Ctx)));
+
+  // declare
+  // ```
+  // struct loop_histogram {
+  //     uint64_t trips, start;
+  //     uint64_t buckets[NumHistKinds][HistBuckets];
+  // };
+  // ```
+  LoopHistTy = StructType::create(Ctx, "LoopHistogram");
+  Type *BucketsTy = ArrayType::get(
+      ArrayType::get(Type::getInt64Ty(Ctx), HistBuckets), NumHistKinds);
+  LoopHistTy->setBody({Type::getInt64Ty(Ctx), Type::getInt64Ty(Ctx),
+                       BucketsTy});
+
+  // declare
+  // ```
+  // struct cfg_edge {
+  //     int32_t func_idx, src, dst;
+  // };
+  // ```
+  CfgEdgeTy = StructType::create(Ctx, "CfgEdge");
+  CfgEdgeTy->setBody(std::vector<Type *>(3, Type::getInt32Ty(Ctx)));
+
+  // declare
+  // ```
+  // struct loop_value {
+  //     int32_t loop_idx, kind, operand;
+  // };
+  // struct value_counts {
+  //     int64_t values[ValueSlots];
+  //     uint64_t counts[ValueSlots];
+  //     uint64_t total;
+  // };
+  // ```
+  LoopValueTy = StructType::create(Ctx, "LoopValue");
+  LoopValueTy->setBody(std::vector<Type *>(3, Type::getInt32Ty(Ctx)));
+  ValueCountsTy = StructType::create(Ctx, "ValueCounts");
+  Type *SlotsTy = ArrayType::get(Type::getInt64Ty(Ctx), ValueSlots);
+  ValueCountsTy->setBody({SlotsTy, SlotsTy, Type::getInt64Ty(Ctx)});
+
+  // declare
+  // ```
+  // struct mem_profile {
+  //     int32_t loop_idx;
+  //     uint64_t samples, cold, lines;
+  //     uint64_t reuse[HistBuckets];
+  // };
+  // ```
+  MemProfileTy = StructType::create(Ctx, "MemProfile");
+  MemProfileTy->setBody({Type::getInt32Ty(Ctx), Type::getInt64Ty(Ctx),
+                         Type::getInt64Ty(Ctx), Type::getInt64Ty(Ctx),
+                         ArrayType::get(Type::getInt64Ty(Ctx), HistBuckets)});
+
   Type *Int32Ty = Type::getInt32Ty(Ctx);
   // Declare `_prof_entry`: it is private to each module
   new GlobalVariable(*CurModule, Int32Ty, false,
                      GlobalValue::LinkOnceODRLinkage,
                      ConstantInt::get(Int32Ty, 0), "_prof_entry", nullptr,
-                     GlobalVariable::NotThreadLocal, 0);
+                     getProfilerTLSMode(), 0);
+
+  // Declare `_prof_probes`, the number of probes executed
+  if (ExactTiming) {
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    new GlobalVariable(*CurModule, Int64Ty, false,
+                       GlobalValue::LinkOnceODRLinkage,
+                       ConstantInt::get(Int64Ty, 0), "_prof_probes", nullptr,
+                       getProfilerTLSMode(), 0);
+  }
+
+  HasCandidates = false;
+  if (CandidateThreshold > 0)
+    readCandidates();
 
   std::vector<Constant *> LoopProfiles;
-  // index to profile entry
-  unsigned Idx = 0;
+  // index to profile entry, and to the loops only
+  unsigned Idx = 0, HistIdx = 0;
+  unsigned NumProfiledLoops = 0;
 
-  // find out how many functions/top-level loops are there and create
+  // find out how many functions/loops are there and create
   // global variable to hold their profiling data
   for (Function &F : M.getFunctionList()) {
     // external function
@@ -317,24 +1219,45 @@ bool LoopInstrumentation::runOnModule(Module &M) {
         ConstantExpr::getInBoundsGetElementPtr(Str->getType(), GV, Args);
 
     // a loop's header id has to start from 1, so use 0 for function
+    Constant *FnIdx = ConstantInt::get(Int32Ty, LoopProfiles.size());
     LoopProfiles.push_back(getLoopProfileInitializer(FnName, 0));
 
-    unsigned i = 0;
-    for (BasicBlock &BB : F) {
-      ++i;
-      Loop *L = LI.getLoopFor(&BB);
-
-      if (!L || L->getParentLoop() || !L->isLoopSimplifyForm() ||
-          L->getHeader() != &BB)
-        continue;
+    if (EdgeCounts && shouldInstrument(F, 0, !LI.empty())) {
+      FirstCfgEdge[&F] = CfgEdges.size();
+      for (auto &Edge : getCountedEdges(F))
+        CfgEdges.push_back(ConstantStruct::get(
+            CfgEdgeTy, {FnIdx, ConstantInt::get(Int32Ty, Edge.first),
+                        ConstantInt::get(Int32Ty, Edge.second)}));
+    }
 
-      LoopProfiles.push_back(getLoopProfileInitializer(FnName, i));
+    for (ProfiledLoop &PL : getProfiledLoops(F, LI)) {
+      unsigned LoopIdx = LoopProfiles.size();
+      if (MemSample && PL.L->getLoopDepth() == 1 &&
+          shouldInstrument(F, PL.HeaderId, true, PL.Fingerprint)) {
+        MemProfileIdx[LoopIdx] = MemProfiles.size();
+        std::vector<Constant *> Fields{ConstantInt::get(Int32Ty, LoopIdx)};
+        for (unsigned k = 1; k < MemProfileTy->getNumElements(); k++)
+          Fields.push_back(
+              Constant::getNullValue(MemProfileTy->getElementType(k)));
+        MemProfiles.push_back(ConstantStruct::get(MemProfileTy, Fields));
+      }
+      if (!PL.Values.empty() &&
+          shouldInstrument(F, PL.HeaderId, true, PL.Fingerprint)) {
+        FirstLoopValue[LoopIdx] = LoopValues.size();
+        for (unsigned k = 0; k < PL.Values.size(); k++)
+          LoopValues.push_back(ConstantStruct::get(
+              LoopValueTy, {ConstantInt::get(Int32Ty, LoopIdx),
+                            ConstantInt::get(Int32Ty, PL.Values[k].Kind),
+                            ConstantInt::get(Int32Ty, k)}));
+      }
+      LoopProfiles.push_back(getLoopProfileInitializer(
+          FnName, PL.HeaderId, PL.ParentId, PL.Fingerprint));
+      NumProfiledLoops++;
     }
   }
 
   // Create the global variables and the function to register them.
-  // Get the function pointer so we don't instrument it!
-  Function *regFunc = initGlobals(LoopProfiles);
+  initGlobals(LoopProfiles, NumProfiledLoops);
 
   // insert code in the entry and exit blocks of a function/loop
   for (Function &F : M.getFunctionList()) {
@@ -342,60 +1265,175 @@ bool LoopInstrumentation::runOnModule(Module &M) {
     if (F.empty())
       continue;
 
-    // skip the registration function
-    if (&F == regFunc)
+    // skip the registration function (and its helpers)
+    if (ProfilerFuncs.count(&F))
       continue;
 
     LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
 
-    Value *FnRunningAddr = instrumentEntry(&F.getEntryBlock(), Idx++, false);
-
-    // instrument returning blocks of `F`
-    for (BasicBlock &BB : F) {
-      if (BB.getTerminator() != NULL && isa<ReturnInst>(BB.getTerminator())) {
-        instrumentExit(&BB, FnRunningAddr, false);
+    // a function or loop that isn't probed keeps its entry (and index),
+    // it just never runs
+    unsigned FnIdx = Idx++;
+    if (shouldInstrument(F, 0, !LI.empty())) {
+      Value *FnRunningAddr =
+          instrumentEntry(&F.getEntryBlock(), FnIdx, false);
+
+      // instrument returning blocks of `F`
+      for (BasicBlock &BB : F) {
+        if (BB.getTerminator() != NULL &&
+            isa<ReturnInst>(BB.getTerminator())) {
+          instrumentExit(&BB, FnRunningAddr, FnIdx, false);
+        }
       }
     }
 
-    unsigned i = 0;
-    for (BasicBlock &BB : F) {
-      ++i;
-      Loop *L = LI.getLoopFor(&BB);
+    // Probe enclosing loops before the loops nested in them: an exit block
+    // shared by both then leaves the inner loop first.
+    std::vector<ProfiledLoop> Loops = getProfiledLoops(F, LI);
+    std::vector<std::pair<unsigned, unsigned>> Indexes;
+    for (unsigned j = 0; j < Loops.size(); j++)
+      Indexes.emplace_back(Idx++, HistIdx++);
+    std::vector<unsigned> Order(Loops.size());
+    for (unsigned j = 0; j < Order.size(); j++)
+      Order[j] = j;
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned a, unsigned b) {
+      return Loops[a].L->getLoopDepth() < Loops[b].L->getLoopDepth();
+    });
+    std::vector<std::pair<Instruction *, unsigned>> MemAccesses;
+    for (unsigned j = 0; j < Loops.size(); j++)
+      if (MemProfileIdx.count(Indexes[j].first))
+        for (Instruction *I : getMemAccesses(Loops[j].L))
+          MemAccesses.emplace_back(I, MemProfileIdx[Indexes[j].first]);
+    for (unsigned j : Order) {
+      if (shouldInstrument(F, Loops[j].HeaderId, true, Loops[j].Fingerprint))
+        instrumentLoop(Indexes[j].first, Indexes[j].second, Loops[j].L);
+      if (FirstLoopValue.count(Indexes[j].first))
+        instrumentValues(Loops[j], FirstLoopValue[Indexes[j].first]);
+    }
 
-      if (!L || L->getParentLoop() || !L->isLoopSimplifyForm() ||
-          L->getHeader() != &BB)
-        continue;
+    if (FirstCfgEdge.count(&F))
+      instrumentEdges(F, FirstCfgEdge[&F]);
 
-      instrumentLoop(Idx++, L);
-    }
+    // last, as this splits blocks
+    for (auto &Access : MemAccesses)
+      instrumentMemAccess(Access.first, Access.second);
   }
 
   return true;
 }
 
-int main(int argc, char **argv) {
-  // Print a stack trace if we signal out.
-  sys::PrintStackTraceOnErrorSignal();
-  PrettyStackTraceProgram X(argc, argv);
-
-  cl::ParseCommandLineOptions(argc, argv, "instrument loop for profiling");
-
-  LLVMContext &Context = getGlobalContext();
+// Instrument the module in `InputFile` into `OutputFile`, reporting errors
+// to `ErrOS`
+static bool instrumentFile(LLVMContext &Context, const std::string &InputFile,
+                           const std::string &OutputFile,
+                           const LoopCallProfile *Profile, const char *ProgName,
+                           raw_ostream &ErrOS) {
   SMDiagnostic Err;
-  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  std::unique_ptr<Module> M = parseIRFile(InputFile, Err, Context);
+  if (!M) {
+    Err.print(ProgName, ErrOS);
+    return false;
+  }
 
   std::error_code EC;
-  tool_output_file Out(OutputFilename, EC, sys::fs::F_None);
+  tool_output_file Out(OutputFile, EC, sys::fs::F_None);
   if (EC) {
-    errs() << EC.message() << '\n';
-    return 1;
+    ErrOS << OutputFile << ": " << EC.message() << '\n';
+    return false;
   }
 
   legacy::PassManager Passes;
-  Passes.add(new LoopInstrumentation());
+  Passes.add(new LoopInstrumentation(Profile));
   Passes.add(createBitcodeWriterPass(Out.os(), true));
 
   Passes.run(*M.get());
 
   Out.keep();
+  return true;
+}
+
+// Instrument the modules of `-batch`, `-j` at a time.  Each module is read
+// into a context of its own, as it would be in a run of its own: types
+// left in a context by a module would get the same types of the next one
+// renamed.
+static bool instrumentBatch(const LoopCallProfile *Profile,
+                            const char *ProgName) {
+  std::ifstream Fin(BatchFilename.c_str());
+  if (!Fin) {
+    errs() << "Cannot open " << BatchFilename << '\n';
+    return false;
+  }
+  std::vector<std::pair<std::string, std::string>> Jobs;
+  std::string Line;
+  while (std::getline(Fin, Line)) {
+    std::istringstream Fields(Line);
+    std::string Input, Output;
+    if (!(Fields >> Input) || Input[0] == '#')
+      continue;
+    if (!(Fields >> Output)) {
+      errs() << BatchFilename << ": no output file for " << Input << '\n';
+      return false;
+    }
+    Jobs.emplace_back(Input, Output);
+  }
+
+  unsigned NumWorkers = NumThreads;
+  if (!NumWorkers)
+    NumWorkers = std::max(std::thread::hardware_concurrency(), 1u);
+  NumWorkers = std::min<size_t>(NumWorkers, Jobs.size());
+
+  std::atomic<unsigned> NextJob(0);
+  std::atomic<bool> Failed(false);
+  std::mutex ErrLock;
+  auto work = [&]() {
+    for (unsigned i; (i = NextJob++) < Jobs.size();) {
+      LLVMContext Context;
+      std::string Errors;
+      raw_string_ostream ErrOS(Errors);
+      if (!instrumentFile(Context, Jobs[i].first, Jobs[i].second, Profile,
+                          ProgName, ErrOS))
+        Failed = true;
+      // not interleaved with those of the other modules
+      ErrOS.flush();
+      if (!Errors.empty()) {
+        std::lock_guard<std::mutex> Lock(ErrLock);
+        errs() << Errors;
+      }
+    }
+  };
+  std::vector<std::thread> Workers;
+  for (unsigned i = 1; i < NumWorkers; i++)
+    Workers.emplace_back(work);
+  work();
+  for (auto &Worker : Workers)
+    Worker.join();
+  return !Failed;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv, "instrument loop for profiling");
+
+  if (BatchFilename.empty() == InputFilename.empty()) {
+    errs() << argv[0] << ": give either an input file or -batch\n";
+    return 1;
+  }
+
+  // read once for all modules, and registered before the workers start
+  LoopCallProfile Profile;
+  if (CandidateThreshold > 0)
+    Profile.readProfiles();
+  initializeLoopInstrumentationPass(*PassRegistry::getPassRegistry());
+
+  if (!BatchFilename.empty())
+    return instrumentBatch(&Profile, argv[0]) ? 0 : 1;
+
+  LLVMContext &Context = getGlobalContext();
+  return instrumentFile(Context, InputFilename, OutputFilename, &Profile,
+                        argv[0], errs())
+             ? 0
+             : 1;
 }
@@ -0,0 +1,318 @@
+//===- llvmtuner/src/merge-profiles.cpp: merge loop profiles -*- C++ -*-===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Merge the loop profiles of several runs (different inputs, processes of
+// one job, ...) into a single profile that the other tools read as usual.
+// Each input is given by the prefix its profile files were written with
+// ($LOOP_PROF_PREFIX), optionally with a weight:
+//
+//	merge-profiles -o all/ run1/ run2/
+//	merge-profiles -o all/ -f runs.txt	# lines of "prefix [weight]"
+//	merge-profiles -o all/ -procs loop-prof.procs
+//
+// -procs merges the profiles the processes of a process tree wrote to
+// $LOOP_PROF_DIR, one subdirectory per pid.  Their time shares are weighted
+// by the time each process ran, and the tree itself (which process forked
+// which, with their samples and time) goes to <prefix>loop-prof.procs.csv.
+//
+// Profiles are read and folded in one at a time, so the number of inputs
+// isn't limited by memory.  The histograms, edge counts and loop values
+// are merged along: their counts are weighted and summed by row.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+#include "LoopCallProfile.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdlib>
+
+using namespace llvm;
+
+static cl::list<std::string>
+InputPrefixes(cl::Positional, cl::desc("<profile prefix>..."));
+
+static cl::opt<std::string>
+InputList("f", cl::desc("File listing profile prefixes and their weights"),
+          cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<std::string>
+ProcessDir("procs", cl::desc("Directory of per-process profiles to merge"),
+           cl::value_desc("directory"), cl::init(""));
+
+static cl::opt<std::string>
+OutputPrefix("o", cl::desc("Prefix of the merged profile files"),
+             cl::value_desc("prefix"), cl::Required);
+
+// A process of the profiled process tree, as described by its info file
+struct ProcessInfo {
+  int Pid, ParentPid;
+  unsigned long long Samples;
+  double TimeMs;
+  std::string Prefix;
+};
+
+static bool readProcessInfo(const std::string& Prefix, ProcessInfo& Proc)
+{
+  std::ifstream Fin(Prefix + ProfileInfoFileName);
+  if (!Fin)
+    return false;
+  Proc.Pid = Proc.ParentPid = 0;
+  Proc.Samples = 0;
+  Proc.TimeMs = 0;
+  Proc.Prefix = Prefix;
+  std::string Line;
+  while (std::getline(Fin, Line)) {
+    size_t Eq = Line.find('=');
+    if (Eq == std::string::npos)
+      continue;
+    std::string Key = Line.substr(0, Eq);
+    std::istringstream Value(Line.substr(Eq + 1));
+    if (Key == "pid")
+      Value >> Proc.Pid;
+    else if (Key == "ppid")
+      Value >> Proc.ParentPid;
+    else if (Key == "samples")
+      Value >> Proc.Samples;
+    else if (Key == "time(ms)")
+      Value >> Proc.TimeMs;
+  }
+  return Proc.Pid != 0;
+}
+
+// Find the processes that wrote their profile to `Dir`
+static std::vector<ProcessInfo> findProcesses(const std::string& Dir)
+{
+  std::vector<ProcessInfo> Procs;
+  std::error_code EC;
+  for (sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+       I.increment(EC)) {
+    ProcessInfo Proc;
+    if (readProcessInfo(I->path() + "/", Proc))
+      Procs.push_back(Proc);
+  }
+  if (EC)
+    std::cerr << "Cannot read " << Dir << ": " << EC.message() << std::endl;
+  return Procs;
+}
+
+// A CSV whose rows end with a count (the histograms and edge counts),
+// merged by adding up the weighted counts of the rows that are the same
+// otherwise
+struct CountFile {
+  std::string Header;
+  std::map<std::string, uint64_t> Counts;
+
+  void add(const std::string& FileName, double Weight) {
+    std::ifstream Fin(FileName);
+    std::string Line;
+    if (!std::getline(Fin, Line))
+      return;
+    Header = Line;
+    while (std::getline(Fin, Line)) {
+      size_t Comma = Line.rfind(',');
+      if (Comma != std::string::npos)
+        Counts[Line.substr(0, Comma)] +=
+            std::strtoull(Line.c_str() + Comma + 1, nullptr, 10) * Weight +
+            0.5;
+    }
+  }
+
+  void write(const std::string& FileName) const {
+    if (Header.empty())
+      return;
+    std::ofstream Fout(FileName);
+    Fout << Header << '\n';
+    for (auto& Row : Counts)
+      Fout << Row.first << ',' << Row.second << '\n';
+  }
+};
+
+// The loop values of the profiles: for each loop value (its module,
+// function, header id, kind and operand), how often it was recorded and
+// how often with each value.  The values are kept as they come.
+struct ValueFile {
+  std::string Header;
+  std::map<std::string, std::pair<uint64_t, std::map<std::string, uint64_t>>>
+      Values;
+
+  void add(const std::string& FileName, double Weight) {
+    std::ifstream Fin(FileName);
+    std::string Line;
+    if (!std::getline(Fin, Line))
+      return;
+    Header = Line;
+    // the total is repeated on every row of a loop value
+    std::set<std::string> Seen;
+    while (std::getline(Fin, Line)) {
+      size_t TotalComma = Line.rfind(',');
+      size_t CountComma = TotalComma == std::string::npos || TotalComma == 0
+                              ? std::string::npos
+                              : Line.rfind(',', TotalComma - 1);
+      size_t ValueComma = CountComma == std::string::npos || CountComma == 0
+                              ? std::string::npos
+                              : Line.rfind(',', CountComma - 1);
+      if (ValueComma == std::string::npos)
+        continue;
+      std::string Key = Line.substr(0, ValueComma);
+      auto& Entry = Values[Key];
+      if (Seen.insert(Key).second)
+        Entry.first +=
+            std::strtoull(Line.c_str() + TotalComma + 1, nullptr, 10) *
+                Weight +
+            0.5;
+      Entry.second[Line.substr(ValueComma + 1, CountComma - ValueComma - 1)] +=
+          std::strtoull(Line.c_str() + CountComma + 1, nullptr, 10) * Weight +
+          0.5;
+    }
+  }
+
+  // one row per value, from the most frequent value of a loop value down
+  void write(const std::string& FileName) const {
+    if (Header.empty())
+      return;
+    std::ofstream Fout(FileName);
+    Fout << Header << '\n';
+    for (auto& Entry : Values) {
+      std::vector<std::pair<uint64_t, std::string>> Counts;
+      for (auto& Count : Entry.second.second)
+        Counts.emplace_back(Count.second, Count.first);
+      std::stable_sort(Counts.begin(), Counts.end(),
+                       [](const std::pair<uint64_t, std::string>& A,
+                          const std::pair<uint64_t, std::string>& B) {
+                         return A.first > B.first;
+                       });
+      for (auto& Count : Counts)
+        Fout << Entry.first << ',' << Count.second << ',' << Count.first
+             << ',' << Entry.second.first << '\n';
+    }
+  }
+};
+
+// Write the process tree depth-first, parents before their children
+static void writeProcessTree(const std::vector<ProcessInfo>& Procs,
+                             const std::string& FileName)
+{
+  std::map<int, unsigned> ByPid;
+  for (unsigned i = 0; i < Procs.size(); i++)
+    ByPid[Procs[i].Pid] = i;
+  std::multimap<int, unsigned> Children;
+  std::vector<unsigned> Stack;
+  double TotalMs = 0;
+  for (unsigned i = 0; i < Procs.size(); i++) {
+    if (ByPid.count(Procs[i].ParentPid))
+      Children.emplace(Procs[i].ParentPid, i);
+    else
+      Stack.push_back(i);
+    TotalMs += Procs[i].TimeMs;
+  }
+
+  std::ofstream Fout(FileName);
+  Fout << "pid,ppid,depth,samples,time(ms),time(pct)\n";
+  std::vector<unsigned> Depth(Procs.size(), 0);
+  while (!Stack.empty()) {
+    unsigned i = Stack.back();
+    Stack.pop_back();
+    const ProcessInfo& Proc = Procs[i];
+    Fout << Proc.Pid << ',' << Proc.ParentPid << ',' << Depth[i] << ','
+         << Proc.Samples << ',' << Proc.TimeMs << ','
+         << (TotalMs > 0 ? 100 * Proc.TimeMs / TotalMs : 0) << '\n';
+    auto Range = Children.equal_range(Proc.Pid);
+    for (auto It = Range.first; It != Range.second; ++It) {
+      Depth[It->second] = Depth[i] + 1;
+      Stack.push_back(It->second);
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  cl::ParseCommandLineOptions(argc, argv, "Merge loop profiles");
+
+  std::vector<std::pair<std::string, double>> Inputs;
+  for (auto& Prefix : InputPrefixes)
+    Inputs.emplace_back(Prefix, 1);
+  if (!InputList.empty()) {
+    std::ifstream Fin(InputList.c_str());
+    if (!Fin) {
+      std::cerr << "Cannot open " << InputList << std::endl;
+      return 1;
+    }
+    std::string Line;
+    while (std::getline(Fin, Line)) {
+      std::istringstream Fields(Line);
+      std::string Prefix;
+      double Weight = 1;
+      if (!(Fields >> Prefix) || Prefix[0] == '#')
+        continue;
+      Fields >> Weight;
+      Inputs.emplace_back(Prefix, Weight);
+    }
+  }
+
+  // merged by the time they ran
+  std::vector<ProcessInfo> Procs;
+  std::map<std::string, double> ShareWeights;
+  if (!ProcessDir.empty()) {
+    Procs = findProcesses(ProcessDir);
+    for (auto& Proc : Procs) {
+      Inputs.emplace_back(Proc.Prefix, 1);
+      ShareWeights[Proc.Prefix] = std::max(Proc.TimeMs, 1.0);
+    }
+  }
+
+  if (Inputs.empty()) {
+    std::cerr << "No profiles to merge" << std::endl;
+    return 1;
+  }
+
+  LoopCallProfile Merged;
+  CountFile Histograms, EdgeCounts;
+  ValueFile LoopValues;
+  unsigned NumMerged = 0;
+  for (auto& Input : Inputs) {
+    LoopCallProfile Profile;
+    Profile.readProfiles(Input.first);
+    if (Profile.GraphNodeMeta().empty()) {
+      std::cerr << "Skipping " << Input.first << ": no profile found"
+                << std::endl;
+      continue;
+    }
+    auto It = ShareWeights.find(Input.first);
+    Merged.merge(Profile, Input.second,
+                 It != ShareWeights.end() ? It->second : -1);
+    Histograms.add(Input.first + HistogramFileName, Input.second);
+    EdgeCounts.add(Input.first + EdgeCountFileName, Input.second);
+    LoopValues.add(Input.first + ValueProfileFileName, Input.second);
+    NumMerged++;
+  }
+  if (NumMerged == 0)
+    return 1;
+
+  Merged.writeProfiles(OutputPrefix);
+  Histograms.write(OutputPrefix + HistogramFileName);
+  EdgeCounts.write(OutputPrefix + EdgeCountFileName);
+  LoopValues.write(OutputPrefix + ValueProfileFileName);
+  if (!Procs.empty())
+    writeProcessTree(Procs, OutputPrefix + "loop-prof.procs.csv");
+#ifndef NDEBUG
+  std::cout << "Merged " << NumMerged << " profiles into " << OutputPrefix
+            << std::endl;
+#endif
+  return 0;
+}
@@ -4,36 +4,165 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <math.h>
 #include <assert.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <string>
 
 #include "common.h"
 #include "LoopCallProfile.h"
+#include "ProfileFormat.h"
 
 #define END_OF_ROW -1
 
-// sample every 100 us
+// sample every 100 us unless LOOP_PROF_FREQ says otherwise
 #define SAMPLING_INTERVAL 100
 
+// capacity (in 32-bit words) of each in-memory sample ring, must be a power
+// of two
+#define RING_WORDS (1 << 20)
+
+// initial number of slots in the edge table, must be a power of two
+#define EDGE_TABLE_SIZE (1 << 16)
+
+// initial number of nodes of the calling context tree, a power of two
+#define CCT_SIZE (1 << 12)
+
+// how often the drain thread looks at the rings
+#define DRAIN_INTERVAL_MS 10
+
+// bounds of the sampling period picked for a target number of samples, in ns
+#define MIN_SAMPLING_PERIOD 10000L
+#define MAX_SAMPLING_PERIOD 100000000L
+
+// number of precomputed exponential variates used to jitter the timer
+#define EXP_TABLE_SIZE 4096
+
+// hardware events read at every sample, see `open_counters`
+enum {
+  CTR_CYCLES,
+  CTR_INSTRUCTIONS,
+  CTR_LLC_MISSES,
+  CTR_BRANCH_MISSES,
+  NUM_COUNTERS
+};
+
 static uint32_t _prof_num_loops_tot = 0;
 
 void _prof_init() __attribute__((constructor));
 void _prof_dump() __attribute__((destructor));
 
+#ifdef __linux__
+// older glibc only exposes the raw union member
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
 // Profile data about a single loop
 struct loop_data {
   char *func;
   int32_t header_id; // > 0 if it's loop, = 0 if it's a function
+  int32_t parent_id; // header id of the enclosing profiled loop, or 0
   int64_t runs;
+  uint64_t fingerprint; // identifies the loop across builds, 0 if function
+};
+
+// Exact cycle counts of a loop (or function) of a thread, maintained by
+// modules instrumented with `-exact-timing`.  Only `cycles`, `calls` and
+// `probes` (the number of probes executed during `cycles`) are results.
+struct loop_timing {
+  uint64_t cycles, calls, probes;
+  uint64_t start, start_probes;
+};
+
+// Histograms of a profiled loop of a thread, maintained by modules
+// instrumented with `-trip-counts` or `-loop-latency`.  Bucket b counts the
+// entries of the loop whose value was in [2^(b-1), 2^b), bucket 0 those
+// where it was 0; the last bucket is open-ended.  `trips` and `start` are
+// the iterations and cycle counter of the running entry.
+#define HIST_BUCKETS 48
+enum { HIST_TRIPS, HIST_CYCLES, HIST_CYCLES_PER_ITER, NUM_HIST_KINDS };
+static const char *const hist_kind_names[NUM_HIST_KINDS] = {
+    "trips", "cycles", "cycles-per-iter"};
+
+struct loop_histogram {
+  uint64_t trips, start;
+  uint64_t buckets[NUM_HIST_KINDS][HIST_BUCKETS];
+};
+
+// A CFG edge counted by modules instrumented with `-edge-counts`: the
+// function (the index of its row in `_prof_loops_p`) and the ids of the
+// blocks at both ends, numbered like loop headers (the entry block is 1).
+// The counts are kept per thread with `-thread-local`, like the histograms.
+struct cfg_edge {
+  int32_t func_idx, src, dst;
+};
+
+// A value live into a profiled loop whose most frequent values modules
+// instrumented with `-value-profile` record at the loop's preheader (see
+// LoopValues.h): the loop (the index of its row in `_prof_loops_p`), the
+// kind of value and its position among the values of the loop.  For a
+// pointer, its alignment is recorded, up to that of a cache line.
+#define VALUE_SLOTS 4
+#define MAX_VALUE_ALIGN 64
+enum { VALUE_BOUND, VALUE_STRIDE, VALUE_ALIGN, NUM_VALUE_KINDS };
+static const char *const value_kind_names[NUM_VALUE_KINDS] = {
+    "bound", "stride", "align"};
+
+struct loop_value {
+  int32_t loop_idx, kind, operand;
+};
+
+// The values of a loop value seen most often, and how often it was
+// recorded.  A value that isn't kept replaces the one seen least often and
+// is counted from 1 on, so the counts are lower bounds.  Modules
+// instrumented with `-thread-local` keep a table per thread.
+struct value_counts {
+  int64_t values[VALUE_SLOTS];
+  uint64_t counts[VALUE_SLOTS];
+  uint64_t total;
 };
 
-static LoopCallProfile profile;
+// The memory accesses of a profiled top-level loop sampled by modules
+// instrumented with `-mem-sample`: the loop (the index of its row in
+// `_prof_loops_p`), the accesses sampled, those that were the first to
+// their cache line, the distinct lines the loop accessed and the reuse
+// distances of the other accesses, bucketed like the histograms.
+//
+// An access is sampled if the hash of its line falls below a threshold
+// (as in SHARDS), so every access to a sampled line is, and the sampled
+// lines are one in the module's rate of all lines.  The reuse distance of
+// an access is the number of distinct sampled lines accessed since the
+// last access to its line, in the sampled accesses of all loops and
+// threads.  Line counts are scaled up by the rate when they are written.
+#define MEM_LINE_SHIFT 6
+
+struct mem_profile {
+  int32_t loop_idx;
+  uint64_t samples, cold, lines;
+  uint64_t reuse[HIST_BUCKETS];
+};
 
 // Create a linked list of descriptors, one per linked module.
 //
@@ -42,6 +171,43 @@ typedef struct module_desc_t {
   uint32_t _prof_num_loops;
   struct loop_data *_prof_loops_p;
   uint32_t *_prof_loops_running_p;
+  // non-null if `_prof_loops_running` is thread-local, in which case it
+  // returns the copy of the calling thread
+  int32_t *(*_get_running)();
+  // non-null if the module was instrumented with `-exact-timing`, in which
+  // case it returns the calling thread's timings and `_timing_totals` sums
+  // up those of the threads (cycles, calls and probes per loop)
+  struct loop_timing *(*_get_timing)();
+  uint64_t *_timing_totals;
+  // non-null if the module was instrumented with `-low-overhead`, in which
+  // case the run counts are kept apart (per thread with `-thread-local`)
+  // and added to `runs` of `_prof_loops_p` when collected
+  int64_t *(*_get_runs)();
+  // non-null if the module keeps histograms of its profiled loops (the
+  // loops, in order, not the functions), in which case it returns the
+  // calling thread's and `_histogram_totals` sums up the buckets of the
+  // threads
+  struct loop_histogram *(*_get_histograms)();
+  uint64_t *_histogram_totals;
+  uint32_t _num_histograms;
+  // non-null if the module counts the edges of its CFGs, in which case
+  // `_get_cfg_edge_counts` returns the calling thread's counts and
+  // `_cfg_edge_totals` sums up those of the threads
+  const struct cfg_edge *_cfg_edges;
+  int64_t *(*_get_cfg_edge_counts)();
+  int64_t *_cfg_edge_totals;
+  uint32_t _num_cfg_edges;
+  // non-null if the module records the values of its profiled loops, in
+  // which case `_get_value_counts` returns the calling thread's counts and
+  // `_value_totals` merges those of the threads
+  const struct loop_value *_loop_values;
+  struct value_counts *(*_get_value_counts)();
+  struct value_counts *_value_totals;
+  uint32_t _num_loop_values;
+  // non-null if the module samples the memory accesses of its loops
+  struct mem_profile *_mem_profiles;
+  uint32_t _num_mem_profiles;
+  uint32_t _mem_rate;
   struct module_desc_t *next;
 } module_desc;
 
@@ -76,6 +242,24 @@ extern "C" void add_module_desc(char* moduleName,
   new_entry->_prof_num_loops = (uint32_t)numloops;
   new_entry->_prof_loops_p = _p_l;
   new_entry->_prof_loops_running_p = (uint32_t *)_p_l_r;
+  new_entry->_get_running = NULL;
+  new_entry->_get_timing = NULL;
+  new_entry->_timing_totals = NULL;
+  new_entry->_get_runs = NULL;
+  new_entry->_get_histograms = NULL;
+  new_entry->_histogram_totals = NULL;
+  new_entry->_num_histograms = 0;
+  new_entry->_cfg_edges = NULL;
+  new_entry->_get_cfg_edge_counts = NULL;
+  new_entry->_cfg_edge_totals = NULL;
+  new_entry->_num_cfg_edges = 0;
+  new_entry->_loop_values = NULL;
+  new_entry->_get_value_counts = NULL;
+  new_entry->_value_totals = NULL;
+  new_entry->_num_loop_values = 0;
+  new_entry->_mem_profiles = NULL;
+  new_entry->_num_mem_profiles = 0;
+  new_entry->_mem_rate = 1;
   new_entry->next = NULL;
 #ifndef NDEBUG
   printf("Registering one module desc!\n");
@@ -84,9 +268,684 @@ extern "C" void add_module_desc(char* moduleName,
 
 static struct timespec begin;
 
-FILE *dumpfile;
-size_t dumpsize;
-size_t num_sampled;
+// Preallocated single-writer/single-reader ring of sample records.  The
+// signal handler of the owning thread appends to it; the drain thread folds
+// the records into the edge table.  `head` and `tail` count words and only
+// ever grow; they are masked when indexing `buf`.
+struct sample_ring {
+  uint32_t *buf;
+  uint64_t head; // written by the signal handler only
+  uint64_t tail; // written by the drain thread only
+  uint64_t dropped; // samples that didn't fit
+};
+
+// Where a thread keeps the timings, run counts, histograms, edge counts and
+// value counts of a module instrumented with `-thread-local` (what the
+// module's getters return on that thread), so they can be summed up while
+// the thread runs
+struct thread_blocks {
+  module_desc *desc;
+  struct loop_timing *timing;
+  int64_t *runs;
+  struct loop_histogram *hists;
+  int64_t *edge_counts;
+  struct value_counts *values;
+  struct thread_blocks *next;
+};
+
+// Sample stream of one profiled thread (or of the whole process when
+// not profiling per thread)
+struct thread_state {
+  uint32_t id; // 0 for the main thread, in order of registration otherwise
+  sample_ring ring;
+  size_t num_sampled;
+  // number of samples in which each loop was running (indexed globally)
+  uint64_t *self;
+  uint32_t self_size;
+  // hardware events counted while each loop was running, NUM_COUNTERS per
+  // loop; only used if the thread has counters
+  uint64_t *counts;
+#ifdef __linux__
+  pid_t tid;
+  timer_t timer;
+  int perf_fd;
+#endif
+  // counter group of this thread, led by the first one; -1 if there is none
+  int counter_fds[NUM_COUNTERS];
+  uint64_t last_counts[NUM_COUNTERS];
+  // wall-clock mode only: time spent on and off CPU while each loop was
+  // running (in ns, two per loop), and the clocks at the previous sample
+  uint64_t *cpu_times;
+  uint64_t last_cpu_ns, last_wall_ns;
+  // what drives the sampling of this thread, NULL once it is stopped
+  const struct sampling_backend *backend;
+  uint32_t rng; // xorshift state used to jitter the timer
+  // the thread's blocks of each thread-local module, NULL once the thread
+  // handed them in (see `collect_thread_counts`)
+  struct thread_blocks *blocks;
+  struct thread_state *next;
+};
+
+// A sampling backend decides which clock drives SIGPROF.  `start` begins
+// sampling the calling thread (or the whole process for `process_state`)
+// and returns false if the backend isn't available; `rearm` is called from
+// the signal handler after every sample; `stop` may be called from any
+// thread.
+struct sampling_backend {
+  const char *name;
+  bool (*start)(thread_state *ts);
+  void (*rearm)(thread_state *ts);
+  void (*stop)(thread_state *ts);
+};
+
+// used when the loop nesting state is process-wide. Keep it (and everything
+// else `_prof_dump` needs) free of C++ destructors: they run before
+// `_prof_dump` does.
+static thread_state process_state;
+
+// Per-thread mode is turned on when any module keeps its nesting state in
+// thread-local storage (i.e. was instrumented with `-thread-local`)
+static bool thread_mode = false;
+static bool sampling_stopped = false;
+// Set once the program starts a thread while not profiling per thread.  The
+// hardware counters of `process_state` only count the main thread, so they
+// aren't reported then.
+static bool other_threads_started = false;
+static thread_state *thread_list_head = NULL;
+static uint32_t num_threads = 0;
+// The samples of the threads that exited, handed in by `retire_thread`:
+// `self`, `counts` and `cpu_times` as in `thread_state`, `size` loops each
+struct exited_samples {
+  uint32_t num_threads;
+  size_t num_sampled;
+  uint32_t size;
+  uint64_t *self, *counts, *cpu_times;
+  bool has_counters;
+};
+static exited_samples exited_threads;
+static pthread_mutex_t thread_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread thread_state *self_thread = NULL;
+
+static void register_thread();
+static void record_thread_blocks(module_desc *desc);
+static void init_ring(sample_ring *ring);
+static void init_sampling();
+static void stop_sampling(thread_state *ts);
+static void open_counters(thread_state *ts);
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-thread-local`
+extern "C" void add_module_running_getter(int32_t *(*getter)()) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_get_running = getter;
+
+  if (thread_mode)
+    return;
+#ifdef __linux__
+  thread_mode = true;
+  init_sampling();
+  stop_sampling(&process_state);
+  // the main thread is the one running global constructors
+  register_thread();
+#else
+  fprintf(stderr, "Per-thread profiling is not supported on this platform\n");
+#endif
+}
+
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__clang__)
+  return __builtin_readcyclecounter();
+#else
+  return 0;
+#endif
+}
+
+// Cost in cycles of one `-exact-timing` probe, measured on the sequence
+// the instrumentation emits: a cycle counter read plus a few loads, stores
+// and selects.  Keep the fastest of a few trials to leave out interrupts.
+static uint64_t probe_overhead = 0;
+
+static void calibrate_probe_overhead() {
+  const unsigned probes = 1000;
+  static volatile uint64_t counter, start, total;
+  uint64_t best = UINT64_MAX;
+  for (unsigned trial = 0; trial < 10; trial++) {
+    uint64_t begin = read_cycles();
+    for (unsigned i = 0; i < probes; i++) {
+      uint64_t now = read_cycles(), n = counter + 1;
+      counter = n;
+      start = (n & 1) ? now : start;
+      total = total + ((n & 1) ? 0 : now - start);
+    }
+    uint64_t cycles = (read_cycles() - begin) / probes;
+    if (cycles < best)
+      best = cycles;
+  }
+  probe_overhead = best;
+}
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-exact-timing`
+extern "C" void add_module_timing(struct loop_timing *(*getter)()) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_get_timing = getter;
+  module_desc_list_tail->_timing_totals = (uint64_t *)calloc(
+      module_desc_list_tail->_prof_num_loops * 3, sizeof(uint64_t));
+  record_thread_blocks(module_desc_list_tail);
+
+  static bool calibrated = false;
+  if (!calibrated) {
+    calibrated = true;
+    calibrate_probe_overhead();
+  }
+}
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-low-overhead`
+extern "C" void add_module_runs(int64_t *(*getter)()) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_get_runs = getter;
+  record_thread_blocks(module_desc_list_tail);
+}
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-trip-counts` or `-loop-latency`
+extern "C" void add_module_histograms(struct loop_histogram *(*getter)(),
+                                      int32_t num_loops) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_get_histograms = getter;
+  module_desc_list_tail->_num_histograms = num_loops;
+  module_desc_list_tail->_histogram_totals = (uint64_t *)calloc(
+      num_loops * NUM_HIST_KINDS * HIST_BUCKETS, sizeof(uint64_t));
+  record_thread_blocks(module_desc_list_tail);
+}
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-edge-counts`
+extern "C" void add_module_cfg_edges(const struct cfg_edge *edges,
+                                     int64_t *(*getter)(),
+                                     int32_t num_edges) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_cfg_edges = edges;
+  module_desc_list_tail->_get_cfg_edge_counts = getter;
+  module_desc_list_tail->_num_cfg_edges = num_edges;
+  module_desc_list_tail->_cfg_edge_totals =
+      (int64_t *)calloc(num_edges, sizeof(int64_t));
+  record_thread_blocks(module_desc_list_tail);
+}
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-value-profile`
+extern "C" void add_module_loop_values(const struct loop_value *values,
+                                       struct value_counts *(*getter)(),
+                                       int32_t num_values) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_loop_values = values;
+  module_desc_list_tail->_get_value_counts = getter;
+  module_desc_list_tail->_num_loop_values = num_values;
+  module_desc_list_tail->_value_totals = (struct value_counts *)calloc(
+      num_values, sizeof(struct value_counts));
+  record_thread_blocks(module_desc_list_tail);
+}
+
+// Called at the preheader of a loop for each of its values
+extern "C" void record_loop_value(struct value_counts *counts, int64_t value,
+                                  int32_t kind) {
+  if (kind == VALUE_ALIGN) {
+    uint64_t align = (uint64_t)value & -(uint64_t)value;
+    value = align == 0 || align > MAX_VALUE_ALIGN ? MAX_VALUE_ALIGN : align;
+  }
+  counts->total++;
+  unsigned least = 0;
+  for (unsigned i = 0; i < VALUE_SLOTS; i++) {
+    if (counts->counts[i] != 0 && counts->values[i] == value) {
+      counts->counts[i]++;
+      return;
+    }
+    if (counts->counts[i] < counts->counts[least])
+      least = i;
+  }
+  counts->values[least] = value;
+  counts->counts[least] = 1;
+}
+
+// Add the counts of `from` to `into`.  A value `into` doesn't keep replaces
+// the one it saw least often if `from` saw it more often, so the counts
+// stay lower bounds.
+static void merge_value_counts(struct value_counts *into,
+                               const struct value_counts *from) {
+  into->total += from->total;
+  for (unsigned j = 0; j < VALUE_SLOTS; j++) {
+    if (from->counts[j] == 0)
+      continue;
+    unsigned i = 0, least = 0;
+    for (; i < VALUE_SLOTS; i++) {
+      if (into->counts[i] != 0 && into->values[i] == from->values[j])
+        break;
+      if (into->counts[i] < into->counts[least])
+        least = i;
+    }
+    if (i < VALUE_SLOTS) {
+      into->counts[i] += from->counts[j];
+    } else if (into->counts[least] < from->counts[j]) {
+      into->values[least] = from->values[j];
+      into->counts[least] = from->counts[j];
+    }
+  }
+}
+
+// Called right after `add_module_desc` by modules instrumented with
+// `-mem-sample`
+extern "C" void add_module_mem_profiles(struct mem_profile *profiles,
+                                        int32_t num_profiles, int32_t rate) {
+  assert(module_desc_list_tail && "Module must be registered first");
+  module_desc_list_tail->_mem_profiles = profiles;
+  module_desc_list_tail->_num_mem_profiles = num_profiles;
+  module_desc_list_tail->_mem_rate = rate > 0 ? rate : 1;
+}
+
+// The sampled lines with the time of their last access (the number of
+// sampled accesses before it), and the (loop, line) pairs accessed, in
+// hash tables with linear probing.  A Fenwick tree over the times has a 1
+// at the last access of each line, so the lines accessed last after a
+// time are counted in logarithmic time (Olken's algorithm).
+struct line_time {
+  uint64_t line; // 0 if the slot is free, lines count from 1
+  uint32_t time;
+};
+struct loop_line {
+  struct mem_profile *profile; // NULL if the slot is free
+  uint64_t line;
+};
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static line_time *mem_lines = NULL;
+static size_t mem_lines_size = 0, mem_num_lines = 0;
+static loop_line *mem_loop_lines = NULL;
+static size_t mem_loop_lines_size = 0, mem_num_loop_lines = 0;
+static uint32_t *mem_tree = NULL;
+static uint32_t mem_tree_size = 0, mem_time = 0;
+
+#define MEM_TABLE_SIZE (1 << 12)
+#define MEM_TREE_SIZE (1 << 16)
+
+static inline size_t mem_slot(uint64_t key, size_t size) {
+  uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+  return (h ^ (h >> 29)) & (size - 1);
+}
+
+static line_time *find_line(line_time *table, size_t size, uint64_t line) {
+  for (size_t i = mem_slot(line, size);; i = (i + 1) & (size - 1))
+    if (table[i].line == line || table[i].line == 0)
+      return &table[i];
+}
+
+static loop_line *find_loop_line(loop_line *table, size_t size,
+                                 struct mem_profile *profile, uint64_t line) {
+  for (size_t i = mem_slot(line ^ (uintptr_t)profile, size);;
+       i = (i + 1) & (size - 1))
+    if (table[i].profile == NULL ||
+        (table[i].profile == profile && table[i].line == line))
+      return &table[i];
+}
+
+// Keep the tables at most half full
+static void grow_mem_tables() {
+  if (mem_num_lines * 2 >= mem_lines_size) {
+    size_t size = mem_lines_size * 2;
+    line_time *table = (line_time *)calloc(size, sizeof(line_time));
+    for (size_t i = 0; i < mem_lines_size; i++)
+      if (mem_lines[i].line)
+        *find_line(table, size, mem_lines[i].line) = mem_lines[i];
+    free(mem_lines);
+    mem_lines = table;
+    mem_lines_size = size;
+  }
+  if (mem_num_loop_lines * 2 >= mem_loop_lines_size) {
+    size_t size = mem_loop_lines_size * 2;
+    loop_line *table = (loop_line *)calloc(size, sizeof(loop_line));
+    for (size_t i = 0; i < mem_loop_lines_size; i++)
+      if (mem_loop_lines[i].profile)
+        *find_loop_line(table, size, mem_loop_lines[i].profile,
+                        mem_loop_lines[i].line) = mem_loop_lines[i];
+    free(mem_loop_lines);
+    mem_loop_lines = table;
+    mem_loop_lines_size = size;
+  }
+}
+
+static void mem_tree_add(uint32_t time, uint32_t delta) {
+  for (; time < mem_tree_size; time += time & -time)
+    mem_tree[time] += delta;
+}
+
+static uint32_t mem_tree_sum(uint32_t time) {
+  uint32_t sum = 0;
+  for (; time > 0; time -= time & -time)
+    sum += mem_tree[time];
+  return sum;
+}
+
+// Renumber the last accesses of the lines 1, 2, ... in their order to make
+// room for new times, growing the tree if the lines take half of it
+static void compact_mem_times() {
+  std::vector<line_time *> order;
+  for (size_t i = 0; i < mem_lines_size; i++)
+    if (mem_lines[i].line)
+      order.push_back(&mem_lines[i]);
+  std::sort(order.begin(), order.end(),
+            [](const line_time *a, const line_time *b) {
+              return a->time < b->time;
+            });
+  if (order.size() * 2 >= mem_tree_size) {
+    mem_tree_size *= 2;
+    free(mem_tree);
+    mem_tree = (uint32_t *)malloc(mem_tree_size * sizeof(uint32_t));
+  }
+  memset(mem_tree, 0, mem_tree_size * sizeof(uint32_t));
+  for (uint32_t i = 0; i < order.size(); i++) {
+    order[i]->time = i + 1;
+    mem_tree_add(i + 1, 1);
+  }
+  mem_time = order.size();
+}
+
+// Add a sampled access to the tables and to the profile of its loop
+static void add_mem_access(struct mem_profile *profile, uint64_t line) {
+  if (mem_tree == NULL) {
+    mem_lines_size = mem_loop_lines_size = MEM_TABLE_SIZE;
+    mem_lines = (line_time *)calloc(mem_lines_size, sizeof(line_time));
+    mem_loop_lines = (loop_line *)calloc(mem_loop_lines_size,
+                                         sizeof(loop_line));
+    mem_tree_size = MEM_TREE_SIZE;
+    mem_tree = (uint32_t *)calloc(mem_tree_size, sizeof(uint32_t));
+  }
+  if (mem_time + 1 >= mem_tree_size)
+    compact_mem_times();
+
+  uint32_t now = ++mem_time;
+  profile->samples++;
+  line_time *last = find_line(mem_lines, mem_lines_size, line);
+  if (last->line == 0) {
+    profile->cold++;
+    last->line = line;
+    mem_num_lines++;
+  } else {
+    uint32_t distance = mem_tree_sum(now - 1) - mem_tree_sum(last->time);
+    mem_tree_add(last->time, (uint32_t)-1);
+    unsigned b = distance ? 64 - __builtin_clzll(distance) : 0;
+    profile->reuse[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+  }
+  last->time = now;
+  mem_tree_add(now, 1);
+
+  loop_line *seen =
+      find_loop_line(mem_loop_lines, mem_loop_lines_size, profile, line);
+  if (seen->profile == NULL) {
+    seen->profile = profile;
+    seen->line = line;
+    mem_num_loop_lines++;
+    profile->lines++;
+  }
+  grow_mem_tables();
+}
+
+// Single-writer/single-reader buffer of the sampled accesses of a thread.
+// The thread appends to it; the drain thread adds the accesses to the
+// tables, so the accesses of different threads are interleaved by buffer
+// rather than one by one.  A thread whose buffer is full adds them itself.
+// Buffers are read and unlinked under `mem_lock` only.
+#define MEM_BUFFER_SIZE (1 << 12)
+
+struct mem_access {
+  struct mem_profile *profile;
+  uint64_t line;
+};
+struct mem_buffer {
+  mem_access buf[MEM_BUFFER_SIZE];
+  uint64_t head; // written by the owning thread only
+  uint64_t tail; // written under `mem_lock` only
+  struct mem_buffer *next;
+};
+static mem_buffer *mem_buffer_list_head = NULL;
+static __thread mem_buffer *self_mem_buffer = NULL;
+static pthread_key_t mem_buffer_key;
+static bool has_mem_buffer_key = false;
+
+static void drain_mem_buffer(mem_buffer *mb) {
+  uint64_t head = __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = mb->tail;
+  for (; tail != head; tail++) {
+    const mem_access *access = &mb->buf[tail & (MEM_BUFFER_SIZE - 1)];
+    add_mem_access(access->profile, access->line);
+  }
+  __atomic_store_n(&mb->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void drain_mem_buffers() {
+  pthread_mutex_lock(&mem_lock);
+  for (mem_buffer *mb = mem_buffer_list_head; mb != NULL; mb = mb->next)
+    drain_mem_buffer(mb);
+  pthread_mutex_unlock(&mem_lock);
+}
+
+// Hand in the accesses of an exiting thread and free its buffer
+static void retire_mem_buffer(void *arg) {
+  mem_buffer *mb = (mem_buffer *)arg;
+  pthread_mutex_lock(&mem_lock);
+  drain_mem_buffer(mb);
+  mem_buffer **link = &mem_buffer_list_head;
+  while (*link != mb)
+    link = &(*link)->next;
+  *link = mb->next;
+  pthread_mutex_unlock(&mem_lock);
+  self_mem_buffer = NULL;
+  free(mb);
+}
+
+static mem_buffer *new_mem_buffer() {
+  mem_buffer *mb = (mem_buffer *)calloc(1, sizeof(mem_buffer));
+  if (mb == NULL) {
+    perror("Unable to allocate memory access buffer");
+    exit(1);
+  }
+  pthread_mutex_lock(&mem_lock);
+  if (!has_mem_buffer_key) {
+    pthread_key_create(&mem_buffer_key, retire_mem_buffer);
+    has_mem_buffer_key = true;
+  }
+  mb->next = mem_buffer_list_head;
+  mem_buffer_list_head = mb;
+  pthread_mutex_unlock(&mem_lock);
+  pthread_setspecific(mem_buffer_key, mb);
+  self_mem_buffer = mb;
+  return mb;
+}
+
+// Called before a sampled access of a loop
+extern "C" void record_mem_access(struct mem_profile *profile, void *addr) {
+  mem_buffer *mb = self_mem_buffer;
+  if (mb == NULL)
+    mb = new_mem_buffer();
+  uint64_t head = mb->head;
+  if (head - __atomic_load_n(&mb->tail, __ATOMIC_ACQUIRE) == MEM_BUFFER_SIZE) {
+    pthread_mutex_lock(&mem_lock);
+    drain_mem_buffer(mb);
+    pthread_mutex_unlock(&mem_lock);
+  }
+  mem_access *access = &mb->buf[head & (MEM_BUFFER_SIZE - 1)];
+  access->profile = profile;
+  access->line = ((uintptr_t)addr >> MEM_LINE_SHIFT) + 1;
+  __atomic_store_n(&mb->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Note where the calling thread keeps the timings, run counts, histograms,
+// edge counts and value counts of `desc`.  Modules that aren't thread-local keep one copy,
+// shared by all threads.
+static void record_thread_blocks(module_desc *desc) {
+  thread_state *ts = self_thread;
+  if (ts == NULL || desc->_get_running == NULL)
+    return;
+  struct loop_timing *timing = desc->_get_timing ? desc->_get_timing() : NULL;
+  int64_t *runs = desc->_get_runs ? desc->_get_runs() : NULL;
+  struct loop_histogram *hists =
+      desc->_get_histograms ? desc->_get_histograms() : NULL;
+  int64_t *edge_counts =
+      desc->_get_cfg_edge_counts ? desc->_get_cfg_edge_counts() : NULL;
+  struct value_counts *values =
+      desc->_get_value_counts ? desc->_get_value_counts() : NULL;
+  if (timing == NULL && runs == NULL && hists == NULL && edge_counts == NULL &&
+      values == NULL)
+    return;
+
+  pthread_mutex_lock(&thread_list_lock);
+  thread_blocks *blocks = ts->blocks;
+  while (blocks != NULL && blocks->desc != desc)
+    blocks = blocks->next;
+  if (blocks == NULL) {
+    blocks = new thread_blocks();
+    blocks->desc = desc;
+    blocks->next = ts->blocks;
+    ts->blocks = blocks;
+  }
+  blocks->timing = timing;
+  blocks->runs = runs;
+  blocks->hists = hists;
+  blocks->edge_counts = edge_counts;
+  blocks->values = values;
+  pthread_mutex_unlock(&thread_list_lock);
+}
+
+// Add the timings, run counts, histograms, edge counts and value counts of
+// an exiting thread to the totals, and forget its blocks, which go away
+// with it
+static void collect_thread_counts(thread_state *ts) {
+  pthread_mutex_lock(&thread_list_lock);
+  thread_blocks *blocks = ts->blocks;
+  ts->blocks = NULL;
+  while (blocks != NULL) {
+    module_desc *desc = blocks->desc;
+    if (blocks->runs != NULL)
+      for (uint32_t i = 0; i < desc->_prof_num_loops; i++)
+        desc->_prof_loops_p[i].runs += blocks->runs[i];
+    if (blocks->hists != NULL) {
+      uint64_t *totals = desc->_histogram_totals;
+      for (uint32_t i = 0; i < desc->_num_histograms; i++) {
+        const uint64_t *buckets = &blocks->hists[i].buckets[0][0];
+        for (unsigned b = 0; b < NUM_HIST_KINDS * HIST_BUCKETS; b++)
+          *totals++ += buckets[b];
+      }
+    }
+    if (blocks->edge_counts != NULL)
+      for (uint32_t i = 0; i < desc->_num_cfg_edges; i++)
+        desc->_cfg_edge_totals[i] += blocks->edge_counts[i];
+    if (blocks->values != NULL)
+      for (uint32_t i = 0; i < desc->_num_loop_values; i++)
+        merge_value_counts(&desc->_value_totals[i], &blocks->values[i]);
+    if (blocks->timing != NULL) {
+      uint64_t *totals = desc->_timing_totals;
+      for (uint32_t i = 0; i < desc->_prof_num_loops; i++) {
+        totals[3 * i] += blocks->timing[i].cycles;
+        totals[3 * i + 1] += blocks->timing[i].calls;
+        totals[3 * i + 2] += blocks->timing[i].probes;
+      }
+    }
+    thread_blocks *next = blocks->next;
+    delete blocks;
+    blocks = next;
+  }
+  pthread_mutex_unlock(&thread_list_lock);
+}
+
+// The timings (cycles, calls and probes per loop), run counts, histograms,
+// edge counts and value counts of a module, summed up over all threads
+struct module_counts {
+  std::vector<uint64_t> timing;
+  std::vector<int64_t> runs;
+  std::vector<uint64_t> hists;
+  std::vector<int64_t> edges;
+  std::vector<struct value_counts> values;
+};
+
+static void add_counts(module_counts *sums, const module_desc *desc,
+                       const struct loop_timing *timing, const int64_t *runs,
+                       const struct loop_histogram *hists,
+                       const int64_t *edge_counts,
+                       const struct value_counts *values) {
+  if (timing != NULL)
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++) {
+      sums->timing[3 * i] += timing[i].cycles;
+      sums->timing[3 * i + 1] += timing[i].calls;
+      sums->timing[3 * i + 2] += timing[i].probes;
+    }
+  if (runs != NULL)
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++)
+      sums->runs[i] += runs[i];
+  if (hists != NULL)
+    for (uint32_t i = 0; i < desc->_num_histograms; i++) {
+      const uint64_t *buckets = &hists[i].buckets[0][0];
+      for (unsigned b = 0; b < NUM_HIST_KINDS * HIST_BUCKETS; b++)
+        sums->hists[i * NUM_HIST_KINDS * HIST_BUCKETS + b] += buckets[b];
+    }
+  if (edge_counts != NULL)
+    for (uint32_t i = 0; i < desc->_num_cfg_edges; i++)
+      sums->edges[i] += edge_counts[i];
+  if (values != NULL)
+    for (uint32_t i = 0; i < desc->_num_loop_values; i++)
+      merge_value_counts(&sums->values[i], &values[i]);
+}
+
+// Sum up the counts of each module (in the order of the list): those
+// handed in by the threads that exited, and those of `threads` and of the
+// modules that aren't thread-local so far.  The counts of running threads
+// are only read, never cleared, as the threads may be adding to them.
+static std::vector<module_counts>
+sum_thread_counts(const std::vector<thread_state *> &threads) {
+  std::vector<module_counts> sums;
+  std::map<const module_desc *, module_counts *> sums_of;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    sums.push_back(module_counts());
+
+  pthread_mutex_lock(&thread_list_lock);
+  module_counts *mc = sums.data();
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next, mc++) {
+    sums_of[desc] = mc;
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++)
+      mc->runs.push_back(desc->_prof_loops_p[i].runs);
+    if (desc->_timing_totals != NULL)
+      mc->timing.assign(desc->_timing_totals,
+                        desc->_timing_totals + desc->_prof_num_loops * 3);
+    if (desc->_histogram_totals != NULL)
+      mc->hists.assign(desc->_histogram_totals,
+                       desc->_histogram_totals + desc->_num_histograms *
+                                                     NUM_HIST_KINDS *
+                                                     HIST_BUCKETS);
+    if (desc->_cfg_edge_totals != NULL)
+      mc->edges.assign(desc->_cfg_edge_totals,
+                       desc->_cfg_edge_totals + desc->_num_cfg_edges);
+    if (desc->_value_totals != NULL)
+      mc->values.assign(desc->_value_totals,
+                        desc->_value_totals + desc->_num_loop_values);
+    if (desc->_get_running == NULL)
+      add_counts(mc, desc, desc->_get_timing ? desc->_get_timing() : NULL,
+                 desc->_get_runs ? desc->_get_runs() : NULL,
+                 desc->_get_histograms ? desc->_get_histograms() : NULL,
+                 desc->_get_cfg_edge_counts ? desc->_get_cfg_edge_counts()
+                                            : NULL,
+                 desc->_get_value_counts ? desc->_get_value_counts() : NULL);
+  }
+  for (thread_state *ts : threads)
+    for (thread_blocks *blocks = ts->blocks; blocks != NULL;
+         blocks = blocks->next)
+      add_counts(sums_of[blocks->desc], blocks->desc, blocks->timing,
+                 blocks->runs, blocks->hists, blocks->edge_counts,
+                 blocks->values);
+  pthread_mutex_unlock(&thread_list_lock);
+  return sums;
+}
 
 // exponential distribution with lambda = 1
 // note that this means the expected value is also one (E[X] = 1/lambda)
@@ -98,193 +957,1910 @@ static inline float rand_exp() {
   return x;
 }
 
+// The timer is re-armed from the signal handler, which can't call `rand` or
+// `logf`; it draws from a table of exponential variates instead.
+static float exp_table[EXP_TABLE_SIZE];
+
+static void init_exp_table() {
+  for (unsigned i = 0; i < EXP_TABLE_SIZE; i++)
+    exp_table[i] = rand_exp();
+}
+
+// async-signal-safe version of `rand_exp`
+static inline float next_exp(uint32_t *rng) {
+  uint32_t x = *rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *rng = x;
+  return exp_table[x % EXP_TABLE_SIZE];
+}
+
 static void dump_sample(int signo);
 
+static void install_handler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = dump_sample;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) != 0) {
+    perror("Unable to catch SIGPROF");
+    exit(1);
+  }
+}
+
+// mean sampling period
+static long sampling_period_ns = SAMPLING_INTERVAL * 1000L;
+
 // setup a timer that fires in T microseconds
-// T is a exponential random variable with expectation of `SAMPLING_INTERVAL`
-// microseconds
+// T is a exponential random variable with expectation of the sampling period
 static void setup_timer() {
   struct itimerval timerspec;
+  long usec = sampling_period_ns / 1000 * (next_exp(&process_state.rng) + 0.5);
 
   timerspec.it_interval.tv_sec = 0;
   timerspec.it_interval.tv_usec = 0;
-  timerspec.it_value.tv_sec = 0;
-  timerspec.it_value.tv_usec = SAMPLING_INTERVAL * (rand_exp() + 0.5);
+  timerspec.it_value.tv_sec = usec / 1000000;
+  timerspec.it_value.tv_usec = usec % 1000000;
 
-  if (signal(SIGPROF, dump_sample) == SIG_ERR) {
-    perror("Unable to catch SIGPROF");
-    exit(1);
-  }
+  setitimer(ITIMER_PROF, &timerspec, NULL);
+}
 
+static void stop_process_timer() {
+  struct itimerval timerspec;
+  memset(&timerspec, 0, sizeof timerspec);
   setitimer(ITIMER_PROF, &timerspec, NULL);
 }
 
-// running_instance[] is an array of integers recording which loops were
-// running at the time of the sample.  Use those to accumulate an NxN
-// matrix of profile entries, where profile[i][j] is for loops i and j,
-// and each profile entry is as defined above.
-//
-static void collect_sample_impl(
-    std::vector<std::pair<unsigned, unsigned>> running_instance) {
-  for (unsigned i = 0, e = running_instance.size(); i != e; i++) {
-    const auto &coli = running_instance[i];
-    profile.getFreq(coli.first, coli.first) += 1;
+#ifdef __linux__
+// Create the timer of a thread (or of the process) on clock `clock`
+static bool create_timer(thread_state *ts, clockid_t clock) {
+  struct sigevent sev;
+  memset(&sev, 0, sizeof sev);
+  sev.sigev_signo = SIGPROF;
+  if (ts == &process_state) {
+    sev.sigev_notify = SIGEV_SIGNAL;
+  } else {
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_notify_thread_id = ts->tid;
+  }
+  return timer_create(clock, &sev, &ts->timer) == 0;
+}
 
-    for (unsigned j = i + 1, e = running_instance.size(); j != e; j++) {
-      const auto &colj = running_instance[j];
-      assert(coli.first < colj.first);
+// arm the timer of a thread, same distribution as `setup_timer`
+static void setup_thread_timer(thread_state *ts) {
+  struct itimerspec timerspec;
+  memset(&timerspec, 0, sizeof timerspec);
+  long nsec = sampling_period_ns * (next_exp(&ts->rng) + 0.5);
+  timerspec.it_value.tv_sec = nsec / 1000000000L;
+  timerspec.it_value.tv_nsec = nsec % 1000000000L;
+  timer_settime(ts->timer, 0, &timerspec, NULL);
+}
+#endif
 
-      if (coli.second < colj.second) {
-        // i called j
-        profile.getFreq(coli.first, colj.first) += 1;
-      } else {
-        // j called i
-        profile.getFreq(colj.first, coli.first) += 1;
-      }
-    }
+// The itimer backend: `ITIMER_PROF` for the whole process, or a timer on
+// the thread's own CPU clock whose signal is delivered to that thread only.
+// Either is re-armed by hand with a random delay after every sample.
+static bool itimer_start(thread_state *ts) {
+  if (ts == &process_state) {
+    setup_timer();
+    return true;
   }
-  printf("\n");
+#ifdef __linux__
+  if (!create_timer(ts, CLOCK_THREAD_CPUTIME_ID))
+    return false;
+  setup_thread_timer(ts);
+  return true;
+#else
+  return false;
+#endif
 }
 
-// extract [(col1, val1), (col2, val2), ...] from a buffer like this: `col1|val1|col2|val2|endCol ...`
-// return bytes read from `dump`
-static int uncompress_one_row(std::vector<std::pair<unsigned, unsigned>> &row,
-                              int32_t *dump) {
-  int i = 0;
-  for (;;) {
-    int32_t col = dump[i++];
-    if (col == END_OF_ROW)
-      break;
-
-    uint32_t val = dump[i++];
-    row.push_back({col, val});
+static void itimer_rearm(thread_state *ts) {
+#ifdef __linux__
+  if (ts != &process_state) {
+    setup_thread_timer(ts);
+    return;
   }
-  return i;
+#endif
+  setup_timer();
 }
 
-static void collect_samples(int32_t *dump) {
-  // Nothing to do if there are zero loops
-  if (_prof_num_loops_tot == 0)
+static void itimer_stop(thread_state *ts) {
+#ifdef __linux__
+  if (ts != &process_state) {
+    timer_delete(ts->timer);
     return;
+  }
+#endif
+  stop_process_timer();
+}
 
-  std::vector<std::pair<unsigned, unsigned>> running_instance;
+static const sampling_backend itimer_backend = {"itimer", itimer_start,
+                                                itimer_rearm, itimer_stop};
 
-  size_t i;
-  for (i = 0; i < num_sampled; i++) {
+#ifdef __linux__
+// The perf backend: a software clock event of the calling thread that
+// raises SIGPROF on that thread every sampling period.  The kernel keeps the
+// period, so the handler only has to allow one more overflow signal.
+static uint64_t perf_clock = PERF_COUNT_SW_CPU_CLOCK;
 
-#ifndef NDEBUG
-    // Debug infinite loop
-    static int inCollect = 0;
-    printf("In collect_sample %d\n", ++inCollect);
-#endif
+static bool perf_start(thread_state *ts) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof attr);
+  attr.size = sizeof attr;
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.config = perf_clock;
+  attr.sample_period = sampling_period_ns;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  if (fd < 0)
+    return false;
 
-    // update profile of all the loops given a new sample
-    dump += uncompress_one_row(running_instance, dump);
-    collect_sample_impl(running_instance);
-    running_instance.resize(0);
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = syscall(SYS_gettid);
+  if (fcntl(fd, F_SETOWN_EX, &owner) != 0 ||
+      fcntl(fd, F_SETSIG, SIGPROF) != 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC) != 0) {
+    close(fd);
+    return false;
   }
+  ts->perf_fd = fd;
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
+  return true;
 }
 
-// similar to `fwrite` except guaranteeing writing all bytes
-static int fwriteall(void *buf, size_t size, FILE *f) {
-  size_t num_written = 0;
-  do {
-    ssize_t bytes = fwrite((char *)buf + num_written, 1, size - num_written, f);
-    assert(bytes >= 0 && "fwrite failed");
-    num_written += bytes;
-  } while (num_written < size);
-  return 0;
+static void perf_rearm(thread_state *ts) {
+  ioctl(ts->perf_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
-// Sample what loops and functions are running and write sample data to a file
-static void dump_one_sample(module_desc *desc, uint32_t global_idx) {
-  // Write the sample data for each module
-  uint32_t i;
-  for (i = 0; i < desc->_prof_num_loops; i++, global_idx++) {
-    if (desc->_prof_loops_running_p[i] == 0)
+static void perf_stop(thread_state *ts) {
+  ioctl(ts->perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+  close(ts->perf_fd);
+}
+
+static const sampling_backend perf_cpu_clock_backend = {
+    "perf-cpu-clock", perf_start, perf_rearm, perf_stop};
+static const sampling_backend perf_task_clock_backend = {
+    "perf-task-clock", perf_start, perf_rearm, perf_stop};
+
+// The wall backend samples on a monotonic clock, i.e. also while the
+// thread is blocked or sleeping; the handler then tells apart the time the
+// thread spent on and off CPU, see `dump_sample`.
+static bool wall_start(thread_state *ts) {
+  if (!create_timer(ts, CLOCK_MONOTONIC))
+    return false;
+  setup_thread_timer(ts);
+  return true;
+}
+
+static void wall_stop(thread_state *ts) {
+  timer_delete(ts->timer);
+}
+
+static const sampling_backend wall_backend = {"wall", wall_start,
+                                              setup_thread_timer, wall_stop};
+#endif
+
+// sampling on wall-clock time rather than on CPU time
+static bool wall_mode = false;
+
+static uint64_t now_ns(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// the CPU clock a thread's (or the process') samples are classified with
+static clockid_t cpu_clock_of(thread_state *ts) {
+  return ts == &process_state ? CLOCK_PROCESS_CPUTIME_ID
+                              : CLOCK_THREAD_CPUTIME_ID;
+}
+
+// the preferred backend, and the one that actually got used
+static const sampling_backend *backend = &itimer_backend;
+static const sampling_backend *active_backend = &itimer_backend;
+static bool backend_requested = false;
+
+// Name of an output file with $LOOP_PROF_PREFIX (e.g. a directory, to keep
+// profiles of different inputs apart) prepended
+static std::string prefixed_file_name(const char *name) {
+  const char *prefix = getenv("LOOP_PROF_PREFIX");
+  return std::string(prefix ? prefix : "") + name;
+}
+
+// Info file of the previous run.  With $LOOP_PROF_DIR every process of a
+// run wrote its own (see `process_dir`): take that of the first process of
+// the run written last, the one whose parent didn't write any.
+static std::string previous_info_file_name() {
+  const char *dir = getenv("LOOP_PROF_DIR");
+  if (dir == NULL)
+    return prefixed_file_name(ProfileInfoFileName);
+  struct proc_info {
+    std::string file_name;
+    int pid, ppid;
+    time_t mtime;
+  };
+  std::vector<proc_info> procs;
+  DIR *procs_dir = opendir(dir);
+  if (procs_dir == NULL)
+    return "";
+  while (struct dirent *entry = readdir(procs_dir)) {
+    if (entry->d_name[0] == '.')
+      continue;
+    proc_info proc = {std::string(dir) + "/" + entry->d_name + "/" +
+                          ProfileInfoFileName,
+                      0, 0, 0};
+    FILE *info_in = fopen(proc.file_name.c_str(), "r");
+    if (info_in == NULL)
       continue;
+    char line[256];
+    while (fgets(line, sizeof line, info_in))
+      if (sscanf(line, "pid=%d", &proc.pid) != 1)
+        sscanf(line, "ppid=%d", &proc.ppid);
+    fclose(info_in);
+    struct stat st;
+    if (stat(proc.file_name.c_str(), &st) == 0)
+      proc.mtime = st.st_mtime;
+    procs.push_back(proc);
+  }
+  closedir(procs_dir);
 
-    fwriteall(&global_idx, sizeof(uint32_t), dumpfile);
-    fwriteall(desc->_prof_loops_running_p + i, sizeof(uint32_t), dumpfile);
-    dumpsize += sizeof(uint32_t) * 2;
+  const proc_info *latest = NULL;
+  for (const proc_info &proc : procs) {
+    bool first = true;
+    for (const proc_info &parent : procs)
+      first &= parent.pid != proc.ppid;
+    if (first && (latest == NULL || proc.mtime >= latest->mtime))
+      latest = &proc;
   }
+  return latest ? latest->file_name : "";
 }
 
-// Sample what loops and functions are running and write sample data to a file
-static void dump_sample(int signo) {
-  uint32_t global_idx = 0;
-  for (module_desc *desc = module_desc_list_head; desc != NULL;
-       desc = desc->next) {
-    dump_one_sample(desc, global_idx);
-    global_idx += desc->_prof_num_loops;
-  }
+// Length (in ms of the sampled clock) of the previous run, as recorded in
+// its info file, or 0 if there is none
+static long long previous_run_ms() {
+  std::string file_name = previous_info_file_name();
+  FILE *info_in = file_name.empty() ? NULL : fopen(file_name.c_str(), "r");
+  if (info_in == NULL)
+    return 0;
+  char line[256];
+  long long ms = 0;
+  while (fgets(line, sizeof line, info_in))
+    if (sscanf(line, "time(ms)=%lld", &ms) == 1)
+      break;
+  fclose(info_in);
+  return ms;
+}
 
-  // write a token to signify end of the row
-  int end = END_OF_ROW;
-  fwriteall(&end, sizeof(uint32_t), dumpfile);
-  dumpsize += sizeof(uint32_t);
+// Pick the sampling period that yields about `target` samples over the run,
+// whose length is given by LOOP_PROF_EXPECTED_SECONDS or else taken from the
+// previous run.  The period stays fixed for the whole run so that every
+// sample stands for the same amount of time.
+static void adapt_sampling_period(long target) {
+  const char *expected = getenv("LOOP_PROF_EXPECTED_SECONDS");
+  double expected_ns = expected ? atof(expected) * 1e9
+                                : previous_run_ms() * 1e6;
+  if (target <= 0 || expected_ns <= 0)
+    return;
 
-  num_sampled++;
-  setup_timer();
+  long period = expected_ns / target;
+  if (period < MIN_SAMPLING_PERIOD)
+    period = MIN_SAMPLING_PERIOD;
+  if (period > MAX_SAMPLING_PERIOD)
+    period = MAX_SAMPLING_PERIOD;
+  sampling_period_ns = period;
 }
 
-void _prof_init() {
-  dumpfile = fopen(ProfileDumpFileName, "w+");
+// Read the sampling configuration from the environment:
+//   LOOP_PROF_FREQ     samples per second of CPU time (default 10000)
+//   LOOP_PROF_TARGET_SAMPLES  number of samples to aim for instead, see
+//                             `adapt_sampling_period`
+//   LOOP_PROF_BACKEND  itimer, perf-cpu-clock (default), perf-task-clock or
+//                      wall
+//
+// The perf backends only ever sample the thread that starts them, so
+// without -thread-local they are used only when asked for explicitly.
+static void init_sampling() {
+  static bool initialized = false;
+  if (initialized)
+    return;
+  initialized = true;
 
   srand(time(NULL));
-  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &begin);
-  setup_timer();
-}
+  init_exp_table();
 
-void _prof_dump() {
-  // disarm timer
-  struct itimerval timerspec;
-  memset(&timerspec, 0, sizeof timerspec);
-  setitimer(SIGPROF, &timerspec, NULL);
-  signal(SIGPROF, SIG_IGN);
+  const char *freq = getenv("LOOP_PROF_FREQ");
+  const char *target = getenv("LOOP_PROF_TARGET_SAMPLES");
+  if (freq && atof(freq) > 0)
+    sampling_period_ns = 1e9 / atof(freq);
+  else if (target)
+    adapt_sampling_period(atol(target));
 
-  // Time the process in ms. For accuracy, do this before postprocessing.
-  struct timespec end;
-  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
-  long long int elapsed =
-      (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
-
-  // read sample from the dump
-  fflush(dumpfile);
-  rewind(dumpfile);
-  int32_t *dump = (int32_t *)mmap(NULL, dumpsize, PROT_READ, MAP_PRIVATE,
-                                  fileno(dumpfile), 0);
-  assert(dump && "failed to mmap dumpfile");
-  fclose(dumpfile);
-  collect_samples(dump);
-  
-#ifndef NDEBUG
-  printf("finished collecting samples\n");
+  const char *name = getenv("LOOP_PROF_BACKEND");
+  backend_requested = name != NULL;
+#ifdef __linux__
+  if (name == NULL || !strcmp(name, perf_cpu_clock_backend.name)) {
+    backend = &perf_cpu_clock_backend;
+  } else if (!strcmp(name, perf_task_clock_backend.name)) {
+    backend = &perf_task_clock_backend;
+    perf_clock = PERF_COUNT_SW_TASK_CLOCK;
+  } else if (!strcmp(name, wall_backend.name)) {
+    backend = &wall_backend;
+    wall_mode = true;
+  }
 #endif
+  if (name && strcmp(name, backend->name))
+    fprintf(stderr, "loop profiler: unknown sampling backend %s, using %s\n",
+            name, backend->name);
 
-  FILE *flat_out = fopen(MetadataFileName, "wb");
+  install_handler();
+}
 
-  fprintf(flat_out, "module,function,header-id,runs,time(pct),time(ms)\n");
-  uint32_t loop_idx = 0;
-  for (module_desc *desc = module_desc_list_head; desc != NULL;
-       desc = desc->next) {
-    struct loop_data *prof_loops = desc->_prof_loops_p;
-    for (uint32_t i = 0; i < desc->_prof_num_loops; i++) {
-      struct loop_data *loop = &prof_loops[i];
-      float pct = (float)profile.getFreq(loop_idx, loop_idx) / num_sampled;
-      assert(pct <= 1.0);
-      fprintf(flat_out, "%s,%s,%d,%ld,%.4f,%.4f\n",
-	      desc->_moduleName, loop->func, loop->header_id,
-              loop->runs, 100 * pct, elapsed * pct);
-      ++loop_idx;
+// begin sampling a thread (or the process), falling back to the itimer
+// backend if the preferred one is unavailable
+static void start_sampling(thread_state *ts) {
+  const sampling_backend *b = backend;
+  if (ts == &process_state && !backend_requested)
+    b = &itimer_backend;
+
+  if (!b->start(ts)) {
+    if (b != &itimer_backend && backend_requested)
+      fprintf(stderr, "loop profiler: %s is unavailable, using itimer\n",
+              b->name);
+    backend = b = &itimer_backend;
+    if (!b->start(ts)) {
+      perror("Unable to start sampling");
+      exit(1);
     }
   }
+  ts->backend = active_backend = b;
+  ts->last_cpu_ns = now_ns(cpu_clock_of(ts));
+  ts->last_wall_ns = now_ns(CLOCK_MONOTONIC);
+}
 
-  profile.dump(ProfileFileName);
+static void stop_sampling(thread_state *ts) {
+  const sampling_backend *b = ts->backend;
+  if (b == NULL)
+    return;
+  ts->backend = NULL;
+  b->stop(ts);
+}
+
+// Count cycles, instructions, last-level cache misses and branch misses of
+// the calling thread in one group, so that they are always scheduled
+// together and their ratios stay exact even when the PMU is multiplexed.
+// If the PMU (or any of the events) isn't available, e.g. in most VMs, the
+// thread is left without counters and only time is profiled.
+static bool counters_disabled = false;
+
+static void open_counters(thread_state *ts) {
+  ts->counter_fds[0] = -1;
+  if (counters_disabled)
+    return;
+#ifdef __linux__
+  static const uint64_t events[NUM_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  int *fds = ts->counter_fds;
+  for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = events[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = i == 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    int group_fd = i == 0 ? -1 : fds[0];
+    fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    if (fds[i] < 0) {
+      while (i-- > 0)
+        close(fds[i]);
+      fds[0] = -1;
+      // don't try again for every thread
+      counters_disabled = true;
+      return;
+    }
+  }
+  memset(ts->last_counts, 0, sizeof ts->last_counts);
+  ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+// Get the events counted since the previous call.  Async-signal-safe.
+static void read_counters(thread_state *ts, uint64_t *deltas) {
+  // PERF_FORMAT_GROUP: the number of events followed by their values
+  uint64_t values[1 + NUM_COUNTERS];
+  if (read(ts->counter_fds[0], values, sizeof values) != sizeof values) {
+    memset(deltas, 0, NUM_COUNTERS * sizeof(uint64_t));
+    return;
+  }
+  for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+    deltas[i] = values[1 + i] - ts->last_counts[i];
+    ts->last_counts[i] = values[1 + i];
+  }
+}
+
+#ifdef __linux__
+static void retire_thread(thread_state *ts);
+
+static void unregister_thread(void *arg) {
+  thread_state *ts = (thread_state *)arg;
+  if (ts == NULL)
+    return;
+  stop_sampling(ts);
+  collect_thread_counts(ts);
+  retire_thread(ts);
+}
+
+// Give the calling thread its own sample stream and sample it on its own
+// CPU clock, with the signal delivered to this thread only
+static void register_thread() {
+  thread_state *ts = new thread_state();
+  init_ring(&ts->ring);
+  ts->tid = syscall(SYS_gettid);
+  ts->rng = (time(NULL) ^ ts->tid) | 1;
+
+  pthread_mutex_lock(&thread_list_lock);
+  ts->id = num_threads++;
+  ts->next = thread_list_head;
+  thread_list_head = ts;
+  pthread_mutex_unlock(&thread_list_lock);
+
+  self_thread = ts;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    record_thread_blocks(desc);
+  open_counters(ts);
+  start_sampling(ts);
+}
+
+struct thread_start {
+  void *(*start_routine)(void *);
+  void *arg;
+};
+
+static void *thread_trampoline(void *arg) {
+  thread_start start = *(thread_start *)arg;
+  delete (thread_start *)arg;
+  if (!sampling_stopped)
+    register_thread();
+  void *ret;
+  // release the timer when the thread exits, even through `pthread_exit`
+  pthread_cleanup_push(unregister_thread, self_thread);
+  ret = start.start_routine(start.arg);
+  pthread_cleanup_pop(1);
+  return ret;
+}
+
+typedef int (*pthread_create_fn)(pthread_t *, const pthread_attr_t *,
+                                 void *(*)(void *), void *);
+
+static pthread_create_fn get_real_pthread_create() {
+  static pthread_create_fn real_create =
+      (pthread_create_fn)dlsym(RTLD_NEXT, "pthread_create");
+  return real_create;
+}
+
+// Intercept thread creation so that every thread is sampled on its own
+extern "C" int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                              void *(*start_routine)(void *), void *arg) {
+  pthread_create_fn real_create = get_real_pthread_create();
+  if (!thread_mode)
+    other_threads_started = true;
+  if (!thread_mode || sampling_stopped)
+    return real_create(thread, attr, start_routine, arg);
+
+  thread_start *start = new thread_start();
+  start->start_routine = start_routine;
+  start->arg = arg;
+  int err = real_create(thread, attr, thread_trampoline, start);
+  if (err != 0)
+    delete start;
+  return err;
+}
+#endif
+
+static void init_ring(sample_ring *ring) {
+  ring->buf = (uint32_t *)mmap(NULL, RING_WORDS * sizeof(uint32_t),
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+  if (ring->buf == MAP_FAILED) {
+    perror("Unable to allocate sample buffer");
+    exit(1);
+  }
+  ring->head = ring->tail = 0;
+  ring->dropped = 0;
+}
+
+// Open-addressing table mapping an edge (src, dst) of the "call graph" to
+// the number of samples in which src was running with dst nested in it.
+// Self time of loop i is kept as edge (i, i).  Only the drain thread (or
+// `_prof_dump`, once the drain thread is gone) touches it.
+struct edge_entry {
+  uint32_t src, dst;
+  uint64_t count; // 0 for an empty slot
+};
+
+static edge_entry *edge_table = NULL;
+static size_t edge_table_size = 0; // always a power of two
+static size_t num_edges = 0;
+
+static inline size_t hash_edge(uint32_t src, uint32_t dst) {
+  uint64_t key = ((uint64_t)src << 32) | dst;
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (size_t)key;
+}
+
+static void init_edge_table(size_t size) {
+  edge_table = (edge_entry *)calloc(size, sizeof(edge_entry));
+  if (edge_table == NULL) {
+    perror("Unable to allocate edge table");
+    exit(1);
+  }
+  edge_table_size = size;
+  num_edges = 0;
+}
+
+static edge_entry *lookup_edge(uint32_t src, uint32_t dst);
+
+// double the table once it is half full
+static void grow_edge_table() {
+  edge_entry *old_table = edge_table;
+  size_t old_size = edge_table_size;
+  init_edge_table(old_size * 2);
+  for (size_t i = 0; i < old_size; i++) {
+    if (old_table[i].count == 0)
+      continue;
+    edge_entry *e = lookup_edge(old_table[i].src, old_table[i].dst);
+    e->count = old_table[i].count;
+  }
+  free(old_table);
+}
+
+// find the slot of an edge, claiming an empty one if it isn't there yet
+static edge_entry *lookup_edge(uint32_t src, uint32_t dst) {
+  size_t mask = edge_table_size - 1;
+  for (size_t i = hash_edge(src, dst) & mask;; i = (i + 1) & mask) {
+    edge_entry *e = &edge_table[i];
+    if (e->count == 0) {
+      if (2 * (num_edges + 1) > edge_table_size) {
+        grow_edge_table();
+        return lookup_edge(src, dst);
+      }
+      e->src = src;
+      e->dst = dst;
+      num_edges++;
+      return e;
+    }
+    if (e->src == src && e->dst == dst)
+      return e;
+  }
+}
+
+// `running` lists which loops were running at the time of one sample, in
+// increasing order of their global index, together with their value in
+// `_prof_loops_running`.  Use those to accumulate the edges of the profile:
+// (i, i) is the self time of loop i, and (i, j) the time loop i spent
+// running loop j.
+//
+static void collect_sample_impl(const uint32_t *running, unsigned n,
+                                uint64_t *self) {
+  for (unsigned i = 0; i != n; i++) {
+    uint32_t loopi = running[2 * i], vali = running[2 * i + 1];
+    lookup_edge(loopi, loopi)->count += 1;
+    self[loopi] += 1;
+
+    for (unsigned j = i + 1; j != n; j++) {
+      uint32_t loopj = running[2 * j], valj = running[2 * j + 1];
+      assert(loopi < loopj);
+
+      if (vali < valj) {
+        // i called j
+        lookup_edge(loopi, loopj)->count += 1;
+      } else {
+        // j called i
+        lookup_edge(loopj, loopi)->count += 1;
+      }
+    }
+  }
+}
+
+// Calling context tree: every distinct stack of running loops and functions
+// (outermost first) seen in a sample is a node, its parent being the same
+// stack without the innermost entry.  Node 0 is the root (nothing running).
+// Children are found through an open-addressing table keyed by (parent,
+// loop).  Like the edge table, this belongs to the drain thread.
+struct cct_node {
+  uint32_t parent, loop;
+  uint64_t inclusive; // samples taken in this context or one nested in it
+  uint64_t exclusive; // samples taken in exactly this context
+};
+
+static cct_node *cct_nodes = NULL;
+static size_t cct_capacity = 0;
+static size_t num_cct_nodes = 0;
+static uint32_t *cct_slots = NULL; // node index, 0 for an empty slot
+static size_t cct_table_size = 0; // always a power of two
+
+static void init_cct(size_t capacity) {
+  cct_nodes = (cct_node *)calloc(capacity, sizeof(cct_node));
+  cct_slots = (uint32_t *)calloc(2 * capacity, sizeof(uint32_t));
+  if (cct_nodes == NULL || cct_slots == NULL) {
+    perror("Unable to allocate calling context tree");
+    exit(1);
+  }
+  cct_capacity = capacity;
+  cct_table_size = 2 * capacity;
+  cct_nodes[0].parent = cct_nodes[0].loop = (uint32_t)-1;
+  num_cct_nodes = 1;
+}
+
+static void insert_cct_slot(uint32_t node) {
+  size_t mask = cct_table_size - 1;
+  size_t i = hash_edge(cct_nodes[node].parent, cct_nodes[node].loop) & mask;
+  while (cct_slots[i])
+    i = (i + 1) & mask;
+  cct_slots[i] = node;
+}
+
+// double the capacity, which keeps the table at most half full
+static void grow_cct() {
+  cct_capacity *= 2;
+  cct_nodes = (cct_node *)realloc(cct_nodes, cct_capacity * sizeof(cct_node));
+  free(cct_slots);
+  cct_table_size = 2 * cct_capacity;
+  cct_slots = (uint32_t *)calloc(cct_table_size, sizeof(uint32_t));
+  if (cct_nodes == NULL || cct_slots == NULL) {
+    perror("Unable to allocate calling context tree");
+    exit(1);
+  }
+  for (uint32_t node = 1; node < num_cct_nodes; node++)
+    insert_cct_slot(node);
+}
+
+// find the child of `parent` running `loop`, creating it if needed
+static uint32_t get_cct_child(uint32_t parent, uint32_t loop) {
+  size_t mask = cct_table_size - 1;
+  for (size_t i = hash_edge(parent, loop) & mask;; i = (i + 1) & mask) {
+    uint32_t node = cct_slots[i];
+    if (node == 0)
+      break;
+    if (cct_nodes[node].parent == parent && cct_nodes[node].loop == loop)
+      return node;
+  }
+
+  if (num_cct_nodes == cct_capacity)
+    grow_cct();
+  uint32_t node = num_cct_nodes++;
+  cct_nodes[node].parent = parent;
+  cct_nodes[node].loop = loop;
+  cct_nodes[node].inclusive = cct_nodes[node].exclusive = 0;
+  insert_cct_slot(node);
+  return node;
+}
+
+// Add one sample to the calling context tree.  `running` is laid out as
+// for `collect_sample_impl`; a loop's value in `_prof_loops_running` grows
+// with its nesting depth, so ordering by value recovers the stack.
+static void collect_context(uint32_t *running, unsigned n) {
+  // insertion sort of (index, value) pairs by value, samples are shallow
+  for (unsigned i = 1; i < n; i++) {
+    uint32_t loop = running[2 * i], val = running[2 * i + 1];
+    unsigned j = i;
+    for (; j > 0 && running[2 * (j - 1) + 1] > val; j--) {
+      running[2 * j] = running[2 * (j - 1)];
+      running[2 * j + 1] = running[2 * (j - 1) + 1];
+    }
+    running[2 * j] = loop;
+    running[2 * j + 1] = val;
+  }
+
+  uint32_t node = 0;
+  cct_nodes[0].inclusive++;
+  for (unsigned i = 0; i < n; i++) {
+    node = get_cct_child(node, running[2 * i]);
+    cct_nodes[node].inclusive++;
+  }
+  cct_nodes[node].exclusive++;
+}
+
+// make room for the per-loop counters of a thread
+static void grow_self(thread_state *ts) {
+  if (ts->self_size >= _prof_num_loops_tot)
+    return;
+  ts->self = (uint64_t *)realloc(ts->self,
+                                 _prof_num_loops_tot * sizeof(uint64_t));
+  memset(ts->self + ts->self_size, 0,
+         (_prof_num_loops_tot - ts->self_size) * sizeof(uint64_t));
+  if (ts->counter_fds[0] >= 0) {
+    ts->counts = (uint64_t *)realloc(
+        ts->counts, _prof_num_loops_tot * NUM_COUNTERS * sizeof(uint64_t));
+    memset(ts->counts + ts->self_size * NUM_COUNTERS, 0,
+           (_prof_num_loops_tot - ts->self_size) * NUM_COUNTERS *
+               sizeof(uint64_t));
+  }
+  if (wall_mode) {
+    ts->cpu_times = (uint64_t *)realloc(
+        ts->cpu_times, _prof_num_loops_tot * 2 * sizeof(uint64_t));
+    memset(ts->cpu_times + ts->self_size * 2, 0,
+           (_prof_num_loops_tot - ts->self_size) * 2 * sizeof(uint64_t));
+  }
+  ts->self_size = _prof_num_loops_tot;
+}
+
+// Fold every complete record of a ring into the edge table and release the
+// space to the signal handler.  A record starts with the counter deltas
+// (two words each) if the thread has counters, then the on- and off-CPU
+// time since the previous sample (two words each) in wall-clock mode.
+static void drain_ring(thread_state *ts) {
+  sample_ring *ring = &ts->ring;
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = ring->tail;
+  if (head == tail)
+    return;
+
+  grow_self(ts);
+
+  // a record is at most one (index, value) pair per loop
+  std::vector<uint32_t> row;
+  uint64_t deltas[NUM_COUNTERS], on_cpu = 0, off_cpu = 0;
+  while (tail != head) {
+    if (ts->counter_fds[0] >= 0) {
+      for (unsigned i = 0; i < NUM_COUNTERS; i++) {
+        uint64_t lo = ring->buf[tail++ & (RING_WORDS - 1)];
+        uint64_t hi = ring->buf[tail++ & (RING_WORDS - 1)];
+        deltas[i] = hi << 32 | lo;
+      }
+    }
+    if (wall_mode) {
+      on_cpu = ring->buf[tail++ & (RING_WORDS - 1)];
+      on_cpu |= (uint64_t)ring->buf[tail++ & (RING_WORDS - 1)] << 32;
+      off_cpu = ring->buf[tail++ & (RING_WORDS - 1)];
+      off_cpu |= (uint64_t)ring->buf[tail++ & (RING_WORDS - 1)] << 32;
+    }
+
+    row.resize(0);
+    for (;;) {
+      uint32_t col = ring->buf[tail++ & (RING_WORDS - 1)];
+      if (col == (uint32_t)END_OF_ROW)
+        break;
+      row.push_back(col);
+      row.push_back(ring->buf[tail++ & (RING_WORDS - 1)]);
+    }
+    collect_sample_impl(row.data(), row.size() / 2, ts->self);
+    collect_context(row.data(), row.size() / 2);
+
+    // the events since the previous sample go to every loop running now
+    if (ts->counter_fds[0] >= 0)
+      for (size_t i = 0; i < row.size(); i += 2)
+        for (unsigned k = 0; k < NUM_COUNTERS; k++)
+          ts->counts[row[i] * NUM_COUNTERS + k] += deltas[k];
+    if (wall_mode)
+      for (size_t i = 0; i < row.size(); i += 2) {
+        ts->cpu_times[row[i] * 2] += on_cpu;
+        ts->cpu_times[row[i] * 2 + 1] += off_cpu;
+      }
+  }
+  __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void drain_rings() {
+  if (!thread_mode) {
+    if (process_state.ring.buf)
+      drain_ring(&process_state);
+    return;
+  }
+
+  pthread_mutex_lock(&thread_list_lock);
+  thread_state *head = thread_list_head;
+  pthread_mutex_unlock(&thread_list_lock);
+  // nodes are only pushed to the front, and only leave the list under
+  // `drain_lock`, which the caller holds, so this is safe to walk
+  for (thread_state *ts = head; ts != NULL; ts = ts->next)
+    drain_ring(ts);
+}
+
+// Snapshots of the profile so far are written by the drain thread, when
+// asked to by a signal or periodically:
+//   LOOP_PROF_SNAPSHOT_SIGNAL    signal number (default SIGUSR2, 0 for none)
+//   LOOP_PROF_SNAPSHOT_INTERVAL  seconds between snapshots (default never)
+// Snapshot N goes to the usual output files suffixed with `.N`.  Like the
+// final profile, it covers everything since the start of the process; its
+// info file gives the window of wall-clock time (in ms since the start) it
+// added over snapshot N-1, so that consecutive snapshots can be diffed.
+static volatile sig_atomic_t snapshot_requested = 0;
+static unsigned num_snapshots = 0;
+static long long snapshot_interval_ms = 0;
+static struct timespec wall_begin;
+static long long window_begin = 0;
+
+static long long wall_time_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - wall_begin.tv_sec) * 1e3 +
+         (now.tv_nsec - wall_begin.tv_nsec) / 1e6;
+}
+
+static void request_snapshot(int /*signo*/) {
+  snapshot_requested = 1;
+}
+
+static void init_snapshots() {
+  clock_gettime(CLOCK_MONOTONIC, &wall_begin);
+
+  const char *interval = getenv("LOOP_PROF_SNAPSHOT_INTERVAL");
+  if (interval)
+    snapshot_interval_ms = atof(interval) * 1e3;
+
+  const char *sig = getenv("LOOP_PROF_SNAPSHOT_SIGNAL");
+  int signo = sig ? atoi(sig) : SIGUSR2;
+  if (signo <= 0)
+    return;
+
+  // leave the signal alone if the program handles it already
+  struct sigaction sa;
+  if (sigaction(signo, NULL, &sa) != 0 || sa.sa_handler != SIG_DFL)
+    return;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = request_snapshot;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(signo, &sa, NULL);
+}
+
+static void take_snapshot();
+
+static volatile bool drain_stopped = false;
+static bool has_drain_thread = false;
+static pthread_t drain_thread;
+// held by the drain thread while it works on the tables, so that a fork
+// doesn't catch them half-updated
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *drain_loop(void *) {
+  struct timespec interval;
+  interval.tv_sec = 0;
+  interval.tv_nsec = DRAIN_INTERVAL_MS * 1000000L;
+  long long next_snapshot = snapshot_interval_ms;
+  while (!drain_stopped) {
+    nanosleep(&interval, NULL);
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    drain_mem_buffers();
+
+    if (snapshot_interval_ms && wall_time_ms() >= next_snapshot) {
+      snapshot_requested = 1;
+      next_snapshot = wall_time_ms() + snapshot_interval_ms;
+    }
+    if (snapshot_requested) {
+      snapshot_requested = 0;
+      take_snapshot();
+    }
+    pthread_mutex_unlock(&drain_lock);
+  }
+  return NULL;
+}
+
+static void start_drain_thread() {
+  if (has_drain_thread)
+    return;
+
+  // the drain thread itself shouldn't be sampled
+  sigset_t prof_set, old_set;
+  sigemptyset(&prof_set);
+  sigaddset(&prof_set, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &prof_set, &old_set);
+#ifdef __linux__
+  int err = get_real_pthread_create()(&drain_thread, NULL, drain_loop, NULL);
+#else
+  int err = pthread_create(&drain_thread, NULL, drain_loop, NULL);
+#endif
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+  if (err != 0) {
+    fprintf(stderr, "Unable to start drain thread\n");
+    exit(1);
+  }
+  has_drain_thread = true;
+}
+
+static void stop_drain_thread() {
+  if (!has_drain_thread)
+    return;
+  drain_stopped = true;
+  pthread_join(drain_thread, NULL);
+  has_drain_thread = false;
+}
+
+// Sample what loops and functions are running and append them to the ring
+// without publishing them.  Return false if the ring is out of space.
+static bool dump_one_sample(sample_ring *ring, uint64_t &head, uint64_t limit,
+                            module_desc *desc, uint32_t global_idx) {
+  uint32_t *running = desc->_get_running ? (uint32_t *)desc->_get_running()
+                                         : desc->_prof_loops_running_p;
+
+  // Write the sample data for each module
+  uint32_t i;
+  for (i = 0; i < desc->_prof_num_loops; i++, global_idx++) {
+    if (running[i] == 0)
+      continue;
+
+    if (head + 2 > limit)
+      return false;
+    ring->buf[head++ & (RING_WORDS - 1)] = global_idx;
+    ring->buf[head++ & (RING_WORDS - 1)] = running[i];
+  }
+  return true;
+}
+
+// Sample what loops and functions are running and record them in the ring.
+// This runs in a signal handler: it does no I/O and no allocation, and
+// costs O(number of profiled loops).
+static void dump_sample(int signo) {
+  thread_state *ts = thread_mode ? self_thread : &process_state;
+  if (ts == NULL || sampling_stopped)
+    return;
+
+  sample_ring *ring = &ts->ring;
+  uint64_t head = ring->head;
+  // one word is reserved for the end-of-row token
+  uint64_t limit =
+      __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + RING_WORDS - 1;
+
+  bool fits = true;
+  if (ts->counter_fds[0] >= 0) {
+    uint64_t deltas[NUM_COUNTERS];
+    read_counters(ts, deltas);
+    fits = head + 2 * NUM_COUNTERS <= limit;
+    for (unsigned i = 0; fits && i < NUM_COUNTERS; i++) {
+      ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)deltas[i];
+      ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)(deltas[i] >> 32);
+    }
+  }
+  if (wall_mode) {
+    // whatever part of the wall time since the previous sample the thread
+    // didn't spend running, it spent blocked or waiting for a CPU
+    uint64_t cpu = now_ns(cpu_clock_of(ts)), wall = now_ns(CLOCK_MONOTONIC);
+    uint64_t wall_delta = wall - ts->last_wall_ns;
+    uint64_t on_cpu = cpu - ts->last_cpu_ns;
+    if (on_cpu > wall_delta)
+      on_cpu = wall_delta;
+    uint64_t off_cpu = wall_delta - on_cpu;
+    ts->last_cpu_ns = cpu;
+    ts->last_wall_ns = wall;
+
+    fits = fits && head + 4 <= limit;
+    if (fits) {
+      ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)on_cpu;
+      ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)(on_cpu >> 32);
+      ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)off_cpu;
+      ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)(off_cpu >> 32);
+    }
+  }
+
+  uint32_t global_idx = 0;
+  for (module_desc *desc = module_desc_list_head; desc != NULL && fits;
+       desc = desc->next) {
+    fits = dump_one_sample(ring, head, limit, desc, global_idx);
+    global_idx += desc->_prof_num_loops;
+  }
+
+  if (!fits) {
+    // the drain thread is behind, drop this sample rather than block
+    ring->dropped++;
+  } else {
+    // write a token to signify end of the row, then publish the record
+    ring->buf[head++ & (RING_WORDS - 1)] = (uint32_t)END_OF_ROW;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    ts->num_sampled++;
+  }
+
+  const sampling_backend *b = ts->backend;
+  if (b)
+    b->rearm(ts);
+}
+
+// fold what is left in a thread's ring and release it
+static void collect_thread_samples(thread_state *ts) {
+  sample_ring *ring = &ts->ring;
+  drain_ring(ts);
+  grow_self(ts);
+
+  if (ring->dropped)
+    fprintf(stderr, "loop profiler: dropped %llu samples\n",
+            (unsigned long long)ring->dropped);
+  munmap(ring->buf, RING_WORDS * sizeof(uint32_t));
+  if (ts->counter_fds[0] >= 0)
+    for (unsigned i = 0; i < NUM_COUNTERS; i++)
+      close(ts->counter_fds[i]);
+}
+
+// Add the samples of a thread whose ring was collected to those of the
+// threads that exited
+static void add_exited_samples(const thread_state *ts) {
+  exited_samples *sum = &exited_threads;
+  uint32_t n = ts->self_size;
+  if (sum->size < n) {
+    sum->self = (uint64_t *)realloc(sum->self, n * sizeof(uint64_t));
+    sum->counts = (uint64_t *)realloc(sum->counts,
+                                      n * NUM_COUNTERS * sizeof(uint64_t));
+    sum->cpu_times =
+        (uint64_t *)realloc(sum->cpu_times, n * 2 * sizeof(uint64_t));
+    memset(sum->self + sum->size, 0, (n - sum->size) * sizeof(uint64_t));
+    memset(sum->counts + sum->size * NUM_COUNTERS, 0,
+           (n - sum->size) * NUM_COUNTERS * sizeof(uint64_t));
+    memset(sum->cpu_times + sum->size * 2, 0,
+           (n - sum->size) * 2 * sizeof(uint64_t));
+    sum->size = n;
+  }
+  sum->num_threads++;
+  sum->num_sampled += ts->num_sampled;
+  for (uint32_t i = 0; i < n; i++)
+    sum->self[i] += ts->self[i];
+  if (ts->counter_fds[0] >= 0) {
+    sum->has_counters = true;
+    for (uint32_t i = 0; i < n * NUM_COUNTERS; i++)
+      sum->counts[i] += ts->counts[i];
+  }
+  if (wall_mode)
+    for (uint32_t i = 0; i < n * 2; i++)
+      sum->cpu_times[i] += ts->cpu_times[i];
+}
+
+#ifdef __linux__
+// Hand in the samples of an exiting thread and let go of its state, so that
+// programs that keep starting threads don't keep a ring for every thread
+// that ever ran.  Once `_prof_dump` started, it takes care of the threads
+// still in the list.
+static void retire_thread(thread_state *ts) {
+  pthread_mutex_lock(&drain_lock);
+  if (sampling_stopped) {
+    pthread_mutex_unlock(&drain_lock);
+    return;
+  }
+  // a SIGPROF still pending finds no state to record in
+  self_thread = NULL;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  collect_thread_samples(ts);
+  add_exited_samples(ts);
+
+  pthread_mutex_lock(&thread_list_lock);
+  thread_state **link = &thread_list_head;
+  while (*link != ts)
+    link = &(*link)->next;
+  *link = ts->next;
+  pthread_mutex_unlock(&thread_list_lock);
+  pthread_mutex_unlock(&drain_lock);
+
+  free(ts->self);
+  free(ts->counts);
+  free(ts->cpu_times);
+  delete ts;
+}
+#endif
+
+// Forked children profile themselves from scratch: they start with empty
+// tables and sample streams, sample on clocks of their own (the parent's
+// perf events and timers keep running for the parent only) and write their
+// profile to a directory of their own, see `process_dir`.
+static bool forked_child = false;
+
+static void before_fork() {
+  pthread_mutex_lock(&drain_lock);
+  pthread_mutex_lock(&thread_list_lock);
+  pthread_mutex_lock(&mem_lock);
+}
+
+static void after_fork_in_parent() {
+  pthread_mutex_unlock(&mem_lock);
+  pthread_mutex_unlock(&thread_list_lock);
+  pthread_mutex_unlock(&drain_lock);
+}
+
+// Let go of the parent's sampling clock and counters of a thread, which
+// aren't ours to stop
+static void release_inherited(thread_state *ts) {
+#ifdef __linux__
+  if (ts->backend && ts->backend->rearm == perf_rearm)
+    close(ts->perf_fd);
+#endif
+  ts->backend = NULL;
+  if (ts->counter_fds[0] >= 0)
+    for (unsigned i = 0; i < NUM_COUNTERS; i++)
+      close(ts->counter_fds[i]);
+  ts->counter_fds[0] = -1;
+}
+
+// Forget the samples of the thread that forked and sample it anew
+static void restart_thread_state(thread_state *ts) {
+  release_inherited(ts);
+  ts->ring.head = ts->ring.tail = ts->ring.dropped = 0;
+  ts->num_sampled = 0;
+  if (ts->self)
+    memset(ts->self, 0, ts->self_size * sizeof(uint64_t));
+  if (ts->counts)
+    memset(ts->counts, 0, ts->self_size * NUM_COUNTERS * sizeof(uint64_t));
+  if (ts->cpu_times)
+    memset(ts->cpu_times, 0, ts->self_size * 2 * sizeof(uint64_t));
+  open_counters(ts);
+  start_sampling(ts);
+}
+
+static void after_fork_in_child() {
+  forked_child = true;
+  // only the thread that forked lives on
+  other_threads_started = false;
+  pthread_mutex_init(&drain_lock, NULL);
+  pthread_mutex_init(&thread_list_lock, NULL);
+  pthread_mutex_init(&mem_lock, NULL);
+  has_drain_thread = false;
+  if (sampling_stopped)
+    return;
+
+  memset(edge_table, 0, edge_table_size * sizeof(edge_entry));
+  num_edges = 0;
+  memset(cct_slots, 0, cct_table_size * sizeof(uint32_t));
+  cct_nodes[0].inclusive = cct_nodes[0].exclusive = 0;
+  num_cct_nodes = 1;
+  // the lines accessed keep their last access, for the reuse distances
+  if (mem_loop_lines != NULL)
+    memset(mem_loop_lines, 0, mem_loop_lines_size * sizeof(loop_line));
+  mem_num_loop_lines = 0;
+  // the accesses buffered so far are the parent's, and only the buffer of
+  // the thread that forked lives on
+  mem_buffer *mb = mem_buffer_list_head;
+  while (mb != NULL) {
+    mem_buffer *next = mb->next;
+    if (mb != self_mem_buffer)
+      free(mb);
+    mb = next;
+  }
+  mem_buffer_list_head = self_mem_buffer;
+  if (self_mem_buffer != NULL) {
+    self_mem_buffer->next = NULL;
+    self_mem_buffer->tail = self_mem_buffer->head;
+  }
+
+  // run counts and timings so far are the parent's; the loops that are
+  // running stay so
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next) {
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++)
+      desc->_prof_loops_p[i].runs = 0;
+    if (desc->_get_cfg_edge_counts != NULL) {
+      memset(desc->_cfg_edge_totals, 0,
+             desc->_num_cfg_edges * sizeof(int64_t));
+      memset(desc->_get_cfg_edge_counts(), 0,
+             desc->_num_cfg_edges * sizeof(int64_t));
+    }
+    if (desc->_get_value_counts != NULL) {
+      memset(desc->_value_totals, 0,
+             desc->_num_loop_values * sizeof(struct value_counts));
+      memset(desc->_get_value_counts(), 0,
+             desc->_num_loop_values * sizeof(struct value_counts));
+    }
+    for (uint32_t i = 0; i < desc->_num_mem_profiles; i++) {
+      struct mem_profile *profile = &desc->_mem_profiles[i];
+      profile->samples = profile->cold = profile->lines = 0;
+      memset(profile->reuse, 0, sizeof profile->reuse);
+    }
+    if (desc->_get_runs != NULL)
+      memset(desc->_get_runs(), 0, desc->_prof_num_loops * sizeof(int64_t));
+    if (desc->_get_histograms != NULL) {
+      memset(desc->_histogram_totals, 0,
+             desc->_num_histograms * NUM_HIST_KINDS * HIST_BUCKETS *
+                 sizeof(uint64_t));
+      struct loop_histogram *hists = desc->_get_histograms();
+      for (uint32_t i = 0; i < desc->_num_histograms; i++)
+        memset(hists[i].buckets, 0, sizeof hists[i].buckets);
+    }
+    if (desc->_get_timing == NULL)
+      continue;
+    memset(desc->_timing_totals, 0,
+           desc->_prof_num_loops * 3 * sizeof(uint64_t));
+    struct loop_timing *timings = desc->_get_timing();
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++)
+      timings[i].cycles = timings[i].calls = timings[i].probes = 0;
+  }
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &begin);
+  clock_gettime(CLOCK_MONOTONIC, &wall_begin);
+  window_begin = 0;
+  num_snapshots = 0;
+  snapshot_requested = 0;
+
+  exited_threads.num_threads = 0;
+  exited_threads.num_sampled = 0;
+  exited_threads.has_counters = false;
+  if (exited_threads.size) {
+    memset(exited_threads.self, 0, exited_threads.size * sizeof(uint64_t));
+    memset(exited_threads.counts, 0,
+           exited_threads.size * NUM_COUNTERS * sizeof(uint64_t));
+    memset(exited_threads.cpu_times, 0,
+           exited_threads.size * 2 * sizeof(uint64_t));
+  }
+
+  if (thread_mode) {
+    // only the thread that forked lives on in the child
+    thread_state *ts = thread_list_head;
+    while (ts != NULL) {
+      thread_state *next = ts->next;
+      if (ts != self_thread) {
+        release_inherited(ts);
+        munmap(ts->ring.buf, RING_WORDS * sizeof(uint32_t));
+        free(ts->self);
+        free(ts->counts);
+        free(ts->cpu_times);
+        while (ts->blocks != NULL) {
+          thread_blocks *blocks = ts->blocks;
+          ts->blocks = blocks->next;
+          delete blocks;
+        }
+        delete ts;
+      }
+      ts = next;
+    }
+    thread_list_head = self_thread;
+    num_threads = 1;
+    if (self_thread) {
+      self_thread->next = NULL;
+      self_thread->id = 0;
+#ifdef __linux__
+      self_thread->tid = syscall(SYS_gettid);
+#endif
+      restart_thread_state(self_thread);
+    } else {
+      thread_list_head = NULL;
+      num_threads = 0;
+      register_thread();
+    }
+  } else {
+    restart_thread_state(&process_state);
+  }
+  start_drain_thread();
+}
+
+void _prof_init() {
+  init_sampling();
+  init_edge_table(EDGE_TABLE_SIZE);
+  init_cct(CCT_SIZE);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &begin);
+  init_snapshots();
+  start_drain_thread();
+  pthread_atfork(before_fork, after_fork_in_parent, after_fork_in_child);
+
+  // the nesting state might have been registered as thread-local already
+  if (thread_mode)
+    return;
+  process_state.rng = rand() | 1;
+  init_ring(&process_state.ring);
+  open_counters(&process_state);
+  start_sampling(&process_state);
+}
+
+// Directory of this process' output files, given by $LOOP_PROF_DIR:
+// every process writes its profile to a subdirectory named by its pid.
+// Without it the profile goes to the current directory, except for forked
+// children, which default to loop-prof.procs/<pid>/.  Empty if unused.
+static std::string process_dir() {
+  const char *dir = getenv("LOOP_PROF_DIR");
+  if (dir == NULL && !forked_child)
+    return "";
+  if (dir == NULL)
+    dir = "loop-prof.procs";
+  std::string pid_dir = std::string(dir) + "/" + std::to_string(getpid());
+  mkdir(dir, 0777);
+  mkdir(pid_dir.c_str(), 0777);
+  return pid_dir + "/";
+}
+
+// Name of one of the output files of snapshot `snap`.  The final profile
+// (snapshot 0) uses the plain names.
+static std::string output_file_name(const char *name, unsigned snap) {
+  std::string dir = process_dir();
+  std::string file_name = dir.empty() ? prefixed_file_name(name) : dir + name;
+  if (snap)
+    file_name += "." + std::to_string(snap);
+  return file_name;
+}
+
+// Record how the profile was taken
+static void write_profile_info(const std::string &file_name, unsigned snap,
+                               size_t num_sampled, long long elapsed,
+                               uint32_t threads, bool has_counters) {
+  FILE *info_out = fopen(file_name.c_str(), "w");
+  if (info_out == NULL)
+    return;
+  fprintf(info_out, "pid=%d\n", (int)getpid());
+  fprintf(info_out, "ppid=%d\n", (int)getppid());
+  fprintf(info_out, "backend=%s\n", active_backend->name);
+  fprintf(info_out, "clock=%s\n", wall_mode ? "wall" : "cpu");
+  fprintf(info_out, "period(ns)=%ld\n", sampling_period_ns);
+  fprintf(info_out, "samples=%zu\n", num_sampled);
+  fprintf(info_out, "time(ms)=%lld\n", elapsed);
+  fprintf(info_out, "threads=%u\n", threads);
+  fprintf(info_out, "counters=%s\n", has_counters ? "yes" : "no");
+  fprintf(info_out, "probe-overhead(cycles)=%llu\n",
+          (unsigned long long)probe_overhead);
+  fprintf(info_out, "snapshot=%u\n", snap);
+  fprintf(info_out, "window-begin(ms)=%lld\n", window_begin);
+  fprintf(info_out, "window-end(ms)=%lld\n", wall_time_ms());
+  fclose(info_out);
+}
+
+// the profiled threads, oldest first
+static std::vector<thread_state *> get_threads() {
+  std::vector<thread_state *> threads;
+  if (thread_mode) {
+    pthread_mutex_lock(&thread_list_lock);
+    for (thread_state *ts = thread_list_head; ts != NULL; ts = ts->next)
+      threads.insert(threads.begin(), ts);
+    pthread_mutex_unlock(&thread_list_lock);
+  } else if (process_state.ring.buf) {
+    threads.push_back(&process_state);
+  }
+  return threads;
+}
+
+// 95% Wilson score interval of the share of `n` samples that `k` make up
+static void share_interval(uint64_t k, uint64_t n, double *lo, double *hi) {
+  const double z = 1.96;
+  if (n == 0) {
+    *lo = *hi = 0;
+    return;
+  }
+  double p = (double)k / n, z2n = z * z / n;
+  double center = (p + z2n / 2) / (1 + z2n);
+  double half = z * sqrt(p * (1 - p) / n + z2n / (4 * n)) / (1 + z2n);
+  *lo = center - half < 0 ? 0 : center - half;
+  *hi = center + half > 1 ? 1 : center + half;
+}
+
+// The bytes a sampled cache line of a module stands for
+static uint64_t mem_line_bytes(const module_desc *desc) {
+  return (uint64_t)desc->_mem_rate << MEM_LINE_SHIFT;
+}
+
+// The reuse distance (in bytes) within which `pct` percent of the sampled
+// accesses of a loop fall, the lower bound of their bucket; the first
+// accesses to their lines are infinitely far
+static double reuse_percentile(const module_desc *desc,
+                               const struct mem_profile *profile,
+                               double pct) {
+  if (profile->samples == 0)
+    return 0;
+  uint64_t target = (uint64_t)ceil(profile->samples * pct / 100), seen = 0;
+  for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+    seen += profile->reuse[b];
+    if (seen >= target)
+      return b ? (double)(1ULL << (b - 1)) * mem_line_bytes(desc) : 0;
+  }
+  return INFINITY;
+}
+
+// Write the non-empty buckets of the histograms of the profiled loops, one
+// per row: the range [lo, hi] of the bucket and the number of entries of
+// the loop that fell in it.  The reuse distances of the sampled memory
+// accesses of a loop are in bytes, and the first accesses to their lines
+// are counted in an `inf` bucket.
+static void write_histograms(const std::vector<module_counts> &counts,
+                             unsigned snap) {
+  bool has_histograms = false;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    has_histograms |= desc->_get_histograms != NULL ||
+                      desc->_mem_profiles != NULL;
+  if (!has_histograms)
+    return;
+
+  FILE *hist_out =
+      fopen(output_file_name(HistogramFileName, snap).c_str(), "w");
+  if (hist_out == NULL) {
+    perror("Unable to write histograms");
+    return;
+  }
+  fprintf(hist_out, "module,function,header-id,kind,lo,hi,count\n");
+  const module_counts *mc = counts.data();
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next, mc++) {
+    for (uint32_t i = 0; i < desc->_num_mem_profiles; i++) {
+      const struct mem_profile *profile = &desc->_mem_profiles[i];
+      struct loop_data *loop = &desc->_prof_loops_p[profile->loop_idx];
+      uint64_t bytes = mem_line_bytes(desc);
+      for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+        if (profile->reuse[b] == 0)
+          continue;
+        uint64_t lo = b ? (1ULL << (b - 1)) * bytes : 0;
+        uint64_t hi = b == HIST_BUCKETS - 1 ? UINT64_MAX
+                                            : b ? (1ULL << b) * bytes - 1 : 0;
+        fprintf(hist_out, "%s,%s,%d,reuse,%llu,%llu,%llu\n",
+                desc->_moduleName, loop->func, loop->header_id,
+                (unsigned long long)lo, (unsigned long long)hi,
+                (unsigned long long)profile->reuse[b]);
+      }
+      if (profile->cold)
+        fprintf(hist_out, "%s,%s,%d,reuse,inf,inf,%llu\n",
+                desc->_moduleName, loop->func, loop->header_id,
+                (unsigned long long)profile->cold);
+    }
+    if (desc->_get_histograms == NULL)
+      continue;
+    const uint64_t *totals = mc->hists.data();
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++) {
+      struct loop_data *loop = &desc->_prof_loops_p[i];
+      if (loop->header_id == 0)
+        continue;
+      for (unsigned kind = 0; kind < NUM_HIST_KINDS; kind++)
+        for (unsigned b = 0; b < HIST_BUCKETS; b++, totals++) {
+          if (*totals == 0)
+            continue;
+          uint64_t lo = b ? 1ULL << (b - 1) : 0;
+          uint64_t hi = b == HIST_BUCKETS - 1 ? UINT64_MAX
+                                              : b ? (1ULL << b) - 1 : 0;
+          fprintf(hist_out, "%s,%s,%d,%s,%llu,%llu,%llu\n",
+                  desc->_moduleName, loop->func, loop->header_id,
+                  hist_kind_names[kind], (unsigned long long)lo,
+                  (unsigned long long)hi, (unsigned long long)*totals);
+        }
+    }
+  }
+  fclose(hist_out);
+}
+
+// Write the values recorded for the profiled loops, one per row from the
+// most frequent value of a loop value down, with the number of times it
+// was seen and the number of times the loop value was recorded
+static void write_loop_values(const std::vector<module_counts> &sums,
+                              unsigned snap) {
+  bool has_values = false;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    has_values |= desc->_loop_values != NULL;
+  if (!has_values)
+    return;
+
+  FILE *values_out =
+      fopen(output_file_name(ValueProfileFileName, snap).c_str(), "w");
+  if (values_out == NULL) {
+    perror("Unable to write loop values");
+    return;
+  }
+  fprintf(values_out,
+          "module,function,header-id,kind,operand,value,count,total\n");
+  const module_counts *mc = sums.data();
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next, mc++)
+    for (uint32_t i = 0; i < desc->_num_loop_values; i++) {
+      const struct loop_value *value = &desc->_loop_values[i];
+      const struct value_counts *counts = &mc->values[i];
+      struct loop_data *loop = &desc->_prof_loops_p[value->loop_idx];
+      unsigned order[VALUE_SLOTS];
+      for (unsigned j = 0; j < VALUE_SLOTS; j++) {
+        unsigned k = j;
+        for (; k > 0 && counts->counts[order[k - 1]] < counts->counts[j]; k--)
+          order[k] = order[k - 1];
+        order[k] = j;
+      }
+      for (unsigned j = 0; j < VALUE_SLOTS; j++) {
+        if (counts->counts[order[j]] == 0)
+          break;
+        fprintf(values_out, "%s,%s,%d,%s,%d,%lld,%llu,%llu\n",
+                desc->_moduleName, loop->func, loop->header_id,
+                value_kind_names[value->kind], value->operand,
+                (long long)counts->values[order[j]],
+                (unsigned long long)counts->counts[order[j]],
+                (unsigned long long)counts->total);
+      }
+    }
+  fclose(values_out);
+}
+
+// Write the CFG edges that were taken, one per row with their count
+static void write_cfg_edges(const std::vector<module_counts> &counts,
+                            unsigned snap) {
+  bool has_edges = false;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    has_edges |= desc->_cfg_edges != NULL;
+  if (!has_edges)
+    return;
+
+  FILE *edges_out =
+      fopen(output_file_name(EdgeCountFileName, snap).c_str(), "w");
+  if (edges_out == NULL) {
+    perror("Unable to write edge counts");
+    return;
+  }
+  fprintf(edges_out, "module,function,src,dst,count\n");
+  const module_counts *mc = counts.data();
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next, mc++)
+    for (uint32_t i = 0; i < desc->_num_cfg_edges; i++) {
+      const struct cfg_edge *edge = &desc->_cfg_edges[i];
+      int64_t count = mc->edges[i];
+      if (count == 0)
+        continue;
+      fprintf(edges_out, "%s,%s,%d,%d,%lld\n", desc->_moduleName,
+              desc->_prof_loops_p[edge->func_idx].func, edge->src, edge->dst,
+              (long long)count);
+    }
+  fclose(edges_out);
+}
+
+// Write the flat and graph profiles (and how they were taken) from
+// everything drained so far.  Only the drain thread, or `_prof_dump` once
+// it is gone, may call this.
+static void write_profile(const std::vector<thread_state *> &threads,
+                          const std::vector<module_counts> &totals,
+                          long long elapsed, unsigned snap) {
+  size_t num_sampled = 0;
+  std::vector<uint64_t> self(_prof_num_loops_tot, 0);
+  std::vector<uint64_t> counts(_prof_num_loops_tot * NUM_COUNTERS, 0);
+  std::vector<uint64_t> cpu_times(_prof_num_loops_tot * 2, 0);
+  bool has_counters = false;
+  for (thread_state *ts : threads) {
+    grow_self(ts);
+    num_sampled += ts->num_sampled;
+    for (uint32_t i = 0; i < _prof_num_loops_tot; i++)
+      self[i] += ts->self[i];
+    if (wall_mode)
+      for (uint32_t i = 0; i < _prof_num_loops_tot * 2; i++)
+        cpu_times[i] += ts->cpu_times[i];
+    if (ts->counter_fds[0] < 0)
+      continue;
+    has_counters = true;
+    for (uint32_t i = 0; i < _prof_num_loops_tot * NUM_COUNTERS; i++)
+      counts[i] += ts->counts[i];
+  }
+  // and those the threads that exited handed in
+  const exited_samples *ex = &exited_threads;
+  num_sampled += ex->num_sampled;
+  for (uint32_t i = 0; i < ex->size; i++)
+    self[i] += ex->self[i];
+  if (wall_mode)
+    for (uint32_t i = 0; i < ex->size * 2; i++)
+      cpu_times[i] += ex->cpu_times[i];
+  if (ex->has_counters) {
+    has_counters = true;
+    for (uint32_t i = 0; i < ex->size * NUM_COUNTERS; i++)
+      counts[i] += ex->counts[i];
+  }
+  // the events of the other threads would be missing
+  if (!thread_mode && other_threads_started)
+    has_counters = false;
+
+  // the edge table is complete now, hand it over to the serializers
+  LoopCallProfile profile;
+  PackWriter pack;
+  for (size_t i = 0; i < edge_table_size; i++)
+    if (edge_table[i].count) {
+      profile.getFreq(edge_table[i].src, edge_table[i].dst) =
+          edge_table[i].count;
+      pack.addEdge(edge_table[i].src, edge_table[i].dst, edge_table[i].count);
+    }
+  
+#ifndef NDEBUG
+  printf("finished collecting samples\n");
+#endif
+
+  FILE *flat_out = fopen(output_file_name(MetadataFileName, snap).c_str(), "wb");
+  if (flat_out == NULL) {
+    perror("Unable to write profile");
+    return;
+  }
+
+  fprintf(flat_out,
+          "module,function,header-id,parent-id,fingerprint,runs,time(pct),"
+          "time(ms)");
+  fprintf(flat_out, ",samples,time-lo(pct),time-hi(pct)");
+  bool has_timing = false;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    has_timing |= desc->_get_timing != NULL;
+  if (has_timing)
+    fprintf(flat_out, ",calls,cycles");
+  if (wall_mode)
+    fprintf(flat_out, ",on-cpu(ms),off-cpu(ms)");
+  if (has_counters)
+    fprintf(flat_out, ",ipc,llc-mpki,br-mpki");
+  bool has_mem = false;
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next)
+    has_mem |= desc->_mem_profiles != NULL;
+  if (has_mem)
+    fprintf(flat_out,
+            ",mem-samples,wss(bytes),reuse-p50(bytes),reuse-p90(bytes)");
+  // per-thread breakdown: share of all samples taken on each thread
+  if (thread_mode)
+    for (thread_state *ts : threads)
+      if (ts->num_sampled > 0)
+        fprintf(flat_out, ",t%u(pct)", ts->id);
+  fprintf(flat_out, "\n");
+
+  uint32_t loop_idx = 0;
+  const module_counts *mc = totals.data();
+  for (module_desc *desc = module_desc_list_head; desc != NULL;
+       desc = desc->next, mc++) {
+    struct loop_data *prof_loops = desc->_prof_loops_p;
+    std::vector<const struct mem_profile *> mem_rows(desc->_prof_num_loops);
+    for (uint32_t i = 0; i < desc->_num_mem_profiles; i++)
+      mem_rows[desc->_mem_profiles[i].loop_idx] = &desc->_mem_profiles[i];
+    for (uint32_t i = 0; i < desc->_prof_num_loops; i++) {
+      struct loop_data *loop = &prof_loops[i];
+      float pct = num_sampled ? (float)self[loop_idx] / num_sampled : 0;
+      assert(pct <= 1.0);
+      int64_t runs = mc->runs[i];
+      fprintf(flat_out, "%s,%s,%d,%d,%016llx,%ld,%.4f,%.4f",
+	      desc->_moduleName, loop->func, loop->header_id, loop->parent_id,
+              (unsigned long long)loop->fingerprint, runs, 100 * pct,
+              elapsed * pct);
+      double lo, hi;
+      share_interval(self[loop_idx], num_sampled, &lo, &hi);
+      fprintf(flat_out, ",%llu,%.4f,%.4f", (unsigned long long)self[loop_idx],
+              100 * lo, 100 * hi);
+      pack.addNode(desc->_moduleName, loop->func,
+                   {0, 0, (uint32_t)loop->header_id, (uint32_t)loop->parent_id,
+                    loop->fingerprint, (uint64_t)runs, self[loop_idx],
+                    100 * pct, elapsed * pct, (float)(100 * lo),
+                    (float)(100 * hi)});
+      // the other columns go to the pack as they are
+      auto add_column = [&](const std::string &name, double value) {
+        pack.setColumn(name, loop_idx, value);
+      };
+      if (has_timing) {
+        // modules without timings report zeros
+        uint64_t calls = 0, cycles = 0;
+        if (!mc->timing.empty()) {
+          const uint64_t *timing = &mc->timing[3 * i];
+          uint64_t overhead = timing[2] * probe_overhead;
+          calls = timing[1];
+          cycles = timing[0] > overhead ? timing[0] - overhead : 0;
+        }
+        fprintf(flat_out, ",%llu,%llu", (unsigned long long)calls,
+                (unsigned long long)cycles);
+        add_column("calls", calls);
+        add_column("cycles", cycles);
+      }
+      if (wall_mode) {
+        fprintf(flat_out, ",%.4f,%.4f", cpu_times[loop_idx * 2] / 1e6,
+                cpu_times[loop_idx * 2 + 1] / 1e6);
+        add_column("on-cpu(ms)", cpu_times[loop_idx * 2] / 1e6);
+        add_column("off-cpu(ms)", cpu_times[loop_idx * 2 + 1] / 1e6);
+      }
+      if (has_counters) {
+        const uint64_t *c = &counts[loop_idx * NUM_COUNTERS];
+        double kinstrs = c[CTR_INSTRUCTIONS] / 1e3;
+        double ipc =
+            c[CTR_CYCLES] ? (double)c[CTR_INSTRUCTIONS] / c[CTR_CYCLES] : 0;
+        double llc_mpki = kinstrs ? c[CTR_LLC_MISSES] / kinstrs : 0;
+        double br_mpki = kinstrs ? c[CTR_BRANCH_MISSES] / kinstrs : 0;
+        fprintf(flat_out, ",%.4f,%.4f,%.4f", ipc, llc_mpki, br_mpki);
+        add_column("ipc", ipc);
+        add_column("llc-mpki", llc_mpki);
+        add_column("br-mpki", br_mpki);
+      }
+      if (has_mem) {
+        // loops that aren't sampled report zeros
+        const struct mem_profile *profile = mem_rows[i];
+        if (profile) {
+          uint64_t wss = profile->lines * mem_line_bytes(desc);
+          double p50 = reuse_percentile(desc, profile, 50);
+          double p90 = reuse_percentile(desc, profile, 90);
+          fprintf(flat_out, ",%llu,%llu,%.0f,%.0f",
+                  (unsigned long long)profile->samples,
+                  (unsigned long long)wss, p50, p90);
+          add_column("mem-samples", profile->samples);
+          add_column("wss(bytes)", wss);
+          add_column("reuse-p50(bytes)", p50);
+          add_column("reuse-p90(bytes)", p90);
+        } else {
+          fprintf(flat_out, ",0,0,0,0");
+        }
+      }
+      if (thread_mode)
+        for (thread_state *ts : threads)
+          if (ts->num_sampled > 0) {
+            float share = 100 * (float)ts->self[loop_idx] / num_sampled;
+            fprintf(flat_out, ",%.4f", share);
+            add_column("t" + std::to_string(ts->id) + "(pct)", share);
+          }
+      fprintf(flat_out, "\n");
+      ++loop_idx;
+    }
+  }
+
+  for (size_t i = 0; i < num_cct_nodes; i++) {
+    profile.addContext(cct_nodes[i].parent, cct_nodes[i].loop,
+                       cct_nodes[i].inclusive, cct_nodes[i].exclusive);
+    pack.addContext(cct_nodes[i].parent, cct_nodes[i].loop,
+                    cct_nodes[i].inclusive, cct_nodes[i].exclusive);
+  }
+
+  profile.dump(output_file_name(ProfileFileName, snap));
+  profile.dumpContexts(output_file_name(ContextFileName, snap));
+  pack.write(output_file_name(PackFileName, snap));
+  write_profile_info(output_file_name(ProfileInfoFileName, snap), snap,
+                     num_sampled, elapsed, threads.size() + ex->num_threads,
+                     has_counters);
+  write_histograms(totals, snap);
+  write_cfg_edges(totals, snap);
+  write_loop_values(totals, snap);
 
   fclose(flat_out);
+}
+
+// Time the process in ms, on the clock that is sampled
+static long long elapsed_ms() {
+  if (wall_mode)
+    return wall_time_ms();
+  struct timespec end;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+  return (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+}
+
+// Write a snapshot of the profile so far without disturbing the process:
+// the counts of the running threads are added in as they are, not handed
+// in.  Called by the drain thread.
+static void take_snapshot() {
+  drain_rings();
+  drain_mem_buffers();
+  unsigned snap = ++num_snapshots;
+  std::vector<thread_state *> threads = get_threads();
+  write_profile(threads, sum_thread_counts(threads), elapsed_ms(), snap);
+  window_begin = wall_time_ms();
+}
+
+void _prof_dump() {
+  // the profile may have been written before an exec that failed
+  static bool dumped = false;
+  if (dumped)
+    return;
+  dumped = true;
+
+  // disarm timer(s)
+  sampling_stopped = true;
+  stop_sampling(&process_state);
+  signal(SIGPROF, SIG_IGN);
+  pthread_mutex_lock(&thread_list_lock);
+  for (thread_state *ts = thread_list_head; ts != NULL; ts = ts->next)
+    stop_sampling(ts);
+  pthread_mutex_unlock(&thread_list_lock);
+
+  // For accuracy, do this before postprocessing.
+  long long elapsed = elapsed_ms();
+
+  stop_drain_thread();
+
+  // read samples from the dump(s); threads exiting meanwhile leave their
+  // state to us
+  pthread_mutex_lock(&drain_lock);
+  std::vector<thread_state *> threads = get_threads();
+  for (thread_state *ts : threads)
+    collect_thread_samples(ts);
+  drain_mem_buffers();
+
+  // the threads that exited handed in their counts; add those of the ones
+  // still running
+  write_profile(threads, sum_thread_counts(threads), elapsed, 0);
+  pthread_mutex_unlock(&drain_lock);
 
 #ifndef NDEBUG
   printf("finished dumping profiling output\n");
 #endif
 }
+
+#ifdef __linux__
+// An exec replaces the program without running its destructors, and a
+// process interval timer would outlive it (its SIGPROF killing a program
+// that isn't profiled).  Write the profile and stop sampling first; if the
+// exec fails, the rest of the process goes unprofiled.  Children that exec
+// right after forking have nothing to write.
+static void prepare_exec() {
+  size_t num_sampled = process_state.num_sampled + exited_threads.num_sampled;
+  pthread_mutex_lock(&thread_list_lock);
+  for (thread_state *ts = thread_list_head; ts != NULL; ts = ts->next)
+    num_sampled += ts->num_sampled;
+  pthread_mutex_unlock(&thread_list_lock);
+  if (num_sampled > 0 || !forked_child) {
+    _prof_dump();
+    return;
+  }
+
+  sampling_stopped = true;
+  stop_sampling(&process_state);
+  pthread_mutex_lock(&thread_list_lock);
+  for (thread_state *ts = thread_list_head; ts != NULL; ts = ts->next)
+    stop_sampling(ts);
+  pthread_mutex_unlock(&thread_list_lock);
+  signal(SIGPROF, SIG_IGN);
+}
+
+typedef int (*execve_fn)(const char *, char *const[], char *const[]);
+typedef int (*execv_fn)(const char *, char *const[]);
+typedef int (*fexecve_fn)(int, char *const[], char *const[]);
+
+extern "C" int execve(const char *path, char *const argv[],
+                      char *const envp[]) {
+  static execve_fn real_execve = (execve_fn)dlsym(RTLD_NEXT, "execve");
+  prepare_exec();
+  return real_execve(path, argv, envp);
+}
+
+extern "C" int execv(const char *path, char *const argv[]) {
+  static execv_fn real_execv = (execv_fn)dlsym(RTLD_NEXT, "execv");
+  prepare_exec();
+  return real_execv(path, argv);
+}
+
+extern "C" int execvp(const char *file, char *const argv[]) {
+  static execv_fn real_execvp = (execv_fn)dlsym(RTLD_NEXT, "execvp");
+  prepare_exec();
+  return real_execvp(file, argv);
+}
+
+extern "C" int execvpe(const char *file, char *const argv[],
+                       char *const envp[]) {
+  static execve_fn real_execvpe = (execve_fn)dlsym(RTLD_NEXT, "execvpe");
+  prepare_exec();
+  return real_execvpe(file, argv, envp);
+}
+
+extern "C" int fexecve(int fd, char *const argv[], char *const envp[]) {
+  static fexecve_fn real_fexecve = (fexecve_fn)dlsym(RTLD_NEXT, "fexecve");
+  prepare_exec();
+  return real_fexecve(fd, argv, envp);
+}
+
+// The arguments of execl, execlp and execle, up to the null one; libc
+// doesn't pass them on to the functions above
+static std::vector<char *> get_exec_args(const char *arg, va_list ap) {
+  std::vector<char *> argv(1, (char *)arg);
+  while (argv.back() != NULL)
+    argv.push_back(va_arg(ap, char *));
+  return argv;
+}
+
+extern "C" int execl(const char *path, const char *arg, ...) {
+  static execv_fn real_execv = (execv_fn)dlsym(RTLD_NEXT, "execv");
+  va_list ap;
+  va_start(ap, arg);
+  std::vector<char *> argv = get_exec_args(arg, ap);
+  va_end(ap);
+  prepare_exec();
+  return real_execv(path, argv.data());
+}
+
+extern "C" int execlp(const char *file, const char *arg, ...) {
+  static execv_fn real_execvp = (execv_fn)dlsym(RTLD_NEXT, "execvp");
+  va_list ap;
+  va_start(ap, arg);
+  std::vector<char *> argv = get_exec_args(arg, ap);
+  va_end(ap);
+  prepare_exec();
+  return real_execvp(file, argv.data());
+}
+
+extern "C" int execle(const char *path, const char *arg, ...) {
+  static execve_fn real_execve = (execve_fn)dlsym(RTLD_NEXT, "execve");
+  va_list ap;
+  va_start(ap, arg);
+  std::vector<char *> argv = get_exec_args(arg, ap);
+  char *const *envp = va_arg(ap, char *const *);
+  va_end(ap);
+  prepare_exec();
+  return real_execve(path, argv.data(), envp);
+}
+#endif
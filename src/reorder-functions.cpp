@@ -1,3 +1,4 @@
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Function.h>
@@ -13,11 +14,16 @@
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/SystemUtils.h>
 #include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iterator>
+#include <map>
 #include <sstream>
 #include <cstdio>
+#include <cstdlib>
 
 using namespace llvm;
 
@@ -34,6 +40,18 @@ cl::opt<bool> ListFunctions("list-functions",
                              cl::desc("List functions and functions declarations in the module"),
                              cl::init(false));
 
+static
+cl::opt<std::string> EdgeProfile("edge-profile",
+                                 cl::desc("Lay out the blocks of the functions along their hottest edges, "
+                                          "as counted by a run instrumented with -edge-counts"),
+                                 cl::value_desc("loop-prof.edges.csv"), cl::init(""));
+
+static
+cl::opt<std::string> BlockMapFilename("block-map",
+                                      cl::desc("With -edge-profile, write the blocks that moved as "
+                                               "\"function,old-id,new-id\" rows to this file"),
+                                      cl::value_desc("filename"), cl::init(""));
+
 
 struct TransformImpl { 
   virtual bool apply(Module *M) const = 0;
@@ -242,6 +260,115 @@ bool reorder(Module *M)
   return true;
 } 
 
+struct EdgeCount {
+  unsigned Src, Dst;
+  uint64_t Count;
+};
+
+// Read the edge counts of the functions of `M`.  The rows of other modules
+// are only used if none is of `M` (e.g. when `M` is a temporary copy).
+std::map<std::string, std::vector<EdgeCount>> readEdgeProfile(Module *M)
+{
+  std::ifstream Fin(EdgeProfile.c_str());
+  if (!Fin) {
+    errs() << "Cannot open " << EdgeProfile << '\n';
+    exit(1);
+  }
+
+  std::string ModuleName = sys::path::filename(M->getModuleIdentifier()).str();
+  std::map<std::string, std::vector<EdgeCount>> Ours, All;
+  std::string Line;
+  std::getline(Fin, Line); // skip header
+  while (std::getline(Fin, Line)) {
+    std::stringstream Fields(Line);
+    std::string Module, Func, Src, Dst, Count;
+    std::getline(Fields, Module, ',');
+    std::getline(Fields, Func, ',');
+    std::getline(Fields, Src, ',');
+    std::getline(Fields, Dst, ',');
+    std::getline(Fields, Count, ',');
+    if (Fields.fail() || !M->getFunction(Func))
+      continue;
+    EdgeCount E{(unsigned)std::atoi(Src.c_str()), (unsigned)std::atoi(Dst.c_str()),
+                std::strtoull(Count.c_str(), nullptr, 10)};
+    All[Func].push_back(E);
+    if (sys::path::filename(Module) == ModuleName)
+      Ours[Func].push_back(E);
+  }
+  return Ours.empty() ? All : Ours;
+}
+
+// Lay out the blocks of `F` along its hottest edges (Pettis and Hansen):
+// taking the edges from the hottest down, chains of blocks are joined where
+// an edge leaves the tail of one chain for the head of another.  The chain
+// of the entry block comes first, the others follow from the hottest to the
+// coldest.  Blocks are numbered from 1 in their current order.  Return false
+// if the counts don't fit the CFG of `F`.
+bool layoutBlocks(Function &F, std::vector<EdgeCount> Edges)
+{
+  std::vector<BasicBlock *> Blocks(1, nullptr);
+  for (BasicBlock &BB : F)
+    Blocks.push_back(&BB);
+  unsigned N = Blocks.size() - 1;
+
+  // a block is as hot as the edges entering or leaving it
+  std::vector<uint64_t> In(N + 1, 0), Out(N + 1, 0);
+  for (const EdgeCount &E : Edges) {
+    if (E.Src == 0 || E.Dst == 0 || E.Src > N || E.Dst > N)
+      return false;
+    TerminatorInst *Term = Blocks[E.Src]->getTerminator();
+    bool IsEdge = false;
+    for (unsigned i = 0, e = Term->getNumSuccessors(); i != e; i++)
+      IsEdge |= Term->getSuccessor(i) == Blocks[E.Dst];
+    if (!IsEdge)
+      return false;
+    Out[E.Src] += E.Count;
+    In[E.Dst] += E.Count;
+  }
+
+  std::vector<std::vector<unsigned>> Chains(N + 1);
+  std::vector<unsigned> ChainOf(N + 1);
+  for (unsigned i = 1; i <= N; i++) {
+    Chains[i].push_back(i);
+    ChainOf[i] = i;
+  }
+  std::stable_sort(Edges.begin(), Edges.end(),
+                   [](const EdgeCount &A, const EdgeCount &B) { return A.Count > B.Count; });
+  for (const EdgeCount &E : Edges) {
+    unsigned From = ChainOf[E.Src], To = ChainOf[E.Dst];
+    if (E.Count == 0 || From == To || E.Dst == 1 ||
+        Chains[From].back() != E.Src || Chains[To].front() != E.Dst)
+      continue;
+    for (unsigned BB : Chains[To]) {
+      Chains[From].push_back(BB);
+      ChainOf[BB] = From;
+    }
+    Chains[To].clear();
+  }
+
+  std::vector<unsigned> Order;
+  std::vector<uint64_t> Heat(N + 1, 0);
+  for (unsigned i = 2; i <= N; i++) {
+    if (Chains[i].empty())
+      continue;
+    Order.push_back(i);
+    for (unsigned BB : Chains[i])
+      Heat[i] = std::max(Heat[i], std::max(In[BB], Out[BB]));
+  }
+  std::stable_sort(Order.begin(), Order.end(),
+                   [&](unsigned A, unsigned B) { return Heat[A] > Heat[B]; });
+  Order.insert(Order.begin(), 1);
+
+  BasicBlock *Prev = nullptr;
+  for (unsigned Chain : Order)
+    for (unsigned BB : Chains[Chain]) {
+      if (Prev)
+        Blocks[BB]->moveAfter(Prev);
+      Prev = Blocks[BB];
+    }
+  return true;
+}
+
 void scanModule(Module *M, std::vector<std::pair<Function *, unsigned>> &Functions,
                 std::vector<Function *> &Declarations)
 {
@@ -295,6 +422,38 @@ int main(int argc, char **argv)
     return 0;
   }
 
+  if (!EdgeProfile.empty()) {
+    // the ids of the blocks change with their order, and loops are named
+    // by the ids of their headers in the profile
+    std::ofstream BlockMap;
+    if (!BlockMapFilename.empty()) {
+      BlockMap.open(BlockMapFilename.c_str());
+      BlockMap << "function,old-id,new-id\n";
+    }
+    for (auto &Pair : readEdgeProfile(M.get())) {
+      Function &F = *M->getFunction(Pair.first);
+      std::vector<BasicBlock *> Blocks;
+      for (BasicBlock &BB : F)
+        Blocks.push_back(&BB);
+      if (!layoutBlocks(F, Pair.second)) {
+        errs() << "warning: the edge counts of " << Pair.first
+               << " don't match its CFG, leaving it as is\n";
+        continue;
+      }
+      std::map<BasicBlock *, unsigned> NewIds;
+      for (BasicBlock &BB : F)
+        NewIds.emplace(&BB, NewIds.size() + 1);
+      for (unsigned i = 0; i < Blocks.size(); i++)
+        if (NewIds[Blocks[i]] != i + 1)
+          BlockMap << Pair.first << ',' << i + 1 << ','
+                   << NewIds[Blocks[i]] << '\n';
+    }
+    if (!BlockMapFilename.empty() && !BlockMap) {
+      errs() << "Cannot write " << BlockMapFilename << '\n';
+      return 1;
+    }
+  }
+
   std::error_code EC;
   tool_output_file Out(OutputFilename, EC, sys::fs::F_None);
   if (EC) {
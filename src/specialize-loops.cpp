@@ -0,0 +1,382 @@
+//===- llvmtuner/src/specialize-loops.cpp: version loops on their values -===//
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Specialize the loops of a module for the values they were entered with
+// most often, as recorded by a run instrumented with
+// `instrument-loops -value-profile` (see LoopValues.h):
+//
+//	specialize-loops foo.bc -o foo.spec.bc [-prof-prefix run1/]
+//
+// A loop whose bound or stride had one value nearly every time it was
+// entered, or whose pointers were nearly always aligned, is versioned: its
+// old preheader checks the values and branches to the loop, which now uses
+// the constants and assumes the alignment, or to a copy of the loop as it
+// was.  The blocks added go to the end of the function, so the header ids
+// of the loops stay the same and the profile of the module still applies
+// to the specialized one.  The fingerprints of a versioned loop and of the
+// loops around it change, though, so its loops are found by header id.
+//
+//===----------------------------------------------------------------------===//
+
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Bitcode/BitcodeWriterPass.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Dominators.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Support/Signals.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+#include "LoopCallProfile.h"
+#include "LoopValues.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+    InputFilename(cl::Positional, cl::desc("<input file>"), cl::Required);
+
+static cl::opt<std::string> OutputFilename("o",
+                                           cl::desc("Specify output file name"),
+                                           cl::value_desc("<output file>"));
+
+static cl::opt<float>
+    MinShare("min-share",
+             cl::desc("Specialize a loop for a value only if it had it at "
+                      "least this share (in %) of the times it was entered"),
+             cl::init(90));
+
+static cl::opt<unsigned>
+    MinEntries("min-entries",
+               cl::desc("Don't specialize loops entered fewer times than "
+                        "this"),
+               cl::init(100));
+
+static cl::opt<unsigned>
+    MinAlignment("min-align",
+                 cl::desc("Don't specialize loops for pointers aligned to "
+                          "fewer bytes than this"),
+                 cl::init(16));
+
+// a loop value as recorded: its kind and values with their counts
+struct RecordedValue {
+  LoopValue::KindTy Kind;
+  std::vector<std::pair<int64_t, uint64_t>> Counts;
+  uint64_t Total;
+};
+
+// function -> header id -> position of the value among the loop's -> value
+typedef std::map<unsigned, RecordedValue> RecordedLoop;
+static std::map<std::string, std::map<unsigned, RecordedLoop>> Recorded;
+
+// Read the values recorded for the loops of `ModuleName`, return false if
+// the profile can't be read
+static bool readValueProfile(StringRef ModuleName) {
+  std::string FileName = ProfilePrefix + ValueProfileFileName;
+  std::ifstream Fin(FileName);
+  if (!Fin) {
+    errs() << "Cannot open " << FileName << '\n';
+    return false;
+  }
+
+  std::string Line;
+  std::getline(Fin, Line); // skip header
+  while (std::getline(Fin, Line)) {
+    std::istringstream Fields(Line);
+    std::string Module, Func, HeaderId, Kind, Operand, Value, Count, Total;
+    std::getline(Fields, Module, ',');
+    std::getline(Fields, Func, ',');
+    std::getline(Fields, HeaderId, ',');
+    std::getline(Fields, Kind, ',');
+    std::getline(Fields, Operand, ',');
+    std::getline(Fields, Value, ',');
+    std::getline(Fields, Count, ',');
+    std::getline(Fields, Total, ',');
+    if (Fields.fail() || sys::path::filename(Module) != ModuleName)
+      continue;
+
+    RecordedValue &RV = Recorded[Func][std::atoi(HeaderId.c_str())]
+                                [std::atoi(Operand.c_str())];
+    RV.Kind = LoopValue::NumKinds;
+    for (unsigned k = 0; k < LoopValue::NumKinds; k++)
+      if (Kind == getLoopValueKindName((LoopValue::KindTy)k))
+        RV.Kind = (LoopValue::KindTy)k;
+    RV.Counts.emplace_back(std::strtoll(Value.c_str(), nullptr, 10),
+                           std::strtoull(Count.c_str(), nullptr, 10));
+    RV.Total = std::strtoull(Total.c_str(), nullptr, 10);
+  }
+  return true;
+}
+
+// Find the value to specialize a loop value for: the bound or stride it had
+// at least `-min-share` of the time, or the largest alignment its pointer
+// had as often
+static bool getDominantValue(const RecordedValue &RV, int64_t &Dominant) {
+  if (RV.Total < MinEntries)
+    return false;
+  auto isDominant = [&](uint64_t Count) {
+    return Count * 100.0 >= MinShare * RV.Total;
+  };
+
+  if (RV.Kind != LoopValue::Align) {
+    for (auto &VC : RV.Counts)
+      if (isDominant(VC.second)) {
+        Dominant = VC.first;
+        return true;
+      }
+    return false;
+  }
+
+  // the alignments recorded are powers of two
+  for (int64_t Alignment = MaxRecordedAlign; Alignment >= MinAlignment;
+       Alignment /= 2) {
+    uint64_t Aligned = 0;
+    for (auto &VC : RV.Counts)
+      if (VC.first >= Alignment)
+        Aligned += VC.second;
+    if (isDominant(Aligned)) {
+      Dominant = Alignment;
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace llvm {
+void initializeLoopSpecializerPass(PassRegistry &);
+};
+
+struct LoopSpecializer : public ModulePass {
+  static char ID;
+
+  // the values a loop is specialized for
+  typedef std::vector<std::pair<LoopValue, int64_t>> Specialization;
+
+  virtual bool runOnModule(Module &) override;
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+  }
+
+  // version `L` (in simplify form) for `Spec`
+  void specialize(Loop *L, const Specialization &Spec, LoopInfo &LI,
+                  DominatorTree &DT);
+
+  LoopSpecializer() : ModulePass(ID) {
+    initializeLoopSpecializerPass(*PassRegistry::getPassRegistry());
+  }
+
+  const char *getPassName() const override { return "LoopSpecializer pass"; }
+};
+
+char LoopSpecializer::ID = 7;
+
+INITIALIZE_PASS_BEGIN(LoopSpecializer, "", "", true, true)
+INITIALIZE_PASS_DEPENDENCY(LoopInfoWrapperPass)
+INITIALIZE_PASS_DEPENDENCY(DominatorTreeWrapperPass)
+INITIALIZE_PASS_END(LoopSpecializer, "", "", true, true)
+
+void LoopSpecializer::specialize(Loop *L, const Specialization &Spec,
+                                 LoopInfo &LI, DominatorTree &DT) {
+  Function *F = L->getHeader()->getParent();
+  const DataLayout &DL = F->getParent()->getDataLayout();
+
+  // the copy leaves for the same exit blocks, through their phis
+  formLCSSARecursively(*L, DT, &LI, nullptr);
+  SmallVector<BasicBlock *, 4> ExitBlocks;
+  L->getUniqueExitBlocks(ExitBlocks);
+
+  // the old preheader checks the values, the loop gets a preheader of its
+  // own and a copy to fall back on
+  BasicBlock *Check = L->getLoopPreheader();
+  BasicBlock *Preheader = SplitBlock(Check, Check->getTerminator(), &DT, &LI);
+  Preheader->setName(L->getHeader()->getName() + ".spec.ph");
+  ValueToValueMapTy VMap;
+  SmallVector<BasicBlock *, 16> Blocks;
+  Loop *Generic = cloneLoopWithPreheader(Preheader, Check, L, VMap,
+                                         ".generic", &LI, &DT, Blocks);
+  remapInstructionsInBlocks(Blocks, VMap);
+
+  for (BasicBlock *Exit : ExitBlocks)
+    for (auto I = Exit->begin(); PHINode *PN = dyn_cast<PHINode>(I); ++I)
+      for (unsigned i = 0, e = PN->getNumIncomingValues(); i != e; i++) {
+        BasicBlock *From = PN->getIncomingBlock(i);
+        if (!L->contains(From))
+          continue;
+        Value *V = PN->getIncomingValue(i);
+        auto It = VMap.find(V);
+        if (It != VMap.end())
+          V = It->second;
+        PN->addIncoming(V, cast<BasicBlock>(VMap[From]));
+      }
+
+  IRBuilder<> Builder(Check->getTerminator());
+  IRBuilder<> PreheaderBuilder(Preheader->getTerminator());
+  Value *Cond = nullptr;
+  for (auto &S : Spec) {
+    Value *V = S.first.V, *Test;
+    if (S.first.Kind == LoopValue::Align) {
+      Value *Addr =
+          Builder.CreatePtrToInt(V, DL.getIntPtrType(V->getType()));
+      Test = Builder.CreateICmpEQ(
+          Builder.CreateAnd(Addr, S.second - 1),
+          ConstantInt::get(Addr->getType(), 0));
+      PreheaderBuilder.CreateAlignmentAssumption(DL, V, S.second);
+    } else {
+      // only the loop sees the constant, the code after it runs either copy
+      Constant *C = ConstantInt::get(V->getType(), S.second, true);
+      Test = Builder.CreateICmpEQ(V, C);
+      std::vector<Use *> Uses;
+      for (Use &U : V->uses())
+        if (auto *I = dyn_cast<Instruction>(U.getUser()))
+          if (L->contains(I))
+            Uses.push_back(&U);
+      for (Use *U : Uses)
+        U->set(C);
+    }
+    Cond = Cond ? Builder.CreateAnd(Cond, Test) : Test;
+  }
+
+  TerminatorInst *Br = Check->getTerminator();
+  BranchInst::Create(Preheader, Generic->getLoopPreheader(), Cond, Br);
+  Br->eraseFromParent();
+
+  // keep the ids of the blocks there were
+  Preheader->moveAfter(&F->back());
+  for (BasicBlock *BB : Blocks)
+    BB->moveAfter(&F->back());
+
+  // the exit blocks (and what they dominated) are dominated by the check now
+  DT.recalculate(*F);
+}
+
+bool LoopSpecializer::runOnModule(Module &M) {
+  bool Changed = false;
+
+  for (auto &I : Recorded) {
+    Function *F = M.getFunction(I.first);
+    if (!F || F->empty())
+      continue;
+
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
+    DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>(*F).getDomTree();
+
+    // find the loops by header id before any of them is versioned
+    std::vector<std::pair<Loop *, Specialization>> ToSpecialize;
+    unsigned i = 0;
+    for (BasicBlock &BB : *F) {
+      auto LIt = I.second.find(++i);
+      if (LIt == I.second.end())
+        continue;
+
+      Loop *L = LI.getLoopFor(&BB);
+      if (!L || L->getHeader() != &BB || !L->isLoopSimplifyForm()) {
+        errs() << "warning: block " << i << " of " << I.first
+               << " is not a loop header\n";
+        continue;
+      }
+
+      // the values must be those the profile was recorded for
+      std::vector<LoopValue> Values = getLoopValues(*L);
+      Specialization Spec;
+      bool Matches = true;
+      for (auto &Op : LIt->second) {
+        if (Op.first >= Values.size() ||
+            Values[Op.first].Kind != Op.second.Kind) {
+          Matches = false;
+          break;
+        }
+        int64_t Dominant;
+        if (getDominantValue(Op.second, Dominant))
+          Spec.emplace_back(Values[Op.first], Dominant);
+      }
+      if (!Matches)
+        errs() << "warning: the values of loop " << i << " of " << I.first
+               << " don't match the profile, leaving it as is\n";
+      else if (!Spec.empty())
+        ToSpecialize.emplace_back(L, Spec);
+    }
+
+    // inner loops first, so that both copies of a loop enclosing one have
+    // it specialized
+    std::stable_sort(ToSpecialize.begin(), ToSpecialize.end(),
+                     [](const std::pair<Loop *, Specialization> &A,
+                        const std::pair<Loop *, Specialization> &B) {
+                       return A.first->getLoopDepth() >
+                              B.first->getLoopDepth();
+                     });
+    for (auto &Pair : ToSpecialize) {
+      specialize(Pair.first, Pair.second, LI, DT);
+      Changed = true;
+    }
+  }
+
+  return Changed;
+}
+
+int main(int argc, char **argv) {
+  // Print a stack trace if we signal out.
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+
+  cl::ParseCommandLineOptions(argc, argv,
+                              "specialize loops for their usual values");
+
+  LLVMContext &Context = getGlobalContext();
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  if (!M.get()) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+
+  if (!readValueProfile(sys::path::filename(M->getName())))
+    return 1;
+  if (Recorded.empty())
+    errs() << "warning: no values recorded for " << M->getName() << '\n';
+
+  std::error_code EC;
+  tool_output_file Out(OutputFilename, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << EC.message() << '\n';
+    return 1;
+  }
+
+  legacy::PassManager Passes;
+  Passes.add(new LoopSpecializer());
+  Passes.add(createBitcodeWriterPass(Out.os(), true));
+  Passes.run(*M.get());
+
+  Out.keep();
+}
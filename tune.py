@@ -12,13 +12,14 @@ import numpy as np
 import argparse
 import ctypes
 import reorder
+import profpack
 from util import *
 from config import config
 
 class Edge(ctypes.Structure):
     _fields_ = [('src', ctypes.c_uint),
             ('dest', ctypes.c_uint),
-            ('freq', ctypes.c_uint)]
+            ('freq', ctypes.c_uint64)]
 
 
 # read an edge from `f`
@@ -41,6 +42,12 @@ class bcolors:
 # a loop's relative time (%) has to be above this threshold to become a tuning candidate
 TUNING_UPPERBOUND = 100
 TUNING_LOWERBOUND = 20
+# a loop nested in a candidate replaces it if it takes at least this share (%)
+# of the candidate's time, so that a hot inner loop is tuned on its own
+INNER_SHARE = 90
+# with a wall-clock profile, a loop that spends more than this share (%) of its
+# time off CPU (blocked on I/O, locks, ...) is not worth tuning
+OFF_CPU_UPPERBOUND = 50
 
 MAX_INVOS = 10000
 # maximum number of workers spawn to run invocations
@@ -49,17 +56,27 @@ MAX_WORKERS = 100
 Loop = namedtuple('Loop', [
     'function',
     'header_id',
+    # header ids of the enclosing loops, outermost first
+    'outer_ids',
+    # identifies the loop across builds, '' if the profile has none
+    'fingerprint',
     'runs',
     'time',
+    'time_lo',
     'nested',
     'idx'])
 
 def get_loops():
+    if os.path.exists(config.packed_profile):
+        return get_packed_loops(profpack.PackedProfile(config.packed_profile))
+
     # mapping function -> list of loop idxs
     func2loop = {}
 
     # mapping loop index -> loop
     loops = {}
+    # mapping (function, header id) -> header id of the enclosing loop
+    parents = {}
 
     # figure out what loops we have
     with open(config.flat_profile) as flat:
@@ -69,18 +86,36 @@ def get_loops():
             # function, not loop
             if p['header-id'] == '0':
                 continue
+            parents[p['function'], p['header-id']] = p.get('parent-id', '0')
 
             reltime = float(p['time(pct)'])
             function = p['function']
+            if 'off-cpu(ms)' in p:
+                on_cpu = float(p['on-cpu(ms)'])
+                off_cpu = float(p['off-cpu(ms)'])
+                if off_cpu * 100 > OFF_CPU_UPPERBOUND * (on_cpu + off_cpu):
+                    continue
             if reltime > 0:
+                # lower end of the confidence interval, if there is one
+                reltime_lo = float(p.get('time-lo(pct)', reltime))
                 loops[i] = Loop(time=reltime,
+                        time_lo=reltime_lo,
                         header_id=p['header-id'],
+                        outer_ids=[],
+                        fingerprint=p.get('fingerprint', ''),
                         function=function,
                         nested=list(),
                         runs=int(p['runs']),
                         idx=i)
                 func2loop.setdefault(function, []).append(i)
 
+    # walk up the enclosing loops of the loops
+    for loop in loops.itervalues():
+        parent = parents[loop.function, loop.header_id]
+        while parent != '0' and len(loop.outer_ids) < len(parents):
+            loop.outer_ids.insert(0, parent)
+            parent = parents.get((loop.function, parent), '0')
+
     # figure out loop nesting
     with open(config.graph_profile) as graph:
         while True:
@@ -109,6 +144,56 @@ def get_loops():
     return loops, func2loop
 
 
+# `get_loops` from a packed profile, looking only at the loops that matter
+def get_packed_loops(pack):
+    func2loop = {}
+    loops = {}
+    nodes = pack.nodes
+
+    # mapping (function, header id) -> header id of the enclosing loop, by the
+    # offsets of the function names, which are interned
+    is_loop = nodes['header_id'] != 0
+    parents = dict(zip(zip(nodes['function'][is_loop],
+        nodes['header_id'][is_loop]), nodes['parent_id'][is_loop]))
+
+    candidates = is_loop & (nodes['time'] > 0)
+    if 'off-cpu(ms)' in pack.columns:
+        on_cpu = pack.columns['on-cpu(ms)']
+        off_cpu = pack.columns['off-cpu(ms)']
+        candidates &= off_cpu * 100 <= OFF_CPU_UPPERBOUND * (on_cpu + off_cpu)
+
+    for i in np.flatnonzero(candidates):
+        i = int(i)
+        node = nodes[i]
+        # walk up the enclosing loops
+        outer_ids = []
+        parent = node['parent_id']
+        while parent != 0 and len(outer_ids) < len(parents):
+            outer_ids.insert(0, str(parent))
+            parent = parents.get((node['function'], parent), 0)
+        function = pack.string(node['function'])
+        loops[i] = Loop(time=float(node['time']),
+                time_lo=float(node['time_lo']),
+                header_id=str(node['header_id']),
+                outer_ids=outer_ids,
+                fingerprint=('%016x' % node['fingerprint']
+                             if node['fingerprint'] else ''),
+                function=function,
+                nested=list(),
+                runs=int(node['runs']),
+                idx=i)
+        func2loop.setdefault(function, []).append(i)
+
+    # figure out loop nesting
+    idxs = np.array(sorted(loops), dtype=np.uint32)
+    edges = pack.edges
+    nesting = edges[np.in1d(edges['from'], idxs) & np.in1d(edges['to'], idxs)]
+    for src, dest in zip(nesting['from'], nesting['to']):
+        loops[int(src)].nested.append(int(dest))
+
+    return loops, func2loop
+
+
 # in the presence of cycles, this assign arbitrary ordering
 # to portions of the loops that are cyclic
 def topological_sort(loops):
@@ -142,9 +227,22 @@ def find_candidate_loops(loops):
         if i in disqualified:
             continue
         loop = loops[i]
-        if loop.time >= TUNING_LOWERBOUND and loop.time <= TUNING_UPPERBOUND:
-            candidates.append(loop)
+        # only take loops that are above the threshold with 95% confidence
+        if loop.time_lo >= TUNING_LOWERBOUND and loop.time <= TUNING_UPPERBOUND:
             disqualified.update(loop.nested)
+            # go down to the loop nested in it that takes nearly all its time
+            found = True
+            while found:
+                found = False
+                for j in loop.nested:
+                    inner = loops[j]
+                    if (inner.function == loop.function and
+                            loop.header_id in inner.outer_ids and
+                            inner.time * 100 >= loop.time * INNER_SHARE):
+                        loop = inner
+                        found = True
+                        break
+            candidates.append(loop)
 
     return candidates
 
@@ -261,11 +359,15 @@ def create_server(server_lib, modules, func, invos):
 # "client" for extract-loops tool
 # return a list of extracted modules (with the first one being the globals module and the second one being the main modules)
 # and a mapping from extracted modules to its top-level extracted loop (a function)
-def extract(module, candidates):
-    call('{tunerpath}/bin/extract-loops {module} -p extracted {loops}'.format(
+# loops are found by fingerprint only if `fingerprints` is set
+def extract(module, candidates, block_map=None, fingerprints=True):
+    call('{tunerpath}/bin/extract-loops {module} -p extracted {block_map}{loops}'.format(
         tunerpath=config.tunerpath,
         module=module,
-        loops=' '.join('-l%s,%s' % (l.function, l.header_id) for l in candidates)))
+        block_map='-block-map %s ' % block_map if block_map else '',
+        loops=' '.join('-l%s,%s%s' % (l.function, '/'.join(l.outer_ids + [l.header_id]),
+            '#' + l.fingerprint if fingerprints and l.fingerprint else '')
+            for l in candidates)))
     extracted_modules = []
     extracted_loops = {}
     with open('extracted.list') as extraction_out:
@@ -367,7 +469,42 @@ if __name__ == '__main__':
     # now extract candidate loops
     provided_makefile = config.makefile
     provided_bc = config.input
-    extracted_modules, extracted_loops = extract(provided_bc, candidates)
+    to_extract = provided_bc
+    if config.specialize:
+        # the loops keep their header ids, but a versioned loop and the
+        # loops around it get new fingerprints
+        to_extract = get_temp()
+        # the values were recorded next to the flat profile
+        prof_dir = os.path.dirname(config.flat_profile)
+        call('{tunerpath}/bin/specialize-loops {input} -o {output}{prefix}'.format(
+            tunerpath=config.tunerpath,
+            input=provided_bc,
+            output=to_extract,
+            prefix=' -prof-prefix %s/' % prof_dir if prof_dir else ''))
+    # lay out the blocks along their hottest edges, if they were counted.
+    # The edge counts are by the blocks' ids in the profiled module, so
+    # this comes before the extraction and -O3 rename and reorder them;
+    # the loops are then found by the ids they had when profiled.
+    block_map = None
+    if os.path.exists(config.edge_profile):
+        laid_out = get_temp()
+        block_map = get_temp()
+        call('{tunerpath}/bin/reorder-functions {input} -o {output} -edge-profile {prof} -block-map {block_map}'.format(
+            tunerpath=config.tunerpath,
+            input=to_extract,
+            output=laid_out,
+            prof=config.edge_profile,
+            block_map=block_map))
+        if to_extract != provided_bc:
+            delete_temp(to_extract)
+        to_extract = laid_out
+    extracted_modules, extracted_loops = extract(
+            to_extract, candidates, block_map,
+            fingerprints=not config.specialize)
+    if to_extract != provided_bc:
+        delete_temp(to_extract)
+    if block_map is not None:
+        delete_temp(block_map)
 
     print 'extracted module(s):', ' '.join(extracted_modules[1:])
 